@@ -9,7 +9,7 @@ make all
 mkdir -p bin/run/document_root
 mkdir -p bin/run/db
 
-cp -f bin/db/kws.db bin/run/db
+cp -f bin/db/kws.db bin/db/kws.db.vocab bin/run/db
 cp -f bin/cgi/* bin/run/document_root
 cp -rf static bin/run/document_root
 
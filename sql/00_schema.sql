@@ -20,4 +20,7 @@ CREATE TABLE keywords
     FOREIGN KEY (qid) REFERENCES questions(qid)
 );
 
-CREATE INDEX kw_index ON keywords (keyword);
\ No newline at end of file
+CREATE INDEX kw_index ON keywords (keyword);
+
+CREATE INDEX answers_qid_index ON answers (qid);
+PRAGMA user_version = 1;
@@ -0,0 +1,24 @@
+CREATE VIEW kw_fts_source AS
+    SELECT q.qid AS qid, q.question AS question, a.answers AS answers, k.keywords AS keywords
+    FROM questions AS q
+    LEFT JOIN
+    (
+        SELECT qid, group_concat(answer, ' ') AS answers FROM answers GROUP BY qid
+    ) AS a ON (a.qid = q.qid)
+    LEFT JOIN
+    (
+        SELECT qid, group_concat(keyword, ' ') AS keywords FROM keywords GROUP BY qid
+    ) AS k ON (k.qid = q.qid);
+
+CREATE VIRTUAL TABLE kw_fts USING fts5
+(
+    question,
+    answers,
+    keywords,
+    content = 'kw_fts_source',
+    content_rowid = 'qid',
+    prefix = '2 3',
+    tokenize = 'unicode61 remove_diacritics 2'
+);
+
+INSERT INTO kw_fts (kw_fts) VALUES ('rebuild');
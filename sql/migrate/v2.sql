@@ -0,0 +1,57 @@
+/*
+ * Schema v1 -> v2. Keyword strings are stored once in vocab and the
+ * (kid, qid) pairs are clustered in a WITHOUT ROWID table, so a keyword
+ * lookup reads its postings without a rowid lookup per hit. The answers
+ * index covers (qid, aid, answer), so answer fetches never touch the
+ * answers table itself.
+ */
+
+BEGIN;
+
+CREATE TABLE vocab
+(
+    kid INTEGER NOT NULL PRIMARY KEY,
+    keyword VARCHAR(128) NOT NULL UNIQUE
+);
+
+CREATE TABLE postings
+(
+    kid INTEGER NOT NULL,
+    qid INTEGER NOT NULL,
+    PRIMARY KEY (kid, qid),
+    FOREIGN KEY (kid) REFERENCES vocab(kid),
+    FOREIGN KEY (qid) REFERENCES questions(qid)
+) WITHOUT ROWID;
+
+INSERT INTO vocab (keyword)
+    SELECT DISTINCT keyword FROM keywords WHERE keyword IS NOT NULL ORDER BY keyword;
+
+INSERT OR IGNORE INTO postings (kid, qid)
+    SELECT v.kid, k.qid FROM keywords AS k INNER JOIN vocab AS v ON (v.keyword = k.keyword);
+
+DROP VIEW IF EXISTS kw_fts_source;
+
+CREATE VIEW kw_fts_source AS
+    SELECT q.qid AS qid, q.question AS question, a.answers AS answers, k.keywords AS keywords
+    FROM questions AS q
+    LEFT JOIN
+    (
+        SELECT qid, group_concat(answer, ' ') AS answers FROM answers GROUP BY qid
+    ) AS a ON (a.qid = q.qid)
+    LEFT JOIN
+    (
+        SELECT p.qid AS qid, group_concat(v.keyword, ' ') AS keywords
+        FROM postings AS p INNER JOIN vocab AS v ON (v.kid = p.kid) GROUP BY p.qid
+    ) AS k ON (k.qid = q.qid);
+
+DROP TABLE keywords;
+
+DROP INDEX IF EXISTS answers_qid_index;
+
+CREATE INDEX answers_qid_index ON answers (qid, aid, answer);
+
+PRAGMA user_version = 2;
+
+COMMIT;
+
+VACUUM;
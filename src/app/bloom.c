@@ -0,0 +1,237 @@
+/*
+ * bloom.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bloom.h"
+
+#define BLOOM_FILE_MAGIC        "KWSBLOOM"
+#define BLOOM_FILE_VERSION      1
+#define BLOOM_FILE_BYTE_ORDER   0x01020304
+
+#define BLOOM_BLOCK_WORDS       8
+
+struct bloom_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n_blocks;
+    uint32_t reserved;
+    uint64_t stamp;
+};
+
+/* odd constants, one per word of a block */
+static const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] =
+{
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+/*
+ * FNV-1a, finished with the murmur3 mixer so every bit of the result
+ * depends on the whole key.
+ */
+static uint64_t bloom_hash(const char *key)
+{
+    const unsigned char *p = (const unsigned char *)key;
+
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (*p != '\0') {
+        h ^= *(p++);
+        h *= 0x100000001b3ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/*
+ * The high half of the hash picks the block, the low half the bit in
+ * each of its words.
+ */
+static uint32_t *bloom_get_block(const struct bloom *bloom, uint64_t h)
+{
+    return bloom->blocks + ((h >> 32) * bloom->n_blocks >> 32) * BLOOM_BLOCK_WORDS;
+}
+
+static uint32_t bloom_get_bit(uint64_t h, int i)
+{
+    return (uint32_t)1 << (((uint32_t)h * bloom_salts[i]) >> 27);
+}
+
+struct bloom *bloom_new(uint64_t n_keys)
+{
+    struct bloom *bloom;
+
+    uint64_t n_blocks = (n_keys * BLOOM_BITS_PER_KEY + BLOOM_BLOCK_WORDS * 32 - 1) / (BLOOM_BLOCK_WORDS * 32);
+
+    if (n_blocks == 0)
+        n_blocks = 1;
+
+    if (n_blocks > UINT32_MAX / BLOOM_BLOCK_WORDS)
+        return NULL;
+
+    if ((bloom = calloc(1, sizeof(struct bloom))) == NULL)
+        return NULL;
+
+    bloom->n_blocks = n_blocks;
+    bloom->blocks = calloc(n_blocks * BLOOM_BLOCK_WORDS, sizeof(uint32_t));
+
+    if (bloom->blocks == NULL) {
+        free(bloom);
+        return NULL;
+    }
+
+    return bloom;
+}
+
+void bloom_add(struct bloom *bloom, const char *key)
+{
+    uint64_t h = bloom_hash(key);
+
+    uint32_t *block = bloom_get_block(bloom, h);
+
+    int i;
+
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        block[i] |= bloom_get_bit(h, i);
+}
+
+bool bloom_may_contain(const struct bloom *bloom, const char *key)
+{
+    uint64_t h = bloom_hash(key);
+
+    const uint32_t *block = bloom_get_block(bloom, h);
+
+    uint32_t missing = 0;
+
+    int i;
+
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        missing |= bloom_get_bit(h, i) & ~block[i];
+
+    return missing == 0;
+}
+
+bool bloom_save(struct bloom *bloom, const char *path)
+{
+    struct bloom_file_header header;
+
+    char *tmp_path;
+
+    FILE *fp;
+
+    bool ok;
+
+    bzero(&header, sizeof(header));
+
+    memcpy(header.magic, BLOOM_FILE_MAGIC, sizeof(header.magic));
+
+    header.version = BLOOM_FILE_VERSION;
+    header.byte_order = BLOOM_FILE_BYTE_ORDER;
+    header.n_blocks = bloom->n_blocks;
+    header.stamp = bloom->stamp;
+
+    tmp_path = alloca(strlen(path) + 5);
+
+    sprintf(tmp_path, "%s.tmp", path);
+
+    if ((fp = fopen(tmp_path, "wb")) == NULL)
+        return false;
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(bloom->blocks, BLOOM_BLOCK_WORDS * sizeof(uint32_t), bloom->n_blocks, fp) == bloom->n_blocks;
+
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Maps a filter written by bloom_save(), shared and read only.
+ */
+struct bloom *bloom_map(const char *path)
+{
+    int fd;
+
+    struct stat st;
+    struct bloom_file_header *header;
+    struct bloom *bloom;
+
+    uint8_t *base;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct bloom_file_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    header = (struct bloom_file_header *)base;
+    bloom = calloc(1, sizeof(struct bloom));
+
+    if (bloom == NULL)
+        goto error;
+
+    if (memcmp(header->magic, BLOOM_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BLOOM_FILE_VERSION || header->byte_order != BLOOM_FILE_BYTE_ORDER ||
+        header->n_blocks == 0 ||
+        (uint64_t)st.st_size != sizeof(*header) + (uint64_t)header->n_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t))
+        goto error;
+
+    bloom->n_blocks = header->n_blocks;
+    bloom->blocks = (uint32_t *)(base + sizeof(*header));
+    bloom->stamp = header->stamp;
+    bloom->map_base = base;
+    bloom->map_size = st.st_size;
+
+    return bloom;
+
+error:
+    free(bloom);
+
+    munmap(base, st.st_size);
+
+    return NULL;
+}
+
+void bloom_free(struct bloom *bloom)
+{
+    if (bloom == NULL)
+        return;
+
+    if (bloom->map_base != NULL)
+        munmap(bloom->map_base, bloom->map_size);
+    else
+        free(bloom->blocks);
+
+    free(bloom);
+}
@@ -0,0 +1,40 @@
+/*
+ * bloom.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Split block Bloom filter over strings. Each key sets one bit in each of
+ * the 8 words of a single 32 byte block, so a lookup touches one cache
+ * line. There are no false negatives; at BLOOM_BITS_PER_KEY about 0.1%
+ * of absent keys pass.
+ */
+#define BLOOM_BITS_PER_KEY      16
+
+struct bloom
+{
+    uint32_t n_blocks;
+    uint32_t *blocks;
+
+    /* caller-defined, saved with the filter (e.g. the source it was built from) */
+    uint64_t stamp;
+
+    void *map_base;
+    size_t map_size;
+};
+
+struct bloom *bloom_new(uint64_t n_keys);
+
+void bloom_add(struct bloom *bloom, const char *key);
+
+bool bloom_may_contain(const struct bloom *bloom, const char *key);
+
+bool bloom_save(struct bloom *bloom, const char *path);
+
+struct bloom *bloom_map(const char *path);
+
+void bloom_free(struct bloom *bloom);
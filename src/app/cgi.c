@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <unistd.h>
 #include <sys/random.h>
 
 #include "cgi.h"
@@ -16,16 +17,28 @@
 #include "html.h"
 #include "db.h"
 
-int _cgi_http_status = 200;
-char _cgi_http_status_buf[12], *_cgi_http_status_str;
-enum http_content_type _cgi_http_content_type = HTTP_CONTENT_TYPE_TEXT_HTML;
-bool _cgi_exit, _cgi_malicious;
+#include <jx_value.h>
+
+/*
+ * Request state is thread-local so that servers can run requests on
+ * several threads at once.
+ */
+__thread int _cgi_http_status = 200;
+__thread char _cgi_http_status_buf[12], *_cgi_http_status_str;
+__thread enum http_content_type _cgi_http_content_type = HTTP_CONTENT_TYPE_TEXT_HTML;
+__thread bool _cgi_exit, _cgi_malicious;
 
 extern char **environ;
 
-static FILE *content_stream;
-static char *content_ptr;
-static size_t content_size;
+static __thread FILE *content_stream;
+static __thread char *content_ptr;
+static __thread size_t content_size;
+static __thread char content_last;
+
+static __thread jx_value *request_params;
+static __thread const char *request_input;
+static __thread size_t request_input_size, request_input_pos;
+static __thread FILE *request_output;
 
 static const char *content_type_strings[HTTP_CONTENT_TYPE_GUARD] =
 {
@@ -39,6 +52,74 @@ const char *cgi_get_ctype_string(enum http_content_type ctype)
     return content_type_strings[ctype];
 }
 
+void cgi_set_request(jx_value *params, const char *input, size_t input_size, FILE *output)
+{
+    request_params = params;
+    request_input = input;
+    request_input_size = input_size;
+    request_input_pos = 0;
+    request_output = output;
+
+    _cgi_http_status = 200;
+    _cgi_http_status_str = NULL;
+    _cgi_http_content_type = HTTP_CONTENT_TYPE_TEXT_HTML;
+    _cgi_exit = false;
+    _cgi_malicious = false;
+}
+
+void cgi_clear_request()
+{
+    cgi_set_request(NULL, NULL, 0, NULL);
+}
+
+const char *cgi_getenv(const char *key)
+{
+    if (request_params != NULL)
+        return jxd_get_string(request_params, (char *)key, NULL);
+
+    return getenv(key);
+}
+
+/*
+ * Fails once more than CGI_MAX_INPUT_SIZE bytes have been read.
+ */
+ssize_t cgi_read_input(void *buf, size_t size)
+{
+    ssize_t r;
+
+    size_t n;
+
+    if (request_params == NULL) {
+        if (request_input_pos > CGI_MAX_INPUT_SIZE)
+            return -1;
+
+        if (size > CGI_MAX_INPUT_SIZE + 1 - request_input_pos)
+            size = CGI_MAX_INPUT_SIZE + 1 - request_input_pos;
+
+        if ((r = read(0, buf, size)) > 0)
+            request_input_pos += r;
+
+        return (request_input_pos > CGI_MAX_INPUT_SIZE) ? -1 : r;
+    }
+
+    n = request_input_size - request_input_pos;
+
+    if (n > size)
+        n = size;
+
+    if (n > 0)
+        memcpy(buf, request_input + request_input_pos, n);
+
+    request_input_pos += n;
+
+    return n;
+}
+
+FILE *cgi_get_output()
+{
+    return (request_output != NULL) ? request_output : stdout;
+}
+
 bool cgi_is_debug()
 {
     return true;
@@ -51,7 +132,7 @@ bool cgi_is_prod()
 
 const char *cgi_server()
 {
-    const char *server_info = getenv("SERVER_SOFTWARE");
+    const char *server_info = cgi_getenv("SERVER_SOFTWARE");
 
     if (server_info == NULL)
         return "unknown";
@@ -66,7 +147,7 @@ const char *cgi_server()
 
 bool cgi_server_is_apache()
 {
-    const char *server_info = getenv("SERVER_SOFTWARE");
+    const char *server_info = cgi_getenv("SERVER_SOFTWARE");
 
     if (server_info == NULL)
         return false;
@@ -76,7 +157,7 @@ bool cgi_server_is_apache()
 
 bool cgi_server_is_node()
 {
-    const char *server_info = getenv("SERVER_SOFTWARE");
+    const char *server_info = cgi_getenv("SERVER_SOFTWARE");
 
     if (server_info == NULL)
         return false;
@@ -91,6 +172,7 @@ bool cgi_open_stream()
     }
 
     content_stream = open_memstream(&content_ptr, &content_size);
+    content_last = '\0';
 
     return content_stream != NULL;
 }
@@ -126,6 +208,7 @@ bool cgi_close_stream()
 
     free(content_ptr);
 
+    content_stream = NULL;
     content_ptr = NULL;
     content_size = 0;
 
@@ -134,8 +217,6 @@ bool cgi_close_stream()
 
 bool cgi_printf(const char *fmt, ...)
 {
-    static char last;
-
     va_list ap;
 
     char *buf;
@@ -161,12 +242,12 @@ bool cgi_printf(const char *fmt, ...)
             *buf = ' ';
         }
 
-        if (last == ' ' && *buf == ' ') {
+        if (content_last == ' ' && *buf == ' ') {
             buf++;
             continue;
         }
 
-        last = *buf;
+        content_last = *buf;
 
         fputc(*buf, content_stream);
 
@@ -203,22 +284,26 @@ void cgi_begin_http_headers()
 {
     const char *ctype_string = cgi_get_ctype_string(_cgi_http_content_type);
 
-    printf("Status: %d\n", _cgi_http_status);
-    printf("Content-Type: %s\n", ctype_string);
+    FILE *out = cgi_get_output();
+
+    fprintf(out, "Status: %d\n", _cgi_http_status);
+    fprintf(out, "Content-Type: %s\n", ctype_string);
 }
 
 void cgi_end_http_headers()
 {
-    printf("Content-Length: %lu\n", content_size);
-    printf("Cache-Control: no-store\n");
-    printf("\n");
+    FILE *out = cgi_get_output();
+
+    fprintf(out, "Content-Length: %lu\n", content_size);
+    fprintf(out, "Cache-Control: no-store\n");
+    fprintf(out, "\n");
 }
 
 const char *cgi_get_cookie_domain()
 {
-    char *base, *top;
+    const char *base, *top;
 
-    base = getenv("SERVER_NAME");
+    base = cgi_getenv("SERVER_NAME");
 
     if (base == NULL)
         return NULL;
@@ -246,37 +331,39 @@ const char *cgi_get_cookie_domain()
 
 bool cgi_set_cookie(const char *name, const char *value, const char *domain, unsigned long max_age, bool secure)
 {
+    FILE *out = cgi_get_output();
+
     if (name == NULL || value == NULL)
         return false;
 
-    printf("Set-Cookie: %s=%s; Path=/; Max-Age=%lu", name, value, max_age);
+    fprintf(out, "Set-Cookie: %s=%s; Path=/; Max-Age=%lu", name, value, max_age);
 
     if (domain == NULL) {
         domain = cgi_get_cookie_domain();
     }
 
     if (domain != NULL) {
-        printf("; Domain=%s", domain);
+        fprintf(out, "; Domain=%s", domain);
     }
 
     if (secure) {
-        printf("; Secure");
+        fprintf(out, "; Secure");
     }
 
-    printf("\n");
+    fprintf(out, "\n");
 
     return true;
 }
 
 bool cgi_get_cookie(char *dst, size_t size, const char *name)
 {
-    const char *http_cookie = getenv("HTTP_COOKIE");
+    const char *http_cookie = cgi_getenv("HTTP_COOKIE");
     return util_lookup_value_in_kv_string(http_cookie, dst, size, name, ";");
 }
 
 bool cgi_get_string_from_query_string(char *dst, size_t size, const char *key)
 {
-    const char *query_str = getenv("QUERY_STRING");
+    const char *query_str = cgi_getenv("QUERY_STRING");
     return util_lookup_value_in_kv_string(query_str, dst, size, key, "&");
 }
 
@@ -324,11 +411,94 @@ exit:
     return r;
 }
 
+void cgi_dump_param(const char *key, jx_value *value, void *ptr)
+{
+    cgi_printf("<b>%s=%s<br/>", key, jxs_get_str(value));
+}
+
 void cgi_dump_env()
 {
     int i;
 
+    if (request_params != NULL) {
+        jxd_iterate(request_params, cgi_dump_param, NULL);
+        return;
+    }
+
     for (i = 0; environ[i] != NULL; i++) {
         cgi_printf("<b>%s<br/>", environ[i]);
     }
-}
\ No newline at end of file
+}
+bool cgi_should_dumpenv()
+{
+    return cgi_is_debug() && cgi_get_int_from_query_string("dumpenv", NULL) == 1;
+}
+
+void cgi_send_error_response(const char *err_msg)
+{
+    _cgi_exit = true;
+
+    cgi_set_status(500);
+    
+    cgi_set_content_type(HTTP_CONTENT_TYPE_TEXT_PLAIN);
+
+    cgi_begin_http_headers();
+
+    cgi_open_stream();
+
+    cgi_printf(err_msg);
+
+    cgi_end_http_headers();
+
+    cgi_dump_stream(cgi_get_output());
+
+    cgi_close_stream();
+}
+
+void cgi_send_redirect_response(const char *url)
+{
+    FILE *out = cgi_get_output();
+
+    _cgi_exit = true;
+
+    fprintf(out, "Status: 302\n");
+    fprintf(out, "Location: %s\n", url);
+    fprintf(out, "\n"); 
+}
+
+void cgi_handle_request(const struct cgi_handler *handler)
+{
+    cgi_open_stream();
+
+    cgi_set_status(200);
+
+    handler->begin();
+
+    if (_cgi_exit) {
+        return;
+    }
+
+    if (cgi_should_dumpenv()) {
+        cgi_dump_env();
+    }
+
+    handler->main();
+
+    if (_cgi_exit) {
+        return;
+    }
+
+    handler->end();
+
+    if (_cgi_exit) {
+        return;
+    }
+
+    cgi_begin_http_headers();
+
+    cgi_end_http_headers();
+
+    cgi_dump_stream(cgi_get_output());
+
+    cgi_close_stream();
+}
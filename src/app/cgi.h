@@ -9,6 +9,19 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+struct jx_value_t;
+typedef struct jx_value_t jx_value;
+
+/* largest request body accepted, by plain CGI, FastCGI and kwsd alike */
+#define CGI_MAX_INPUT_SIZE  (1024 * 1024)
+
+struct cgi_handler
+{
+    void (*begin)();
+    void (*main)();
+    void (*end)();
+};
+
 enum http_content_type
 {
     HTTP_CONTENT_TYPE_TEXT_PLAIN,
@@ -17,6 +30,16 @@ enum http_content_type
     HTTP_CONTENT_TYPE_GUARD
 };
 
+void cgi_set_request(jx_value *params, const char *input, size_t input_size, FILE *output);
+
+void cgi_clear_request();
+
+const char *cgi_getenv(const char *key);
+
+ssize_t cgi_read_input(void *buf, size_t size);
+
+FILE *cgi_get_output();
+
 bool cgi_is_prod();
 
 bool cgi_is_debug();
@@ -61,6 +84,8 @@ void cgi_send_redirect_response(const char *url);
 
 void cgi_send_error_response(const char *err_msg);
 
+void cgi_handle_request(const struct cgi_handler *handler);
+
 void cgi_begin();
 
 void cgi_main();
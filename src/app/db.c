@@ -8,390 +8,1907 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "db.h"
+#include "bloom.h"
+#include "kwidx.h"
+#include "mph.h"
+#include "rank.h"
+#include "tok.h"
 
-#include <jx_value.h>
+#include <jx_util.h>
 
 #define DB_PATH_SIZE            1024
 #define DB_ERROR_MSG_SIZE       1024
 
-static sqlite3 *db;
+#define DB_SCHEMA_VERSION       2
+
+#define DB_SERVING_MMAP_SIZE    1073741824
+#define DB_SERVING_CACHE_SIZE   -65536
+
+enum db_action
+{
+    DB_ACTION_GET_KW_LIST_EXACT_MATCH,
+    DB_ACTION_GET_KW_LIST_LIKE_MATCH,
+    DB_ACTION_GET_KW_QIDS,
+    DB_ACTION_GET_KW_QIDS_LIKE,
+    DB_ACTION_GET_QUESTIONS,
+    DB_ACTION_GET_ANSWERS,
+    DB_ACTION_GET_FTS_MATCH_CNT,
+    DB_ACTION_GET_FTS_QIDS,
+    DB_ACTION_GET_FTS_QIDS_AFTER,
+    DB_ACTION_INSERT_QUESTION,
+    DB_ACTION_INSERT_ANSWER,
+    DB_ACTION_INSERT_VOCAB,
+    DB_ACTION_INSERT_KEYWORD,
+    DB_ACTION_GUARD
+};
+
+/*
+ * Statements that take a list (keyword filters, question and answer
+ * fetches) take it as a JSON array through json_each(), so they are
+ * prepared once whatever the list length.
+ */
+static const char *db_stmt_sql[DB_ACTION_GUARD] =
+{
+    "SELECT t.value FROM json_each(?) AS t "
+    "WHERE EXISTS (SELECT 1 FROM keywords WHERE keyword = t.value) ORDER BY t.key;",
+    "SELECT t.value FROM json_each(?) AS t "
+    "WHERE EXISTS (SELECT 1 FROM keywords WHERE keyword LIKE '%' || t.value || '%') ORDER BY t.key;",
+    "SELECT qid FROM keywords WHERE keyword IN (SELECT value FROM json_each(?));",
+    "SELECT DISTINCT k.qid, t.key FROM json_each(?) AS t "
+    "INNER JOIN keywords AS k ON (k.keyword LIKE '%' || t.value || '%');",
+    "SELECT t.key, qt.question FROM json_each(?) AS t "
+    "INNER JOIN questions AS qt ON (qt.qid = t.value) ORDER BY t.key;",
+    "SELECT t.key, at.answer FROM json_each(?) AS t "
+    "INNER JOIN answers AS at ON (at.qid = t.value) ORDER BY t.key, at.aid;",
+    "SELECT COUNT(*) FROM json_each(?) AS t "
+    "WHERE EXISTS (SELECT 1 FROM kw_fts WHERE kw_fts MATCH '\"' || replace(t.value, '\"', '\"\"') || '\"*');",
+    "SELECT rowid, bm25(kw_fts) AS score FROM kw_fts WHERE kw_fts MATCH ? "
+    "ORDER BY score, rowid LIMIT ? OFFSET ?;",
+    "SELECT qid, score FROM "
+    "(SELECT rowid AS qid, bm25(kw_fts) AS score FROM kw_fts WHERE kw_fts MATCH ?1) "
+    "WHERE score > ?2 OR (score = ?2 AND qid > ?3) "
+    "ORDER BY score, qid LIMIT ?4;",
+    "INSERT INTO questions (question) VALUES (?);",
+    "INSERT INTO answers (qid, answer) VALUES (?, ?);",
+    NULL,
+    "INSERT INTO keywords (qid, keyword) VALUES (?, ?);"
+};
+
+/*
+ * Schema v2 (sql/migrate/v2.sql) replaces the keywords table with vocab
+ * and postings. Actions that read keywords have a v2 form here; the rest
+ * run unchanged on both schemas.
+ */
+static const char *db_stmt_sql_v2[DB_ACTION_GUARD] =
+{
+    [DB_ACTION_GET_KW_LIST_EXACT_MATCH] =
+    "SELECT t.value FROM json_each(?) AS t "
+    "WHERE EXISTS (SELECT 1 FROM vocab WHERE keyword = t.value) ORDER BY t.key;",
+    [DB_ACTION_GET_KW_LIST_LIKE_MATCH] =
+    "SELECT t.value FROM json_each(?) AS t "
+    "WHERE EXISTS (SELECT 1 FROM vocab WHERE keyword LIKE '%' || t.value || '%') ORDER BY t.key;",
+    [DB_ACTION_GET_KW_QIDS] =
+    "SELECT p.qid FROM vocab AS v INNER JOIN postings AS p ON (p.kid = v.kid) "
+    "WHERE v.keyword IN (SELECT value FROM json_each(?));",
+    [DB_ACTION_GET_KW_QIDS_LIKE] =
+    "SELECT DISTINCT p.qid, t.key FROM json_each(?) AS t "
+    "INNER JOIN vocab AS v ON (v.keyword LIKE '%' || t.value || '%') INNER JOIN postings AS p ON (p.kid = v.kid);",
+    [DB_ACTION_INSERT_VOCAB] =
+    "INSERT OR IGNORE INTO vocab (keyword) VALUES (?);",
+    [DB_ACTION_INSERT_KEYWORD] =
+    "INSERT OR IGNORE INTO postings (kid, qid) SELECT kid, ?1 FROM vocab WHERE keyword = ?2;"
+};
+
+/*
+ * Everything tied to a single connection. Each thread that talks to the
+ * database owns one context; single-threaded programs use the default.
+ */
+struct db_context
+{
+    sqlite3 *db;
+    int rc;
+    bool in_transaction;
+    bool open_deferred;
+    int schema_version;
+    char error_msg[DB_ERROR_MSG_SIZE];
+    sqlite3_stmt *stmt_cache[DB_ACTION_GUARD];
+
+    /* vocabulary filter, and the stamp of the .vocab file it was mapped from */
+    struct bloom *vocab_filter;
+    uint64_t vocab_file_stamp;
+};
+
 static char db_path[DB_PATH_SIZE];
-static char db_error_msg[DB_ERROR_MSG_SIZE];
-static int db_rc = SQLITE_OK;
-static bool _db_in_transaction = false;
 
-enum db_status
+/* synchronous setting to restore at db_ingest_end() */
+static char db_ingest_synchronous[16] = "FULL";
+
+/*
+ * Connection profile, chosen once at startup. The serving profiles open
+ * every connection read-only and tune it for a search-only workload;
+ * immutable also tells SQLite the file never changes, so reads take no
+ * locks at all.
+ */
+enum db_profile
+{
+    DB_PROFILE_DEFAULT,
+    DB_PROFILE_SERVING,
+    DB_PROFILE_IMMUTABLE
+};
+
+static const char *db_profile_names[] = { "default", "serving", "immutable" };
+
+static enum db_profile db_profile;
+static long long db_prewarmed = -1;
+
+/* Read-only once loaded, so it is shared by every context. */
+static struct kwidx *db_index;
+static struct db_context db_default_context = { .rc = SQLITE_OK };
+static __thread struct db_context *db_cntx = &db_default_context;
+
+void db_set_error_msg(const char *fmt, ...);
+bool db_check_open();
+enum db_status db_exec_sql(const char *sql);
+bool db_get_pragma(const char *name, char *buf, size_t size);
+sqlite3_stmt *db_get_stmt(enum db_action action);
+void db_clear_cache();
+bool db_bind_null(sqlite3_stmt *stmt, int index);
+bool db_bind_text(sqlite3_stmt *stmt, int index, const char *str);
+bool db_bind_int(sqlite3_stmt *stmt, int index, int value);
+bool db_bind_double(sqlite3_stmt *stmt, int index, double value);
+bool db_bind_int_foreign_key(sqlite3_stmt *stmt, int index, int value);
+int db_step(sqlite3_stmt *stmt);
+bool db_reset(sqlite3_stmt *stmt);
+bool db_finalize(sqlite3_stmt *stmt);
+
+typedef bool (*db_row_cb)(sqlite3_stmt *stmt, void *ptr);
+
+bool db_for_each_row(const char *sql, db_row_cb cb, void *ptr);
+
+struct db_token
+{
+    char *str;
+    size_t pos;
+    bool dup;
+};
+
+struct db_token_set
+{
+    struct db_token *tokens;
+    size_t n, capacity;
+};
+
+bool db_add_token(char *token, void *ptr)
+{
+    struct db_token_set *set = ptr;
+
+    struct db_token *tokens;
+
+    if (strlen(token) > TOK_MAX_LENGTH)
+        return true;
+
+    if (set->n == set->capacity) {
+        set->capacity = (set->capacity == 0) ? 16 : set->capacity * 2;
+
+        if ((tokens = realloc(set->tokens, set->capacity * sizeof(struct db_token))) == NULL)
+            return false;
+
+        set->tokens = tokens;
+    }
+
+    if ((set->tokens[set->n].str = strdup(token)) == NULL)
+        return false;
+
+    set->tokens[set->n].pos = set->n;
+    set->tokens[set->n].dup = false;
+    set->n++;
+
+    return true;
+}
+
+int db_compare_tokens(const void *a, const void *b)
+{
+    const struct db_token *x = a, *y = b;
+
+    int r = strcmp(x->str, y->str);
+
+    return (r != 0) ? r : (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+int db_compare_token_pos(const void *a, const void *b)
+{
+    const struct db_token *x = a, *y = b;
+
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/*
+ * Splits a query into unique tokens with the shared tokenizer, in order
+ * of first appearance. Duplicates are found by sorting, so the cost does
+ * not depend on token length.
+ */
+jx_value *db_get_tokens(const char *query)
+{
+    struct db_token_set set = { 0 };
+
+    jx_value *tokens;
+
+    size_t i;
+
+    tok_split(query, db_add_token, &set);
+
+    qsort(set.tokens, set.n, sizeof(struct db_token), db_compare_tokens);
+
+    for (i = 1; i < set.n; i++)
+        set.tokens[i].dup = strcmp(set.tokens[i].str, set.tokens[i - 1].str) == 0;
+
+    qsort(set.tokens, set.n, sizeof(struct db_token), db_compare_token_pos);
+
+    tokens = jxa_new(10);
+
+    for (i = 0; i < set.n; i++) {
+        if (!set.tokens[i].dup)
+            jxa_push(tokens, jxs_new(set.tokens[i].str));
+
+        free(set.tokens[i].str);
+    }
+
+    free(set.tokens);
+
+    return tokens;
+}
+
+void db_stamp_stat(uint64_t *stamp, const struct stat *st)
+{
+    uint64_t values[] = { st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+
+    size_t i;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        *stamp ^= values[i];
+        *stamp *= 0x100000001b3ull;
+    }
+}
+
+/*
+ * Stamps the database from the size and modification time of its file
+ * and of its -wal file, if there is one: any write changes one of them.
+ * It takes a couple of stat() calls and no SQL. The inode is left out,
+ * so the stamp survives a copy that keeps the times (cp -p).
+ */
+uint64_t db_get_file_stamp()
+{
+    char path[DB_PATH_SIZE + 8];
+
+    struct stat st;
+
+    uint64_t stamp = 0xcbf29ce484222325ull;
+
+    if (stat(db_path, &st) == 0) {
+        st.st_ino = 0;
+        db_stamp_stat(&stamp, &st);
+    }
+
+    snprintf(path, sizeof(path), "%s-wal", db_path);
+
+    if (stat(path, &st) == 0) {
+        st.st_ino = 0;
+        db_stamp_stat(&stamp, &st);
+    }
+
+    return stamp;
+}
+
+/*
+ * Returns the filter written next to the database by kws-mkvocab
+ * (<database>.vocab), if there is one and the database has not changed
+ * since it was built. The .vocab file is stat()ed on every call and mapped
+ * again when it is replaced (make vocab), so long-running processes pick
+ * up a rebuilt filter; a stale one would drop keywords added since, so it
+ * is ignored until rebuilt.
+ */
+struct bloom *db_get_vocab_filter()
+{
+    char path[DB_PATH_SIZE + 8];
+
+    struct stat st;
+
+    uint64_t file_stamp = 0;
+
+    snprintf(path, sizeof(path), "%s.vocab", db_path);
+
+    if (stat(path, &st) == 0)
+        db_stamp_stat(&file_stamp, &st);
+
+    if (file_stamp != db_cntx->vocab_file_stamp) {
+        bloom_free(db_cntx->vocab_filter);
+
+        db_cntx->vocab_filter = (file_stamp != 0) ? bloom_map(path) : NULL;
+        db_cntx->vocab_file_stamp = file_stamp;
+    }
+
+    if (db_cntx->vocab_filter == NULL || db_cntx->vocab_filter->stamp != db_get_file_stamp())
+        return NULL;
+
+    return db_cntx->vocab_filter;
+}
+
+jx_value *db_filter_tokens(struct bloom *filter, jx_value *tokens)
+{
+    jx_value *kept = jxa_new(10);
+
+    const char *token;
+
+    size_t i;
+
+    for (i = 0; i < jxa_get_length(tokens); i++) {
+        token = jxs_get_str(jxa_get(tokens, i));
+
+        if (bloom_may_contain(filter, token))
+            jxa_push(kept, jxs_new(token));
+    }
+
+    jxv_free(tokens);
+
+    return kept;
+}
+
+/*
+ * Returns the query tokens that match at least one keyword, resolved with
+ * a single statement regardless of the number of tokens. The number of
+ * query tokens is stored in n_tokens. For exact searches, tokens the
+ * vocabulary filter rules out never reach SQLite, and a query left with
+ * none runs no statement at all.
+ */
+jx_value *db_get_kw_list(struct kws_request *request, int *n_tokens)
+{
+    int rc;
+
+    char *json;
+
+    jx_value *tokens, *kw_list;
+
+    sqlite3_stmt *stmt;
+
+    struct bloom *filter;
+
+    tokens = db_get_tokens(request->query);
+
+    *n_tokens = jxa_get_length(tokens);
+
+    if (request->type == KW_SEARCH_TYPE_EXACT && *n_tokens > 0 && (filter = db_get_vocab_filter()) != NULL)
+        tokens = db_filter_tokens(filter, tokens);
+
+    if (jxa_get_length(tokens) == 0)
+        return tokens;
+
+    stmt = db_get_stmt((request->type == KW_SEARCH_TYPE_EXACT) ?
+        DB_ACTION_GET_KW_LIST_EXACT_MATCH : DB_ACTION_GET_KW_LIST_LIKE_MATCH);
+
+    json = jx_serialize_json(tokens, false);
+
+    jxv_free(tokens);
+
+    if (stmt == NULL || json == NULL) {
+        free(json);
+        return NULL;
+    }
+
+    if (!db_bind_text(stmt, 1, json)) {
+        db_set_error_msg("bind: [%s] error: [%s]", json, sqlite3_errstr(db_cntx->rc));
+        db_reset(stmt);
+        free(json);
+        return NULL;
+    }
+
+    kw_list = jxa_new(10);
+
+    while ((rc = db_step(stmt)) == SQLITE_ROW)
+        jxa_push(kw_list, jxs_new((char *)sqlite3_column_text(stmt, 0)));
+
+    db_reset(stmt);
+
+    free(json);
+
+    if (rc != SQLITE_DONE) {
+        jxv_free(kw_list);
+        return NULL;
+    }
+
+    return kw_list;
+}
+
+/*
+ * Cursor tokens are opaque to clients: the rank as a hex float and the
+ * qid, so the rank round-trips exactly.
+ */
+bool db_parse_cursor(const char *str, struct kws_cursor *cursor)
+{
+    char *end;
+
+    unsigned long qid;
+
+    cursor->set = false;
+
+    if (str == NULL || *str == '\0')
+        return false;
+
+    cursor->rank = strtod(str, &end);
+
+    if (end == str || *end != ':')
+        return false;
+
+    str = end + 1;
+    qid = strtoul(str, &end, 16);
+
+    if (end == str || *end != '\0' || qid > UINT32_MAX)
+        return false;
+
+    cursor->qid = qid;
+    cursor->set = true;
+
+    return true;
+}
+
+void db_format_cursor(struct kws_cursor *cursor, char *buf, size_t size)
+{
+    snprintf(buf, size, "%a:%x", cursor->rank, cursor->qid);
+}
+
+/*
+ * True if a question ranked (rank, qid) comes after the cursor in result
+ * order: higher ranks first, then lower qids first.
+ */
+bool db_is_after_cursor(struct kws_cursor *cursor, double rank, uint32_t qid)
+{
+    if (!cursor->set)
+        return true;
+
+    return rank < cursor->rank || (rank == cursor->rank && qid > cursor->qid);
+}
+
+/*
+ * The number of the n_tokens query tokens a question must match under
+ * the request's match mode.
+ */
+int db_get_required_matches(struct kws_request *request, int n_tokens)
+{
+    switch (request->mode) {
+    case KW_MATCH_MODE_ALL:
+        return n_tokens;
+    case KW_MATCH_MODE_MIN:
+        if (request->min_match > n_tokens)
+            return n_tokens;
+
+        return (request->min_match > 1) ? request->min_match : 1;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * One page of ranked questions, best first. Searches rank and paginate
+ * qids first, then fetch the text for exactly the page.
+ */
+struct db_page
+{
+    uint32_t *qids;
+    double *ranks;
+    size_t size, capacity;
+};
+
+bool db_page_add(struct db_page *page, uint32_t qid, double rank)
+{
+    size_t capacity;
+
+    void *qids, *ranks;
+
+    if (page->size == page->capacity) {
+        capacity = (page->capacity > 0) ? page->capacity * 2 : 16;
+
+        qids = realloc(page->qids, capacity * sizeof(uint32_t));
+
+        if (qids == NULL)
+            return false;
+
+        page->qids = qids;
+
+        ranks = realloc(page->ranks, capacity * sizeof(double));
+
+        if (ranks == NULL)
+            return false;
+
+        page->ranks = ranks;
+        page->capacity = capacity;
+    }
+
+    page->qids[page->size] = qid;
+    page->ranks[page->size] = rank;
+    page->size++;
+
+    return true;
+}
+
+/*
+ * A full page gets a cursor to resume after its last question.
+ */
+void db_set_page_cursor(struct kws_response *response, struct kws_request *request, struct db_page *page)
+{
+    if (request->page_size <= 0 || page->size < (size_t)request->page_size)
+        return;
+
+    response->cursor.rank = page->ranks[page->size - 1];
+    response->cursor.qid = page->qids[page->size - 1];
+    response->cursor.set = true;
+}
+
+void db_page_free(struct db_page *page)
+{
+    free(page->qids);
+    free(page->ranks);
+}
+
+/*
+ * Runs a list fetch statement over the page's qids. Rows come back as
+ * (position in page, text), ordered by position.
+ */
+bool db_fetch_page_rows(enum db_action action, const char *json, jx_value **objects, size_t n, bool answers)
+{
+    int rc;
+
+    size_t key;
+
+    sqlite3_stmt *stmt;
+
+    jx_value *qt_object;
+
+    stmt = db_get_stmt(action);
+
+    if (stmt == NULL)
+        return false;
+
+    if (!db_bind_text(stmt, 1, json)) {
+        db_set_error_msg("query: bind: [%s] error: [%s]", json, sqlite3_errstr(db_cntx->rc));
+        db_reset(stmt);
+        return false;
+    }
+
+    while ((rc = db_step(stmt)) == SQLITE_ROW) {
+        key = sqlite3_column_int(stmt, 0);
+
+        if (key >= n)
+            continue;
+
+        if (!answers) {
+            qt_object = jxd_new();
+
+            jxd_put_string(qt_object, "question", (char *)sqlite3_column_text(stmt, 1));
+            jxd_put(qt_object, "answers", jxa_new(10));
+
+            objects[key] = qt_object;
+        }
+        else if (objects[key] != NULL) {
+            jxa_push(jxd_get(objects[key], "answers"), jxs_new((char *)sqlite3_column_text(stmt, 1)));
+        }
+    }
+
+    db_reset(stmt);
+
+    return rc == SQLITE_DONE;
+}
+
+/*
+ * Fetches the questions of a page with one lookup, then all of their
+ * answers with a second one through the answers(qid) index, so question
+ * text is sent once per question rather than once per answer.
+ */
+jx_value *db_get_questions(struct db_page *page)
+{
+    size_t i;
+
+    char id[16];
+
+    jx_value *buf, *qt_list, **objects;
+
+    bool ok;
+
+    objects = calloc(page->size + 1, sizeof(jx_value *));
+
+    if (objects == NULL) {
+        db_set_error_msg("query: out of memory");
+        return NULL;
+    }
+
+    buf = jxs_new("[");
+
+    for (i = 0; i < page->size; i++) {
+        snprintf(id, sizeof(id), (i > 0) ? ",%u" : "%u", page->qids[i]);
+        jxs_append_str(buf, id);
+    }
+
+    jxs_push(buf, ']');
+
+    ok = db_fetch_page_rows(DB_ACTION_GET_QUESTIONS, jxs_get_str(buf), objects, page->size, false) &&
+         db_fetch_page_rows(DB_ACTION_GET_ANSWERS, jxs_get_str(buf), objects, page->size, true);
+
+    jxv_free(buf);
+
+    qt_list = ok ? jxa_new(10) : NULL;
+
+    for (i = 0; i < page->size; i++) {
+        if (objects[i] == NULL)
+            continue;
+
+        if (!ok) {
+            jxv_free(objects[i]);
+            continue;
+        }
+
+        jxd_put_number(objects[i], "rank", page->ranks[i]);
+
+        jxa_push(qt_list, objects[i]);
+    }
+
+    free(objects);
+
+    return qt_list;
+}
+
+/*
+ * Builds an FTS5 query matching any of the tokens as a prefix.
+ */
+char *db_get_fts_query(jx_value *tokens)
+{
+    jx_value *buf;
+    char *token, *query;
+    size_t i;
+
+    buf = jxs_new(NULL);
+
+    for (i = 0; i < jxa_get_length(tokens); i++) {
+        if (i > 0)
+            jxs_append_str(buf, " OR ");
+
+        jxs_push(buf, '"');
+
+        for (token = jxs_get_str(jxa_get(tokens, i)); *token != '\0'; token++) {
+            if (*token == '"')
+                jxs_push(buf, '"');
+
+            jxs_push(buf, *token);
+        }
+
+        jxs_append_str(buf, "\"*");
+    }
+
+    query = strdup(jxs_get_str(buf));
+
+    jxv_free(buf);
+
+    return query;
+}
+
+/*
+ * Counts the tokens that match at least one question in the FTS table.
+ */
+int db_get_fts_matches(jx_value *tokens)
+{
+    int r;
+
+    char *json;
+
+    sqlite3_stmt *stmt;
+
+    stmt = db_get_stmt(DB_ACTION_GET_FTS_MATCH_CNT);
+    json = jx_serialize_json(tokens, false);
+
+    if (stmt == NULL || json == NULL) {
+        free(json);
+        return -1;
+    }
+
+    if (!db_bind_text(stmt, 1, json)) {
+        db_reset(stmt);
+        free(json);
+        return -1;
+    }
+
+    r = (db_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+
+    db_reset(stmt);
+
+    free(json);
+
+    return r;
+}
+
+/*
+ * FTS5 backed search over questions, answers and keywords. Questions are
+ * ordered by bm25 and reported with rank -bm25, so higher is better like
+ * the other search types. Pages are counted in questions. With a cursor,
+ * bm25 still scores every match but nothing before the cursor is sorted
+ * past or skipped with OFFSET.
+ */
+bool db_fts_search(struct kws_response *response, struct kws_request *request)
+{
+    int matches, limit, offset, rc;
+
+    char *query;
+
+    sqlite3_stmt *stmt;
+
+    struct db_page page = { 0 };
+
+    jx_value *tokens, *qt_list;
+
+    bool ok;
+
+    if (db_cntx->db == NULL) {
+        db_set_error_msg("fts search requires a database connection");
+        return false;
+    }
+
+    tokens = db_get_tokens(request->query);
+
+    if (jxa_get_length(tokens) == 0) {
+        response->matches = 0;
+        jxv_free(tokens);
+        return true;
+    }
+
+    matches = db_get_fts_matches(tokens);
+    query = db_get_fts_query(tokens);
+
+    jxv_free(tokens);
+
+    if (matches < 0 || query == NULL) {
+        free(query);
+        return false;
+    }
+
+    if (matches == 0) {
+        response->matches = 0;
+        free(query);
+        return true;
+    }
+
+    limit = (request->page_size > 0) ? request->page_size : -1;
+    offset = (request->page_size > 0 && request->page > 1) ? request->page_size * (request->page - 1) : 0;
+
+    if (request->cursor.set) {
+        stmt = db_get_stmt(DB_ACTION_GET_FTS_QIDS_AFTER);
+
+        ok = stmt != NULL && db_bind_text(stmt, 1, query) && db_bind_double(stmt, 2, -request->cursor.rank) &&
+             db_bind_int(stmt, 3, request->cursor.qid) && db_bind_int(stmt, 4, limit);
+    }
+    else {
+        stmt = db_get_stmt(DB_ACTION_GET_FTS_QIDS);
+
+        ok = stmt != NULL && db_bind_text(stmt, 1, query) && db_bind_int(stmt, 2, limit) &&
+             db_bind_int(stmt, 3, offset);
+    }
+
+    if (!ok) {
+        if (stmt != NULL) {
+            db_set_error_msg("query: [%s] bind error: [%s]", query, sqlite3_errstr(db_cntx->rc));
+            db_reset(stmt);
+        }
+
+        free(query);
+        return false;
+    }
+
+    while ((rc = db_step(stmt)) == SQLITE_ROW) {
+        if (!db_page_add(&page, sqlite3_column_int(stmt, 0), -sqlite3_column_double(stmt, 1))) {
+            db_set_error_msg("query: out of memory");
+            break;
+        }
+    }
+
+    db_reset(stmt);
+
+    free(query);
+
+    qt_list = (rc == SQLITE_DONE) ? db_get_questions(&page) : NULL;
+
+    db_set_page_cursor(response, request, &page);
+
+    db_page_free(&page);
+
+    if (qt_list == NULL)
+        return false;
+
+    response->result = qt_list;
+    response->matches = matches;
+
+    return true;
+}
+
+/*
+ * Phase one of a keyword search: counts, per question, the keyword rows
+ * matching kw_list and keeps the best questions after the cursor that
+ * match at least required of them, up to the end of the requested page.
+ * Like searches count each token once per question it matches, with the
+ * same LIKE predicate that built kw_list.
+ */
+bool db_rank_questions(jx_value *kw_list, enum kw_search_type type, struct kws_cursor *cursor, uint32_t required,
+    struct rank_heap *heap, size_t k)
+{
+    int rc;
+
+    size_t i;
+
+    char *json;
+
+    sqlite3_stmt *stmt;
+
+    struct rank_counter counter;
+
+    stmt = db_get_stmt((type == KW_SEARCH_TYPE_EXACT) ? DB_ACTION_GET_KW_QIDS : DB_ACTION_GET_KW_QIDS_LIKE);
+
+    if (stmt == NULL)
+        return false;
+
+    if (!rank_counter_init(&counter)) {
+        db_set_error_msg("rank: out of memory");
+        return false;
+    }
+
+    json = jx_serialize_json(kw_list, false);
+
+    if (json == NULL || !db_bind_text(stmt, 1, json)) {
+        db_set_error_msg("rank: unable to bind keyword list");
+        db_reset(stmt);
+        rank_counter_free(&counter);
+        free(json);
+        return false;
+    }
+
+    while ((rc = db_step(stmt)) == SQLITE_ROW) {
+        if (!rank_counter_add(&counter, sqlite3_column_int(stmt, 0))) {
+            db_set_error_msg("rank: out of memory");
+            break;
+        }
+    }
+
+    db_reset(stmt);
+
+    free(json);
+
+    if (rc != SQLITE_DONE) {
+        rank_counter_free(&counter);
+        return false;
+    }
+
+    if (k > counter.size)
+        k = counter.size;
+
+    if (!rank_heap_init(heap, k)) {
+        db_set_error_msg("rank: out of memory");
+        rank_counter_free(&counter);
+        return false;
+    }
+
+    for (i = 0; i < counter.capacity; i++) {
+        if (counter.ids[i] != 0 && counter.counts[i] >= required &&
+            db_is_after_cursor(cursor, counter.counts[i], counter.ids[i] - 1))
+            rank_heap_push(heap, counter.counts[i], counter.ids[i] - 1);
+    }
+
+    rank_counter_free(&counter);
+
+    rank_heap_sort(heap);
+
+    return true;
+}
+
+bool db_kw_search(struct kws_response *response, struct kws_request *request)
+{
+    size_t first, last, i;
+
+    int matches, n_tokens, required;
+
+    struct rank_heap heap;
+    struct db_page page = { 0 };
+
+    jx_value *kw_list, *qt_list;
+
+    if (request->query == NULL || strlen(request->query) == 0)
+        return false;
+
+    if (!db_check_open())
+        return false;
+
+    if (request->type == KW_SEARCH_TYPE_FTS)
+        return db_fts_search(response, request);
+
+    if (db_index != NULL) {
+        kw_list = db_get_tokens(request->query);
+
+        if (!kwidx_search(db_index, kw_list, response, request)) {
+            db_set_error_msg("index search failed");
+            jxv_free(kw_list);
+            return false;
+        }
+
+        jxv_free(kw_list);
+        return true;
+    }
+
+    kw_list = db_get_kw_list(request, &n_tokens);
+
+    if (kw_list == NULL) {
+        return false;
+    }
+
+    matches = jxa_get_length(kw_list);
+    required = db_get_required_matches(request, n_tokens);
+
+    if (matches == 0 || matches < required) {
+        response->matches = matches;
+        jxv_free(kw_list);
+        return true;
+    }
+
+    if (request->page_size > 0) {
+        first = (request->page > 1 && !request->cursor.set) ? (size_t)request->page_size * (request->page - 1) : 0;
+        last = first + request->page_size;
+    }
+    else {
+        first = 0;
+        last = SIZE_MAX;
+    }
+
+    if (!db_rank_questions(kw_list, request->type, &request->cursor, required, &heap, last)) {
+        jxv_free(kw_list);
+        return false;
+    }
+
+    jxv_free(kw_list);
+
+    for (i = first; i < heap.size; i++) {
+        if (!db_page_add(&page, heap.hits[i].id, heap.hits[i].rank)) {
+            db_set_error_msg("query: out of memory");
+            rank_heap_free(&heap);
+            db_page_free(&page);
+            return false;
+        }
+    }
+
+    rank_heap_free(&heap);
+
+    qt_list = db_get_questions(&page);
+
+    db_set_page_cursor(response, request, &page);
+
+    db_page_free(&page);
+
+    if (qt_list == NULL)
+        return false;
+
+    response->result = qt_list;
+    response->matches = matches;
+
+    return true;
+}
+
+void db_set_error_msg(const char *fmt, ...)
+{
+    va_list ap;
+
+    int r;
+
+    va_start(ap, fmt);
+    r = vsnprintf(db_cntx->error_msg, DB_ERROR_MSG_SIZE, fmt, ap);
+    va_end(ap);
+
+    if (r >= DB_ERROR_MSG_SIZE) {
+        db_cntx->error_msg[DB_ERROR_MSG_SIZE - 1] = '\0';
+    }
+}
+
+void db_set_path(const char *fmt, ...)
+{
+    va_list ap;
+
+    int r;
+
+    va_start(ap, fmt);
+    r = vsnprintf(db_path, DB_PATH_SIZE, fmt, ap);
+    va_end(ap);
+
+    if (r >= DB_PATH_SIZE) {
+        db_path[DB_PATH_SIZE - 1] = '\0';
+    }
+}
+
+struct db_context *db_context_new()
+{
+    struct db_context *cntx = calloc(1, sizeof(struct db_context));
+
+    if (cntx != NULL)
+        cntx->rc = SQLITE_OK;
+
+    return cntx;
+}
+
+void db_context_free(struct db_context *cntx)
+{
+    struct db_context *current = db_cntx;
+
+    if (cntx == NULL || cntx == &db_default_context)
+        return;
+
+    db_cntx = cntx;
+
+    db_close();
+
+    db_cntx = (current == cntx) ? &db_default_context : current;
+
+    free(cntx);
+}
+
+void db_set_context(struct db_context *cntx)
+{
+    db_cntx = (cntx != NULL) ? cntx : &db_default_context;
+}
+
+bool db_set_profile(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(db_profile_names) / sizeof(db_profile_names[0]); i++) {
+        if (strcmp(name, db_profile_names[i]) == 0) {
+            db_profile = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Reads the whole database file ahead into the page cache once per
+ * process, so the first searches do not fault pages in one at a time.
+ */
+void db_prewarm()
+{
+    struct stat st;
+
+    void *map;
+
+    int fd;
+
+    if (__atomic_exchange_n(&db_prewarmed, 0, __ATOMIC_ACQ_REL) != -1)
+        return;
+
+    if ((fd = open(db_path, O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map != MAP_FAILED) {
+            if (madvise(map, st.st_size, MADV_WILLNEED) == 0)
+                __atomic_store_n(&db_prewarmed, (long long)st.st_size, __ATOMIC_RELEASE);
+
+            munmap(map, st.st_size);
+        }
+    }
+
+    close(fd);
+}
+
+bool db_apply_profile()
+{
+    char sql[128];
+
+    if (db_profile == DB_PROFILE_DEFAULT)
+        return true;
+
+    snprintf(sql, sizeof(sql), "PRAGMA mmap_size = %d;", DB_SERVING_MMAP_SIZE);
+
+    if (db_exec_sql(sql) != DB_STATUS_OK)
+        return false;
+
+    snprintf(sql, sizeof(sql), "PRAGMA cache_size = %d;", DB_SERVING_CACHE_SIZE);
+
+    if (db_exec_sql(sql) != DB_STATUS_OK ||
+        db_exec_sql("PRAGMA temp_store = MEMORY;") != DB_STATUS_OK ||
+        db_exec_sql("PRAGMA query_only = 1;") != DB_STATUS_OK)
+        return false;
+
+    db_prewarm();
+
+    return true;
+}
+
+/*
+ * Schema version from PRAGMA user_version: 0 or 1 is the original
+ * keywords table, 2 is vocab plus postings.
+ */
+bool db_read_schema_version()
+{
+    char value[32];
+
+    if (!db_get_pragma("user_version", value, sizeof(value))) {
+        db_set_error_msg("db_open: unable to read schema version");
+        return false;
+    }
+
+    db_cntx->schema_version = atoi(value);
+
+    if (db_cntx->schema_version > DB_SCHEMA_VERSION) {
+        db_set_error_msg("db_open: unsupported schema version %d", db_cntx->schema_version);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * SQL functions that split stored keywords with db_get_tokens(), the
+ * function queries go through, so that a keyword only matches what a
+ * query token can be:
+ *
+ *   kws_tokens(text)  the tokens as a JSON array, for json_each()
+ *   kws_fold(text)    the tokens joined by spaces; a keyword a query
+ *                     token can match is its own kws_fold()
+ */
+void db_tokens_sql(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *str = (const char *)sqlite3_value_text(argv[0]);
+
+    jx_value *tokens;
+
+    char *json;
+
+    if (str == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    tokens = db_get_tokens(str);
+    json = (tokens != NULL) ? jx_serialize_json(tokens, false) : NULL;
+
+    jxv_free(tokens);
+
+    if (json == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    sqlite3_result_text(ctx, json, -1, free);
+}
+
+void db_fold_sql(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *str = (const char *)sqlite3_value_text(argv[0]);
+
+    jx_value *tokens;
+
+    const char *token;
+
+    char *buf;
+
+    size_t i, n, size = 0;
+
+    if (str == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    tokens = db_get_tokens(str);
+
+    /* folded tokens take at most 3 / 2 of their bytes, plus the spaces */
+    if (tokens == NULL || (buf = sqlite3_malloc(sqlite3_value_bytes(argv[0]) / 2 * 3 + 4)) == NULL) {
+        jxv_free(tokens);
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    for (i = 0; i < jxa_get_length(tokens); i++) {
+        token = jxs_get_str(jxa_get(tokens, i));
+        n = strlen(token);
+
+        if (i > 0)
+            buf[size++] = ' ';
+
+        memcpy(buf + size, token, n);
+        size += n;
+    }
+
+    jxv_free(tokens);
+
+    sqlite3_result_text(ctx, buf, size, sqlite3_free);
+}
+
+bool db_open_v2(int flags)
+{
+    char uri[DB_PATH_SIZE * 3 + 32], *p;
+
+    const char *filename = db_path, *c;
+
+    if (db_profile != DB_PROFILE_DEFAULT)
+        flags = SQLITE_OPEN_READONLY | (flags & SQLITE_OPEN_NOMUTEX);
+
+    if (db_profile == DB_PROFILE_IMMUTABLE) {
+        p = uri + sprintf(uri, "file:");
+
+        for (c = db_path; *c != '\0'; c++) {
+            if (*c == '%' || *c == '?' || *c == '#')
+                p += sprintf(p, "%%%02X", (unsigned char)*c);
+            else
+                *(p++) = *c;
+        }
+
+        strcpy(p, "?immutable=1");
+
+        filename = uri;
+        flags |= SQLITE_OPEN_URI;
+    }
+
+    if ((db_cntx->rc = sqlite3_open_v2(filename, &db_cntx->db, flags, NULL)) != SQLITE_OK) {
+        db_set_error_msg("db_open: [%s]", sqlite3_errstr(db_cntx->rc));
+
+        sqlite3_close_v2(db_cntx->db);
+        db_cntx->db = NULL;
+
+        return false;
+    }
+
+    sqlite3_busy_timeout(db_cntx->db, 100);
+
+    sqlite3_create_function(db_cntx->db, "kws_fold", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, db_fold_sql, NULL, NULL);
+    sqlite3_create_function(db_cntx->db, "kws_tokens", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, db_tokens_sql, NULL, NULL);
+
+    if (!db_apply_profile()) {
+        db_close();
+        return false;
+    }
+
+    if (!db_read_schema_version()) {
+        db_close();
+        return false;
+    }
+
+    return true;
+}
+
+bool db_get_pragma(const char *name, char *buf, size_t size)
+{
+    char sql[64];
+
+    sqlite3_stmt *stmt;
+
+    bool ok = false;
+
+    snprintf(sql, sizeof(sql), "PRAGMA %s;", name);
+
+    if (sqlite3_prepare_v2(db_cntx->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return false;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        snprintf(buf, size, "%s", (const char *)sqlite3_column_text(stmt, 0));
+        ok = true;
+    }
+
+    sqlite3_finalize(stmt);
+
+    return ok;
+}
+
+/*
+ * One line self-report of the settings the current connection actually
+ * ended up with, read back from SQLite. Reads are lock-free when
+ * immutable=1; with journal_mode=wal they never wait on a writer.
+ */
+void db_report_profile(FILE *fp, const char *prefix)
+{
+    static const char *pragmas[] = { "journal_mode", "mmap_size", "cache_size", "temp_store", "query_only" };
+
+    char value[64];
+
+    size_t i;
+
+    if (db_cntx->db == NULL)
+        return;
+
+    fprintf(fp, "%s: db profile %s: schema=%d read_only=%d immutable=%d", prefix, db_profile_names[db_profile],
+        db_cntx->schema_version, sqlite3_db_readonly(db_cntx->db, "main"), db_profile == DB_PROFILE_IMMUTABLE);
+
+    for (i = 0; i < sizeof(pragmas) / sizeof(pragmas[0]); i++) {
+        if (db_get_pragma(pragmas[i], value, sizeof(value)))
+            fprintf(fp, " %s=%s", pragmas[i], value);
+    }
+
+    fprintf(fp, " prewarmed=%lld\n", (db_prewarmed > 0) ? db_prewarmed : 0);
+}
+
+bool db_open()
+{
+    return db_open_v2(SQLITE_OPEN_READWRITE);
+}
+
+/*
+ * Defers db_open() to the first search that needs SQLite, so requests
+ * answered from elsewhere (the result cache) never open the database.
+ */
+void db_open_deferred()
+{
+    db_cntx->open_deferred = true;
+}
+
+bool db_check_open()
+{
+    if (db_cntx->db != NULL || !db_cntx->open_deferred)
+        return true;
+
+    db_cntx->open_deferred = false;
+
+    return db_open();
+}
+
+/*
+ * Connections opened this way are only ever used by the calling thread,
+ * so SQLite's per-connection mutex is skipped.
+ */
+bool db_open_read_only()
 {
-    DB_STATUS_ERROR,
-    DB_STATUS_OK,
-    DB_STATUS_IN_TRANSACTION,
-    DB_STATUS_NOT_IN_TRANSACTION
-};
+    return db_open_v2(SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX);
+}
 
-enum db_action
+bool db_close()
 {
-    DB_ACTION_GET_KW_CNT_EXACT_MATCH,
-    DB_ACTION_GET_KW_CNT_LIKE_MATCH,
-    DB_ACTION_GUARD
-};
+    if (db_cntx->db == NULL)
+        return false;
 
-struct db_stmt {
-    sqlite3_stmt *stmt;
-    const char *sql;
+    db_clear_cache();
+
+    sqlite3_close_v2(db_cntx->db);
+
+    db_cntx->db = NULL;
+
+    bloom_free(db_cntx->vocab_filter);
+
+    db_cntx->vocab_filter = NULL;
+    db_cntx->vocab_file_stamp = 0;
+
+    return true;
 }
-db_stmt_cache[] =
+
+bool db_for_each_row(const char *sql, db_row_cb cb, void *ptr)
 {
-    { NULL, "SELECT COUNT(*) AS CNT FROM keywords WHERE keyword = ?;" },
-    { NULL, "SELECT COUNT(*) AS CNT FROM keywords WHERE keyword LIKE ?;" }
-};
+    sqlite3_stmt *stmt;
 
-const char *get_answers_sql =
-    "SELECT v.qid, v.question, v.rank, at.answer FROM                   "
-    "(                                                                  "
-    "   SELECT qt.qid, qt.question, COUNT(*) AS rank FROM               "
-    "   (                                                               "
-    "       SELECT qid, keyword FROM keywords WHERE keyword IN (%s)     "
-    "   ) AS kt                                                         "
-    "   INNER JOIN questions AS qt ON (kt.qid = qt.qid)                 "
-    "   GROUP BY qt.qid, qt.question                                    "
-    ") AS v                                                             "
-    "INNER JOIN answers AS at ON (v.qid = at.qid)                       "
-    "ORDER BY rank DESC                                                 "
-    "LIMIT ? OFFSET ?;                                                  ";
+    int rc;
 
-void db_set_error_msg(const char *fmt, ...);
-enum db_status db_exec_sql(const char *sql);
-enum db_status db_begin();
-enum db_status db_rollback();
-enum db_status db_commit();
-sqlite3_stmt *db_get_stmt(enum db_action action);
-void db_clear_cache();
-bool db_bind_null(sqlite3_stmt *stmt, int index);
-bool db_bind_text(sqlite3_stmt *stmt, int index, const char *str);
-bool db_bind_int(sqlite3_stmt *stmt, int index, int value);
-bool db_bind_int_foreign_key(sqlite3_stmt *stmt, int index, int value);
-int db_step(sqlite3_stmt *stmt);
-bool db_reset(sqlite3_stmt *stmt);
-bool db_finalize(sqlite3_stmt *stmt);
+    db_cntx->rc = sqlite3_prepare_v2(db_cntx->db, sql, -1, &stmt, NULL);
 
-void str_to_lower(char *str)
-{
-    while (*str) {
-        *str = tolower(*str);
-        str++;
+    if (db_get_error()) {
+        db_set_error_msg("prepare: [%s]", sqlite3_errstr(db_cntx->rc));
+        return false;
+    }
+
+    while ((rc = db_step(stmt)) == SQLITE_ROW) {
+        if (!cb(stmt, ptr)) {
+            db_set_error_msg("query: [%s] row rejected", sql);
+            db_finalize(stmt);
+            return false;
+        }
     }
+
+    db_finalize(stmt);
+
+    return rc == SQLITE_DONE;
 }
 
-void terminate(char *str)
+bool db_load_question(sqlite3_stmt *stmt, void *idx)
 {
-    while (*str) {
-        if (*str == '?') {
-            *str = '\0';
-            break;
-        }
+    return kwidx_add_question(idx, sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+}
 
-        str++;
-    }
+bool db_load_answer(sqlite3_stmt *stmt, void *idx)
+{
+    return kwidx_add_answer(idx, sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
 }
 
-char *get_sql_with_n_params(const char *sql_in, int n)
+bool db_load_keyword(sqlite3_stmt *stmt, void *idx)
 {
-    int count;
+    return kwidx_add_keyword(idx, (const char *)sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
+}
 
-    char *sql_out, *p_str, *ptr;
+/*
+ * Builds the in-memory index from the current connection. Once loaded,
+ * searches on every context are answered from the index without SQL.
+ */
+bool db_load_index()
+{
+    struct kwidx *idx;
 
-    if (n < 1)
-        return NULL;
+    if (db_cntx->db == NULL) {
+        db_set_error_msg("db_load_index: database is not open");
+        return false;
+    }
 
-    p_str = ptr = alloca(n * 2);
+    idx = kwidx_new();
 
-    do {
-        *(ptr++) = '?';
-        *(ptr++) = (n > 1) ? ',' : '\0';
-    } while (--n > 0);
+    if (idx == NULL) {
+        db_set_error_msg("db_load_index: out of memory");
+        return false;
+    }
 
-    count = snprintf(NULL, 0, sql_in, p_str);
+    if (!db_for_each_row("SELECT qid, question FROM questions ORDER BY qid;", db_load_question, idx) ||
+        !db_for_each_row("SELECT qid, answer FROM answers ORDER BY qid, aid;", db_load_answer, idx) ||
+        !db_for_each_row((db_cntx->schema_version >= 2) ?
+            "SELECT t.value, p.qid FROM vocab AS v INNER JOIN postings AS p ON (p.kid = v.kid), "
+            "json_each(kws_tokens(v.keyword)) AS t ORDER BY 1, 2;" :
+            "SELECT t.value, k.qid FROM keywords AS k, json_each(kws_tokens(k.keyword)) AS t ORDER BY 1, 2;",
+            db_load_keyword, idx)) {
+        kwidx_free(idx);
+        return false;
+    }
 
-    sql_out = malloc(count + 1);
+    if (!kwidx_finish(idx)) {
+        db_set_error_msg("db_load_index: out of memory");
+        kwidx_free(idx);
+        return false;
+    }
 
-    if (sql_out == NULL)
-        return NULL;
+    kwidx_free(db_index);
 
-    sprintf(sql_out, sql_in, p_str);
+    db_index = idx;
 
-    return sql_out;
+    return true;
 }
 
-int db_get_keyword_count(enum db_action act, const char *param)
+/*
+ * Replaces the in-memory index with a snapshot written by db_save_index().
+ * No database connection is needed to search a mapped index.
+ */
+bool db_map_index(const char *path)
 {
-    int r;
-    sqlite3_stmt *stmt;
-
-    stmt = db_get_stmt(act);
+    struct kwidx *idx;
 
-    if (stmt == NULL)
-        return -1;
+    idx = kwidx_map(path);
 
-    if (!db_bind_text(stmt, 1, param)) {
-        db_reset(stmt);
-        return -1;
+    if (idx == NULL) {
+        db_set_error_msg("db_map_index: unable to map index snapshot '%s'", path);
+        return false;
     }
 
-    db_rc = db_step(stmt);
+    kwidx_free(db_index);
 
-    if (db_get_error()) {
-        db_reset(stmt);
-        return -1;
-    }
+    db_index = idx;
+
+    return true;
+}
 
-    r = sqlite3_column_int(stmt, 0);
+bool db_save_index(const char *path)
+{
+    if (db_index == NULL) {
+        db_set_error_msg("db_save_index: index is not loaded");
+        return false;
+    }
 
-    db_reset(stmt);
+    if (!kwidx_save(db_index, path)) {
+        db_set_error_msg("db_save_index: unable to write '%s'", path);
+        return false;
+    }
 
-    return r;
+    return true;
 }
 
-int db_get_keyword_exact_matches(const char* kw)
+bool db_count_row(sqlite3_stmt *stmt, void *n)
 {
-    return db_get_keyword_count(DB_ACTION_GET_KW_CNT_EXACT_MATCH, kw);
+    *(uint64_t *)n = sqlite3_column_int64(stmt, 0);
+
+    return true;
 }
 
-int db_get_keyword_like_matches(const char *kw)
+bool db_filter_keyword(sqlite3_stmt *stmt, void *filter)
 {
-    char *param;
+    const char *keyword = (const char *)sqlite3_column_text(stmt, 0);
 
-    param = alloca(strlen(kw) + 3);
+    if (keyword != NULL)
+        bloom_add(filter, keyword);
 
-    sprintf(param, "%%%s%%", kw);
-
-    return db_get_keyword_count(DB_ACTION_GET_KW_CNT_LIKE_MATCH, param);
+    return true;
 }
 
-jx_value *db_get_kw_list(struct kws_request *request)
+/*
+ * Writes a Bloom filter over the vocabulary of the current connection,
+ * stamped by db_get_file_stamp().
+ */
+bool db_save_vocab_filter(const char *path)
 {
-    int count;
-    jx_value *kw_set, *kw_list;
-    char *query, *kw;
+    struct bloom *filter;
 
-    kw_set = jxd_new();
-    kw_list = jxa_new(10);
+    uint64_t n_keywords = 0, stamp = db_get_file_stamp();
 
-    query = alloca(strlen(request->query) + 1);
+    bool v2;
 
-    strcpy(query, request->query);
+    if (db_cntx->db == NULL) {
+        db_set_error_msg("db_save_vocab_filter: database is not open");
+        return false;
+    }
 
-    kw = strtok(query, " ");
+    v2 = db_cntx->schema_version >= 2;
 
-    do {
-        str_to_lower(kw);
+    if (!db_for_each_row(v2 ? "SELECT COUNT(*) FROM vocab;" : "SELECT COUNT(DISTINCT keyword) FROM keywords;",
+        db_count_row, &n_keywords))
+        return false;
 
-        terminate(kw);
+    if ((filter = bloom_new(n_keywords)) == NULL) {
+        db_set_error_msg("db_save_vocab_filter: out of memory");
+        return false;
+    }
 
-        if (jxd_has_key(kw_set, kw))
-            continue;
+    filter->stamp = stamp;
 
-        if (request->type == KW_SEARCH_TYPE_EXACT)
-            count = db_get_keyword_exact_matches(kw);
-        else
-            count = db_get_keyword_like_matches(kw);
+    if (!db_for_each_row(v2 ? "SELECT DISTINCT t.value FROM vocab AS v, json_each(kws_tokens(v.keyword)) AS t;" :
+        "SELECT DISTINCT t.value FROM keywords AS k, json_each(kws_tokens(k.keyword)) AS t;",
+        db_filter_keyword, filter)) {
+        bloom_free(filter);
+        return false;
+    }
 
-        if (count <= 0)
-            continue;
+    if (!bloom_save(filter, path)) {
+        db_set_error_msg("db_save_vocab_filter: unable to write '%s'", path);
+        bloom_free(filter);
+        return false;
+    }
 
-        jxd_put_bool(kw_set, kw, true);
-        jxa_push(kw_list, jxs_new(kw));
-    } while ((kw = strtok(NULL, " ")) != NULL);
+    bloom_free(filter);
 
-    jxv_free(kw_set);
+    return true;
+}
 
-    return kw_list;
+void db_free_index()
+{
+    kwidx_free(db_index);
+
+    db_index = NULL;
 }
 
-bool db_kw_search(struct kws_response *response, struct kws_request *request)
+bool db_save_index_sql(sqlite3_stmt *stmt, void *ptr)
 {
-    int matches, i, p, limit, offset, rc, qid, last_qid, rank;
+    jx_value *pair = jxa_new(2);
 
-    char *question, *answer;
+    jxa_push(pair, jxs_new((char *)sqlite3_column_text(stmt, 0)));
+    jxa_push(pair, jxs_new((char *)sqlite3_column_text(stmt, 1)));
 
-    sqlite3_stmt *stmt;
-    char *sql;
+    return jxa_push(ptr, pair);
+}
 
-    jx_value *kw_list, *qt_list, *qt_object, *a_list;
+/*
+ * Prepares the connection for a bulk load: secondary indexes on the
+ * tables being loaded are dropped so that each is built once by
+ * db_ingest_end() instead of being updated row by row. Their definitions
+ * are kept in the kws_deferred_indexes table, written in the same
+ * transaction as the drops, so a load that dies before db_ingest_end()
+ * leaves them for the next one to rebuild. The drops are made in the
+ * first transaction of the load, which this opens; if that fails nothing
+ * is dropped. Otherwise call db_ingest_end() however the load ends. Until
+ * then commits sync less often (synchronous=NORMAL, which can only be set
+ * outside a transaction), still keeping the database intact after a crash.
+ */
+bool db_ingest_begin()
+{
+    char sql[DB_PATH_SIZE];
 
-    limit = request->page_size;
-    offset = limit * (request->page - 1);
+    jx_value *indexes;
 
-    if (request->query == NULL || strlen(request->query) == 0)
-        return false;
+    size_t i;
 
-    kw_list = db_get_kw_list(request);
+    bool ok;
 
-    if (kw_list == NULL) {
+    if (db_cntx->db == NULL) {
+        db_set_error_msg("db_ingest_begin: database is not open");
         return false;
     }
 
-    matches = jxa_get_length(kw_list);
+    if (!db_get_pragma("synchronous", db_ingest_synchronous, sizeof(db_ingest_synchronous)) ||
+        db_exec_sql("PRAGMA synchronous = NORMAL;") != DB_STATUS_OK ||
+        db_exec_sql("PRAGMA cache_size = -65536;") != DB_STATUS_OK)
+        return false;
 
-    if (matches == 0) {
-        response->matches = 0;
-        jxv_free(kw_list);
-        return true;
+    if (db_begin() != DB_STATUS_OK) {
+        db_cntx->in_transaction = false;
+        return false;
     }
 
-    sql = get_sql_with_n_params(get_answers_sql, matches);
+    if (db_exec_sql("CREATE TABLE IF NOT EXISTS kws_deferred_indexes "
+        "(name TEXT NOT NULL PRIMARY KEY, sql TEXT NOT NULL);") != DB_STATUS_OK ||
+        db_exec_sql("INSERT OR IGNORE INTO kws_deferred_indexes (name, sql) "
+        "SELECT name, sql FROM sqlite_master WHERE type = 'index' AND sql IS NOT NULL "
+        "AND tbl_name IN ('answers', 'keywords', 'postings');") != DB_STATUS_OK) {
+        db_rollback();
+        return false;
+    }
 
-    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    indexes = jxa_new(4);
 
-    if (db_get_error()) {
-        db_set_error_msg("prepare: [%s]", sqlite3_errstr(db_rc));
+    ok = db_for_each_row("SELECT name, sql FROM kws_deferred_indexes ORDER BY name;", db_save_index_sql, indexes);
 
-        jxv_free(kw_list);
-        free(sql);
+    for (i = 0; ok && i < jxa_get_length(indexes); i++) {
+        snprintf(sql, sizeof(sql), "DROP INDEX IF EXISTS \"%s\";", jxs_get_str(jxa_get(jxa_get(indexes, i), 0)));
 
-        return false;
+        ok = db_exec_sql(sql) == DB_STATUS_OK;
     }
 
-    for (i = 0, p = 1; i < matches; i++, p++) {
-        char *keyword = jxs_get_str(jxa_get(kw_list, i));
+    jxv_free(indexes);
 
-        if (!db_bind_text(stmt, p, keyword)) {
-            db_set_error_msg("query: [%s] bind: [%s] error: [%s]", sql, keyword, sqlite3_errstr(db_rc));
+    if (!ok)
+        db_rollback();
 
-            db_finalize(stmt);
-            jxv_free(kw_list);
-            free(sql);
+    return ok;
+}
+
+bool db_ingest_keyword(int qid, const char *kw)
+{
+    sqlite3_stmt *stmt;
 
+    if (db_cntx->schema_version >= 2) {
+        if ((stmt = db_get_stmt(DB_ACTION_INSERT_VOCAB)) == NULL)
+            return false;
+
+        if (!db_bind_text(stmt, 1, kw) || db_step(stmt) != SQLITE_DONE) {
+            db_set_error_msg("insert keyword: %s", sqlite3_errmsg(db_cntx->db));
+            db_reset(stmt);
             return false;
         }
-    }
 
-    if (!db_bind_int(stmt, p++, limit)) {
-        db_set_error_msg("query: [%s] bind: [%d] error: [%s]", sql, limit, sqlite3_errstr(db_rc));
+        db_reset(stmt);
+    }
 
-        db_finalize(stmt);
-        jxv_free(kw_list);
-        free(sql);
+    if ((stmt = db_get_stmt(DB_ACTION_INSERT_KEYWORD)) == NULL)
+        return false;
 
+    if (!db_bind_int(stmt, 1, qid) || !db_bind_text(stmt, 2, kw) || db_step(stmt) != SQLITE_DONE) {
+        db_set_error_msg("insert keyword: %s", sqlite3_errmsg(db_cntx->db));
+        db_reset(stmt);
         return false;
     }
 
-    if (!db_bind_int(stmt, p++, offset)) {
-        db_set_error_msg("query: [%s] bind: [%d] error: [%s]", sql, offset, sqlite3_errstr(db_rc));
+    db_reset(stmt);
 
-        db_finalize(stmt);
-        jxv_free(kw_list);
-        free(sql);
+    return true;
+}
+
+struct db_ingest_kw_set
+{
+    jx_value *seen;
+    int qid;
+};
+
+bool db_ingest_token(char *token, void *ptr)
+{
+    struct db_ingest_kw_set *set = ptr;
+
+    if (strlen(token) > TOK_MAX_LENGTH || jxd_has_key(set->seen, token))
+        return true;
+
+    jxd_put_bool(set->seen, token, true);
 
+    return db_ingest_keyword(set->qid, token);
+}
+
+/*
+ * Adds one question with its answers and keywords. Keywords are
+ * lowercased and deduplicated so they match query tokens. Runs inside
+ * whatever transaction the caller has open.
+ */
+bool db_ingest_add(const char *question, jx_value *answers, jx_value *keywords)
+{
+    struct db_ingest_kw_set set;
+
+    jx_value *value;
+
+    sqlite3_stmt *stmt;
+
+    size_t i, n;
+
+    bool ok = false;
+
+    if ((stmt = db_get_stmt(DB_ACTION_INSERT_QUESTION)) == NULL)
+        return false;
+
+    if (!db_bind_text(stmt, 1, question) || db_step(stmt) != SQLITE_DONE) {
+        db_set_error_msg("insert question: %s", sqlite3_errmsg(db_cntx->db));
+        db_reset(stmt);
         return false;
     }
 
-    qt_list = jxa_new(10);
-    qt_object = NULL;
-    last_qid = -1;
+    db_reset(stmt);
 
-    while ((rc = db_step(stmt)) != SQLITE_DONE) {
-        if (rc != SQLITE_ROW) {
-            return false;
-        }
+    set.qid = (int)sqlite3_last_insert_rowid(db_cntx->db);
 
-        qid = sqlite3_column_int(stmt, 0);
-        question = (char *)sqlite3_column_text(stmt, 1);
-        rank = sqlite3_column_int(stmt, 2);
-        answer = (char *)sqlite3_column_text(stmt, 3);
+    n = (answers != NULL) ? jxa_get_length(answers) : 0;
 
-        if (last_qid != qid) {
-            qt_object = jxd_new();
+    for (i = 0; i < n; i++) {
+        value = jxa_get(answers, i);
 
-            jxd_put_string(qt_object, "question", question);
-            jxd_put_number(qt_object, "rank", rank);
-            jxd_put(qt_object, "answers", jxa_new(10));
+        if (jxv_get_type(value) != JX_TYPE_STRING)
+            continue;
 
-            jxa_push(qt_list, qt_object);
+        if ((stmt = db_get_stmt(DB_ACTION_INSERT_ANSWER)) == NULL)
+            return false;
 
-            last_qid = qid;
+        if (!db_bind_int(stmt, 1, set.qid) || !db_bind_text(stmt, 2, jxs_get_str(value)) || db_step(stmt) != SQLITE_DONE) {
+            db_set_error_msg("insert answer: %s", sqlite3_errmsg(db_cntx->db));
+            db_reset(stmt);
+            return false;
         }
 
-        a_list = jxd_get(qt_object, "answers");
-
-        jxa_push(a_list, jxs_new(answer));
+        db_reset(stmt);
     }
 
-    db_finalize(stmt);
+    set.seen = jxd_new();
 
-    response->result = qt_list;
-    response->matches = matches;
+    n = (keywords != NULL) ? jxa_get_length(keywords) : 0;
 
-    jxv_free(kw_list);
+    for (i = 0; i < n; i++) {
+        value = jxa_get(keywords, i);
 
-    free(sql);
+        if (jxv_get_type(value) == JX_TYPE_STRING && !tok_split(jxs_get_str(value), db_ingest_token, &set))
+            goto exit;
+    }
 
-    return true;
+    ok = true;
+
+exit:
+    jxv_free(set.seen);
+
+    return ok;
 }
 
-void db_set_error_msg(const char *fmt, ...)
+bool db_has_object(const char *type, const char *name)
 {
-    va_list ap;
+    sqlite3_stmt *stmt;
 
-    int r;
+    bool found;
 
-    va_start(ap, fmt);
-    r = vsnprintf(db_error_msg, DB_ERROR_MSG_SIZE, fmt, ap);
-    va_end(ap);
+    db_cntx->rc = sqlite3_prepare_v2(db_cntx->db,
+        "SELECT 1 FROM sqlite_master WHERE type = ? AND name = ?;", -1, &stmt, NULL);
 
-    if (r >= DB_ERROR_MSG_SIZE) {
-        db_error_msg[DB_ERROR_MSG_SIZE - 1] = '\0';
+    if (db_get_error()) {
+        db_set_error_msg("prepare: %s", sqlite3_errstr(db_cntx->rc));
+        return false;
     }
+
+    found = db_bind_text(stmt, 1, type) && db_bind_text(stmt, 2, name) && db_step(stmt) == SQLITE_ROW;
+
+    db_finalize(stmt);
+
+    return found;
 }
 
-void db_set_path(const char *fmt, ...)
+/*
+ * Ends a bulk load, after its last commit or rollback: recreates the
+ * indexes listed in kws_deferred_indexes that a rollback has not already
+ * restored, rebuilds the FTS table if the database has one, and restores
+ * the synchronous setting. The rebuild is one transaction, so if it fails
+ * the list is kept for the next load.
+ */
+bool db_ingest_end()
 {
-    va_list ap;
+    char sql[64];
 
-    int r;
+    jx_value *indexes = jxa_new(4), *index;
 
-    va_start(ap, fmt);
-    r = vsnprintf(db_path, DB_PATH_SIZE, fmt, ap);
-    va_end(ap);
+    size_t i;
 
-    if (r >= DB_PATH_SIZE) {
-        db_path[DB_PATH_SIZE - 1] = '\0';
-    }
-}
+    bool ok = db_begin() == DB_STATUS_OK;
 
-bool db_open()
-{
-    if ((db_rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
-        db_set_error_msg("db_open: [%s]", sqlite3_errstr(db_rc));
-        return false;
+    if (!ok)
+        db_cntx->in_transaction = false;
+
+    if (ok && db_has_object("table", "kws_deferred_indexes")) {
+        ok = db_for_each_row("SELECT name, sql FROM kws_deferred_indexes ORDER BY name;", db_save_index_sql, indexes);
+
+        for (i = 0; ok && i < jxa_get_length(indexes); i++) {
+            index = jxa_get(indexes, i);
+
+            if (!db_has_object("index", jxs_get_str(jxa_get(index, 0))))
+                ok = db_exec_sql(jxs_get_str(jxa_get(index, 1))) == DB_STATUS_OK;
+        }
+
+        ok = ok && db_exec_sql("DROP TABLE kws_deferred_indexes;") == DB_STATUS_OK;
     }
 
-    sqlite3_busy_timeout(db, 100);
+    jxv_free(indexes);
 
-    return true;
+    if (ok && db_has_object("table", "kw_fts"))
+        ok = db_exec_sql("INSERT INTO kw_fts (kw_fts) VALUES ('rebuild');") == DB_STATUS_OK;
+
+    if (ok)
+        ok = db_commit() == DB_STATUS_OK;
+    else
+        db_rollback();
+
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous = %s;", db_ingest_synchronous);
+
+    return db_exec_sql(sql) == DB_STATUS_OK && ok;
 }
 
-bool db_close()
+/*
+ * Rewrites stored keywords to the tokens a query would be split into
+ * (kws_tokens), the form kws-ingest keywords take: "Moon" becomes "moon"
+ * and "e-mail" the two keywords "e" and "mail", merged with keywords the
+ * question already has. Keywords loaded from SQL, or before folding was
+ * added, can otherwise never match a query.
+ */
+bool db_fold_keywords()
 {
-    if (db == NULL)
+    static const char *sql_v1[] =
+    {
+        "INSERT INTO keywords (qid, keyword) "
+        "SELECT DISTINCT k.qid, t.value FROM keywords AS k, json_each(kws_tokens(k.keyword)) AS t "
+        "WHERE k.keyword <> kws_fold(k.keyword) AND NOT EXISTS "
+        "(SELECT 1 FROM keywords AS e WHERE e.qid = k.qid AND e.keyword = t.value);",
+        "DELETE FROM keywords WHERE keyword <> kws_fold(keyword);",
+        NULL
+    };
+
+    static const char *sql_v2[] =
+    {
+        "INSERT OR IGNORE INTO vocab (keyword) "
+        "SELECT DISTINCT t.value FROM vocab AS v, json_each(kws_tokens(v.keyword)) AS t "
+        "WHERE v.keyword <> kws_fold(v.keyword) ORDER BY 1;",
+        "INSERT OR IGNORE INTO postings (kid, qid) "
+        "SELECT f.kid, p.qid FROM vocab AS v INNER JOIN postings AS p ON (p.kid = v.kid), "
+        "json_each(kws_tokens(v.keyword)) AS t INNER JOIN vocab AS f ON (f.keyword = t.value) "
+        "WHERE v.keyword <> kws_fold(v.keyword);",
+        "DELETE FROM postings WHERE kid IN (SELECT kid FROM vocab WHERE keyword <> kws_fold(keyword));",
+        "DELETE FROM vocab WHERE keyword <> kws_fold(keyword);",
+        NULL
+    };
+
+    const char **sql = (db_cntx->schema_version >= 2) ? sql_v2 : sql_v1;
+
+    int changes;
+
+    if (db_cntx->db == NULL) {
+        db_set_error_msg("db_fold_keywords: database is not open");
         return false;
+    }
 
-    db_clear_cache();
+    if (db_begin() != DB_STATUS_OK)
+        return false;
 
-    sqlite3_close_v2(db);
+    changes = sqlite3_total_changes(db_cntx->db);
 
-    return true;
+    for (; *sql != NULL; sql++) {
+        if (db_exec_sql(*sql) != DB_STATUS_OK) {
+            db_rollback();
+            return false;
+        }
+    }
+
+    if (sqlite3_total_changes(db_cntx->db) != changes && db_has_object("table", "kw_fts") &&
+        db_exec_sql("INSERT INTO kw_fts (kw_fts) VALUES ('rebuild');") != DB_STATUS_OK) {
+        db_rollback();
+        return false;
+    }
+
+    return db_commit() == DB_STATUS_OK;
 }
 
 bool db_get_error()
 {
-    return !(db_rc == SQLITE_OK || db_rc == SQLITE_DONE || db_rc == SQLITE_ROW);
+    return !(db_cntx->rc == SQLITE_OK || db_cntx->rc == SQLITE_DONE || db_cntx->rc == SQLITE_ROW);
 }
 
 const char *db_get_error_msg()
 {
-    return db_error_msg;
+    return db_cntx->error_msg;
 }
 
 enum db_status db_exec_sql(const char *sql)
@@ -400,20 +1917,20 @@ enum db_status db_exec_sql(const char *sql)
 
     enum db_status status = DB_STATUS_ERROR;
 
-    if (db == NULL)
+    if (db_cntx->db == NULL)
         return false;
 
-    db_rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    db_cntx->rc = sqlite3_prepare_v2(db_cntx->db, sql, -1, &stmt, NULL);
 
     if (db_get_error()) {
-        db_set_error_msg("prepare: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("prepare: %s", sqlite3_errstr(db_cntx->rc));
         return status;
     }
 
-    db_rc = sqlite3_step(stmt);
+    db_cntx->rc = sqlite3_step(stmt);
 
     if (db_get_error()) {
-        db_set_error_msg("step: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("step: %s", sqlite3_errstr(db_cntx->rc));
         goto exit;
     }   
 
@@ -434,32 +1951,32 @@ enum db_status db_begin()
 
     int attempts = 0;
 
-    if (_db_in_transaction) {
+    if (db_cntx->in_transaction) {
         return DB_STATUS_IN_TRANSACTION;
     }
 
-    _db_in_transaction = true;
+    db_cntx->in_transaction = true;
 
-    sqlite3_busy_timeout(db, 100);
+    sqlite3_busy_timeout(db_cntx->db, 100);
 
-    db_rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    db_cntx->rc = sqlite3_prepare_v2(db_cntx->db, sql, -1, &stmt, NULL);
 
     if (db_get_error()) {
-       db_set_error_msg("prepare: %s", sqlite3_errstr(db_rc));
+       db_set_error_msg("prepare: %s", sqlite3_errstr(db_cntx->rc));
        return DB_STATUS_ERROR;
     }
 
     while (attempts++ < 30) {
         if (attempts > 10) {
-            sqlite3_busy_timeout(db, 500);
+            sqlite3_busy_timeout(db_cntx->db, 500);
         }
         else if (attempts > 20) {
-            sqlite3_busy_timeout(db, 1000);
+            sqlite3_busy_timeout(db_cntx->db, 1000);
         }
 
-        db_rc = sqlite3_step(stmt);
+        db_cntx->rc = sqlite3_step(stmt);
 
-        if (db_rc == SQLITE_BUSY) {
+        if (db_cntx->rc == SQLITE_BUSY) {
             sqlite3_reset(stmt);
             continue;
         }
@@ -469,10 +1986,11 @@ enum db_status db_begin()
         }
 
         status = DB_STATUS_OK;
+        break;
     }
 
     if (status != DB_STATUS_OK) {
-        db_set_error_msg("step: %s\n", sqlite3_errstr(db_rc));
+        db_set_error_msg("step: %s\n", sqlite3_errstr(db_cntx->rc));
     }
 
     sqlite3_finalize(stmt);
@@ -484,13 +2002,13 @@ enum db_status db_rollback()
 {
     enum db_status status;
 
-    if (!_db_in_transaction) {
+    if (!db_cntx->in_transaction) {
         return DB_STATUS_NOT_IN_TRANSACTION;
     }
 
     status = db_exec_sql("rollback;");
 
-        _db_in_transaction = false;
+        db_cntx->in_transaction = false;
 
     return status;
 }
@@ -499,11 +2017,11 @@ enum db_status db_commit()
 {
     enum db_status status;
 
-    if (!_db_in_transaction) {
+    if (!db_cntx->in_transaction) {
         return DB_STATUS_IN_TRANSACTION;
     }
 
-    _db_in_transaction = false;
+    db_cntx->in_transaction = false;
 
     status = db_exec_sql("commit;");
 
@@ -512,18 +2030,24 @@ enum db_status db_commit()
 
 sqlite3_stmt *db_get_stmt(enum db_action action)
 {
-    struct db_stmt item = db_stmt_cache[action];
+    sqlite3_stmt **stmt = &db_cntx->stmt_cache[action];
 
-    if (item.stmt == NULL) {
-        db_rc = sqlite3_prepare_v2(db, item.sql, -1, &item.stmt, NULL);
+    const char *sql;
+
+    if (*stmt == NULL) {
+        sql = (db_cntx->schema_version >= 2 && db_stmt_sql_v2[action] != NULL) ?
+            db_stmt_sql_v2[action] : db_stmt_sql[action];
+
+        db_cntx->rc = sqlite3_prepare_v2(db_cntx->db, sql, -1, stmt, NULL);
 
         if (db_get_error()) {
-            db_set_error_msg("prepare: %s", sqlite3_errstr(db_rc));
+            db_set_error_msg("prepare: %s", sqlite3_errstr(db_cntx->rc));
+            *stmt = NULL;
             return NULL;
         }
     }
 
-    return item.stmt;
+    return *stmt;
 }
 
 void db_clear_cache()
@@ -531,19 +2055,19 @@ void db_clear_cache()
     int i;
 
     for (i = 0; i < DB_ACTION_GUARD; i++) {
-        if (db_stmt_cache[i].stmt != NULL) {
-            sqlite3_finalize(db_stmt_cache[i].stmt);
-            db_stmt_cache[i].stmt = NULL;
+        if (db_cntx->stmt_cache[i] != NULL) {
+            sqlite3_finalize(db_cntx->stmt_cache[i]);
+            db_cntx->stmt_cache[i] = NULL;
         }
     }
 }
 
 bool db_bind_null(sqlite3_stmt *stmt, int index)
 {
-    db_rc = sqlite3_bind_null(stmt, index); 
+    db_cntx->rc = sqlite3_bind_null(stmt, index); 
 
     if (db_get_error()) {
-        db_set_error_msg("bind: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("bind: %s", sqlite3_errstr(db_cntx->rc));
         return false;
     }
 
@@ -552,10 +2076,10 @@ bool db_bind_null(sqlite3_stmt *stmt, int index)
 
 bool db_bind_text(sqlite3_stmt *stmt, int index, const char *str)
 {
-    db_rc = sqlite3_bind_text(stmt, index, str, -1, NULL);
+    db_cntx->rc = sqlite3_bind_text(stmt, index, str, -1, NULL);
 
     if (db_get_error()) {
-        db_set_error_msg("bind: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("bind: %s", sqlite3_errstr(db_cntx->rc));
         return false;
     }
 
@@ -564,10 +2088,22 @@ bool db_bind_text(sqlite3_stmt *stmt, int index, const char *str)
 
 bool db_bind_int(sqlite3_stmt *stmt, int index, int value)
 {
-    db_rc = sqlite3_bind_int(stmt, index, value);
+    db_cntx->rc = sqlite3_bind_int(stmt, index, value);
+
+    if (db_get_error()) {
+        db_set_error_msg("bind: %s", sqlite3_errstr(db_cntx->rc));
+        return false;
+    }
+
+    return true;
+}
+
+bool db_bind_double(sqlite3_stmt *stmt, int index, double value)
+{
+    db_cntx->rc = sqlite3_bind_double(stmt, index, value);
 
     if (db_get_error()) {
-        db_set_error_msg("bind: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("bind: %s", sqlite3_errstr(db_cntx->rc));
         return false;
     }
 
@@ -585,25 +2121,25 @@ bool db_bind_int_foreign_key(sqlite3_stmt *stmt, int index, int value)
 
 int db_step(sqlite3_stmt *stmt)
 {
-    db_rc = sqlite3_step(stmt);
+    db_cntx->rc = sqlite3_step(stmt);
 
     if (db_get_error()) {
-        db_set_error_msg("step: %s", sqlite3_errstr(db_rc));
+        db_set_error_msg("step: %s", sqlite3_errstr(db_cntx->rc));
     }   
 
-    return db_rc;
+    return db_cntx->rc;
 }
 
 bool db_reset(sqlite3_stmt *stmt)
 {
-    db_rc = sqlite3_reset(stmt);
+    db_cntx->rc = sqlite3_reset(stmt);
 
     return !db_get_error();
 }
 
 bool db_finalize(sqlite3_stmt *stmt)
 {
-    db_rc = sqlite3_finalize(stmt);
+    db_cntx->rc = sqlite3_finalize(stmt);
 
     return !db_get_error();
 }
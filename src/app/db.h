@@ -6,21 +6,58 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 struct jx_value_t;
 typedef struct jx_value_t jx_value;
 
+struct db_context;
+
+enum db_status
+{
+    DB_STATUS_ERROR,
+    DB_STATUS_OK,
+    DB_STATUS_IN_TRANSACTION,
+    DB_STATUS_NOT_IN_TRANSACTION
+};
+
 enum kw_search_type
 {
     KW_SEARCH_TYPE_EXACT,
-    KW_SEARCH_TYPE_LIKE
+    KW_SEARCH_TYPE_LIKE,
+    KW_SEARCH_TYPE_FTS
+};
+
+/*
+ * How many query tokens a question must match: any of them, all of
+ * them, or at least kws_request.min_match of them.
+ */
+enum kw_match_mode
+{
+    KW_MATCH_MODE_ANY,
+    KW_MATCH_MODE_ALL,
+    KW_MATCH_MODE_MIN
+};
+
+/*
+ * Keyset position: the (rank, qid) of the last question of a page. A
+ * request with a cursor set resumes right after it and ignores page.
+ */
+struct kws_cursor
+{
+    double rank;
+    uint32_t qid;
+    bool set;
 };
 
 struct kws_request
 {
     const char *query;
     enum kw_search_type type;
+    enum kw_match_mode mode;
+    int min_match;
     int page, page_size;
+    struct kws_cursor cursor;
 };
 
 struct kws_response
@@ -29,16 +66,65 @@ struct kws_response
     int page, page_size;
     int matches;
     bool error;
+    struct kws_cursor cursor;
 };
 
 bool db_kw_search(struct kws_response *response, struct kws_request *request);
 
+jx_value *db_get_tokens(const char *query);
+
+bool db_parse_cursor(const char *str, struct kws_cursor *cursor);
+
+void db_format_cursor(struct kws_cursor *cursor, char *buf, size_t size);
+
+bool db_is_after_cursor(struct kws_cursor *cursor, double rank, uint32_t qid);
+
+int db_get_required_matches(struct kws_request *request, int n_tokens);
+
 void db_set_path(const char *fmt, ...);
 
+struct db_context *db_context_new();
+
+void db_context_free(struct db_context *cntx);
+
+void db_set_context(struct db_context *cntx);
+
+bool db_set_profile(const char *name);
+
 bool db_open();
 
+void db_open_deferred();
+
+bool db_open_read_only();
+
 bool db_close();
 
+void db_report_profile(FILE *fp, const char *prefix);
+
+enum db_status db_begin();
+
+enum db_status db_commit();
+
+enum db_status db_rollback();
+
+bool db_ingest_begin();
+
+bool db_ingest_add(const char *question, jx_value *answers, jx_value *keywords);
+
+bool db_ingest_end();
+
+bool db_fold_keywords();
+
+bool db_load_index();
+
+bool db_map_index(const char *path);
+
+bool db_save_index(const char *path);
+
+void db_free_index();
+
+bool db_save_vocab_filter(const char *path);
+
 bool db_get_error();
 
 const char *db_get_error_msg();
\ No newline at end of file
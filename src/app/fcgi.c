@@ -0,0 +1,563 @@
+/*
+ * fcgi.c
+ * Copyright (c) 2023, Cory Montgomery
+ *
+ * Minimal FastCGI responder (protocol version 1). Requests are served
+ * one at a time; connections may be kept open between requests when the
+ * web server asks for FCGI_KEEP_CONN, but are never multiplexed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cgi.h"
+#include "fcgi.h"
+
+#include <jx_value.h>
+
+#define FCGI_VERSION_1              1
+
+#define FCGI_BEGIN_REQUEST          1
+#define FCGI_ABORT_REQUEST          2
+#define FCGI_END_REQUEST            3
+#define FCGI_PARAMS                 4
+#define FCGI_STDIN                  5
+#define FCGI_STDOUT                 6
+#define FCGI_GET_VALUES             9
+#define FCGI_GET_VALUES_RESULT      10
+#define FCGI_UNKNOWN_TYPE           11
+
+#define FCGI_RESPONDER              1
+#define FCGI_KEEP_CONN              1
+
+#define FCGI_REQUEST_COMPLETE       0
+#define FCGI_CANT_MPX_CONN          1
+#define FCGI_UNKNOWN_ROLE           3
+
+#define FCGI_HEADER_SIZE            8
+#define FCGI_MAX_CONTENT_SIZE       65535
+#define FCGI_MAX_PADDING_SIZE       255
+#define FCGI_STDOUT_CHUNK_SIZE      65528
+#define FCGI_BEGIN_REQUEST_SIZE     8
+#define FCGI_MAX_PARAMS_SIZE        (64 * 1024)
+
+struct fcgi_header
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t id;
+    uint16_t content_size;
+    uint8_t padding_size;
+};
+
+static int fcgi_listen_fd = -1;
+
+bool fcgi_read_full(int fd, void *buf, size_t size)
+{
+    ssize_t r;
+    uint8_t *ptr = buf;
+
+    while (size > 0) {
+        r = read(fd, ptr, size);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            return false;
+
+        ptr += r;
+        size -= r;
+    }
+
+    return true;
+}
+
+bool fcgi_write_full(int fd, const void *buf, size_t size)
+{
+    ssize_t r;
+    const uint8_t *ptr = buf;
+
+    while (size > 0) {
+        r = write(fd, ptr, size);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            return false;
+
+        ptr += r;
+        size -= r;
+    }
+
+    return true;
+}
+
+bool fcgi_write_record(int fd, uint8_t type, uint16_t id, const void *content, uint16_t size)
+{
+    static const uint8_t padding[8];
+
+    uint8_t header[FCGI_HEADER_SIZE];
+    uint8_t padding_size = (8 - (size % 8)) % 8;
+
+    header[0] = FCGI_VERSION_1;
+    header[1] = type;
+    header[2] = id >> 8;
+    header[3] = id & 0xff;
+    header[4] = size >> 8;
+    header[5] = size & 0xff;
+    header[6] = padding_size;
+    header[7] = 0;
+
+    if (!fcgi_write_full(fd, header, FCGI_HEADER_SIZE))
+        return false;
+
+    if (size > 0 && !fcgi_write_full(fd, content, size))
+        return false;
+
+    return padding_size == 0 || fcgi_write_full(fd, padding, padding_size);
+}
+
+bool fcgi_write_end_request(int fd, uint16_t id, uint8_t protocol_status)
+{
+    uint8_t body[8] = { 0, 0, 0, 0, protocol_status, 0, 0, 0 };
+
+    return fcgi_write_record(fd, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+bool fcgi_read_record(int fd, struct fcgi_header *header, uint8_t *content)
+{
+    uint8_t buf[FCGI_HEADER_SIZE];
+
+    if (!fcgi_read_full(fd, buf, FCGI_HEADER_SIZE))
+        return false;
+
+    header->version = buf[0];
+    header->type = buf[1];
+    header->id = (buf[2] << 8) | buf[3];
+    header->content_size = (buf[4] << 8) | buf[5];
+    header->padding_size = buf[6];
+
+    if (header->version != FCGI_VERSION_1)
+        return false;
+
+    return fcgi_read_full(fd, content, header->content_size + header->padding_size);
+}
+
+bool fcgi_append(char **buf, size_t *size, const uint8_t *src, size_t n)
+{
+    char *ptr = realloc(*buf, *size + n + 1);
+
+    if (ptr == NULL)
+        return false;
+
+    memcpy(ptr + *size, src, n);
+
+    *size += n;
+    ptr[*size] = '\0';
+
+    *buf = ptr;
+
+    return true;
+}
+
+size_t fcgi_get_nv_length(const uint8_t **ptr, const uint8_t *end, bool *ok)
+{
+    const uint8_t *p = *ptr;
+
+    if (p >= end) {
+        *ok = false;
+        return 0;
+    }
+
+    if ((p[0] & 0x80) == 0) {
+        *ptr = p + 1;
+        return p[0];
+    }
+
+    if (p + 4 > end) {
+        *ok = false;
+        return 0;
+    }
+
+    *ptr = p + 4;
+
+    return ((size_t)(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool fcgi_parse_params(jx_value *params, const char *buf, size_t size)
+{
+    const uint8_t *ptr = (const uint8_t *)buf, *end = ptr + size;
+
+    size_t name_size, value_size;
+
+    char *name, *value;
+
+    bool ok = true;
+
+    while (ptr < end) {
+        name_size = fcgi_get_nv_length(&ptr, end, &ok);
+        value_size = fcgi_get_nv_length(&ptr, end, &ok);
+
+        if (!ok || name_size > (size_t)(end - ptr) || value_size > (size_t)(end - ptr) - name_size)
+            return false;
+
+        name = strndup((const char *)ptr, name_size);
+        value = strndup((const char *)ptr + name_size, value_size);
+
+        if (name == NULL || value == NULL) {
+            free(name);
+            free(value);
+            return false;
+        }
+
+        jxd_put_string(params, name, value);
+
+        free(name);
+        free(value);
+
+        ptr += name_size + value_size;
+    }
+
+    return true;
+}
+
+bool fcgi_send_values(int fd, const uint8_t *content, size_t size)
+{
+    static const uint8_t values[] =
+    {
+        14, 1, 'F', 'C', 'G', 'I', '_', 'M', 'A', 'X', '_', 'C', 'O', 'N', 'N', 'S', '1',
+        13, 1, 'F', 'C', 'G', 'I', '_', 'M', 'A', 'X', '_', 'R', 'E', 'Q', 'S', '1',
+        15, 1, 'F', 'C', 'G', 'I', '_', 'M', 'P', 'X', 'S', '_', 'C', 'O', 'N', 'N', 'S', '0'
+    };
+
+    return fcgi_write_record(fd, FCGI_GET_VALUES_RESULT, 0, values, sizeof(values));
+}
+
+/*
+ * Answers a request whose params or input are over the limit. The rest
+ * of it is never read, so the connection has to be closed afterwards.
+ */
+bool fcgi_write_too_large(int fd, uint16_t id)
+{
+    static const char response[] = "Status: 413\nContent-Type: text/plain\n\n";
+
+    return fcgi_write_record(fd, FCGI_STDOUT, id, response, sizeof(response) - 1) &&
+           fcgi_write_record(fd, FCGI_STDOUT, id, NULL, 0) &&
+           fcgi_write_end_request(fd, id, FCGI_REQUEST_COMPLETE);
+}
+
+void fcgi_reset_request(struct fcgi_request *req)
+{
+    if (req->params != NULL) {
+        jxv_free(req->params);
+        req->params = NULL;
+    }
+
+    free(req->input);
+
+    req->input = NULL;
+    req->input_size = 0;
+    req->id = 0;
+    req->aborted = false;
+}
+
+bool fcgi_read_request(struct fcgi_request *req)
+{
+    struct fcgi_header header;
+
+    uint8_t content[FCGI_MAX_CONTENT_SIZE + FCGI_MAX_PADDING_SIZE];
+
+    char *params_buf = NULL;
+    size_t params_size = 0;
+
+    bool begun = false, params_done = false, stdin_done = false;
+
+    while (!(begun && params_done && stdin_done)) {
+        if (!fcgi_read_record(req->fd, &header, content))
+            goto error;
+
+        if (header.id == 0) {
+            if (header.type == FCGI_GET_VALUES) {
+                if (!fcgi_send_values(req->fd, content, header.content_size))
+                    goto error;
+            }
+            else {
+                uint8_t body[8] = { header.type };
+
+                if (!fcgi_write_record(req->fd, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body)))
+                    goto error;
+            }
+
+            continue;
+        }
+
+        if (header.type == FCGI_BEGIN_REQUEST) {
+            if (begun) {
+                if (!fcgi_write_end_request(req->fd, header.id, FCGI_CANT_MPX_CONN))
+                    goto error;
+
+                continue;
+            }
+
+            if (header.content_size < FCGI_BEGIN_REQUEST_SIZE)
+                goto error;
+
+            req->keep_conn = (content[2] & FCGI_KEEP_CONN) != 0;
+
+            if (((content[0] << 8) | content[1]) != FCGI_RESPONDER) {
+                if (!fcgi_write_end_request(req->fd, header.id, FCGI_UNKNOWN_ROLE) || !req->keep_conn)
+                    goto error;
+
+                continue;
+            }
+
+            req->id = header.id;
+            req->params = jxd_new();
+
+            if (req->params == NULL)
+                goto error;
+
+            begun = true;
+
+            continue;
+        }
+
+        if (!begun || header.id != req->id)
+            continue;
+
+        switch (header.type) {
+            case FCGI_ABORT_REQUEST:
+                if (!fcgi_write_end_request(req->fd, req->id, FCGI_REQUEST_COMPLETE) || !req->keep_conn)
+                    goto error;
+
+                fcgi_reset_request(req);
+
+                free(params_buf);
+                params_buf = NULL;
+                params_size = 0;
+
+                begun = params_done = stdin_done = false;
+                break;
+            case FCGI_PARAMS:
+                if (params_size + header.content_size > FCGI_MAX_PARAMS_SIZE) {
+                    fcgi_write_too_large(req->fd, req->id);
+                    goto error;
+                }
+
+                if (header.content_size == 0)
+                    params_done = true;
+                else if (!fcgi_append(&params_buf, &params_size, content, header.content_size))
+                    goto error;
+                break;
+            case FCGI_STDIN:
+                if (req->input_size + header.content_size > CGI_MAX_INPUT_SIZE) {
+                    fcgi_write_too_large(req->fd, req->id);
+                    goto error;
+                }
+
+                if (header.content_size == 0)
+                    stdin_done = true;
+                else if (!fcgi_append(&req->input, &req->input_size, content, header.content_size))
+                    goto error;
+                break;
+        }
+    }
+
+    if (!fcgi_parse_params(req->params, params_buf, params_size))
+        goto error;
+
+    free(params_buf);
+
+    return true;
+
+error:
+    free(params_buf);
+
+    fcgi_reset_request(req);
+
+    return false;
+}
+
+int fcgi_bind_unix(const char *path)
+{
+    int fd;
+
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    bzero(&addr, sizeof(addr));
+
+    addr.sun_family = AF_UNIX;
+
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int fcgi_bind_inet(const char *address)
+{
+    int fd, on = 1;
+
+    char *host, *port;
+
+    struct addrinfo hints, *info, *ai;
+
+    host = alloca(strlen(address) + 1);
+
+    strcpy(host, address);
+
+    port = strrchr(host, ':');
+
+    if (port == NULL)
+        return -1;
+
+    *(port++) = '\0';
+
+    bzero(&hints, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &info) != 0)
+        return -1;
+
+    fd = -1;
+
+    for (ai = info; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(info);
+
+    return fd;
+}
+
+bool fcgi_open()
+{
+    struct sockaddr_storage addr;
+    socklen_t size = sizeof(addr);
+
+    const char *address = getenv("KWS_FCGI_SOCKET");
+
+    if (address != NULL && *address != '\0') {
+        if (*address == '/' || *address == '.')
+            fcgi_listen_fd = fcgi_bind_unix(address);
+        else
+            fcgi_listen_fd = fcgi_bind_inet(address);
+    }
+    /* Per the FastCGI spec, a web server that spawns us passes the
+     * listening socket as fd 0, which has no peer. */
+    else if (getpeername(0, (struct sockaddr *)&addr, &size) == -1 && errno == ENOTCONN) {
+        fcgi_listen_fd = 0;
+    }
+
+    if (fcgi_listen_fd != -1) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    return fcgi_listen_fd != -1;
+}
+
+bool fcgi_is_open()
+{
+    return fcgi_listen_fd != -1;
+}
+
+bool fcgi_accept(struct fcgi_request *req)
+{
+    if (fcgi_listen_fd == -1)
+        return false;
+
+    for (;;) {
+        if (req->fd == -1) {
+            req->fd = accept(fcgi_listen_fd, NULL, NULL);
+
+            if (req->fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+
+                return false;
+            }
+        }
+
+        if (fcgi_read_request(req))
+            return true;
+
+        close(req->fd);
+
+        req->fd = -1;
+    }
+}
+
+bool fcgi_finish(struct fcgi_request *req, const char *output, size_t size)
+{
+    bool ok = true;
+
+    size_t n;
+
+    if (req->fd == -1)
+        return false;
+
+    while (ok && size > 0) {
+        n = (size > FCGI_STDOUT_CHUNK_SIZE) ? FCGI_STDOUT_CHUNK_SIZE : size;
+
+        ok = fcgi_write_record(req->fd, FCGI_STDOUT, req->id, output, n);
+
+        output += n;
+        size -= n;
+    }
+
+    ok = ok && fcgi_write_record(req->fd, FCGI_STDOUT, req->id, NULL, 0);
+    ok = ok && fcgi_write_end_request(req->fd, req->id, FCGI_REQUEST_COMPLETE);
+
+    fcgi_reset_request(req);
+
+    if (!ok || !req->keep_conn) {
+        close(req->fd);
+        req->fd = -1;
+    }
+
+    return ok;
+}
+
+void fcgi_close()
+{
+    if (fcgi_listen_fd == -1)
+        return;
+
+    close(fcgi_listen_fd);
+
+    fcgi_listen_fd = -1;
+}
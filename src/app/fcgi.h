@@ -0,0 +1,34 @@
+/*
+ * fcgi.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct jx_value_t;
+typedef struct jx_value_t jx_value;
+
+struct fcgi_request
+{
+    int fd;
+    uint16_t id;
+    bool keep_conn;
+    bool aborted;
+
+    jx_value *params;
+
+    char *input;
+    size_t input_size;
+};
+
+bool fcgi_open();
+
+bool fcgi_is_open();
+
+bool fcgi_accept(struct fcgi_request *req);
+
+bool fcgi_finish(struct fcgi_request *req, const char *output, size_t size);
+
+void fcgi_close();
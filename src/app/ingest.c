@@ -0,0 +1,494 @@
+/*
+ * ingest.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "db.h"
+#include "tok.h"
+
+#include <jx_util.h>
+
+#define INGEST_DEFAULT_BATCH    50000
+#define INGEST_CHUNK_LINES      256
+#define INGEST_WINDOW           32
+#define INGEST_MAX_WORKERS      64
+
+/*
+ * Ingest runs as a pipeline: a reader thread cuts the input into chunks
+ * of lines, worker threads parse them and extract keywords, and the main
+ * thread writes them to SQLite in input order. At most INGEST_WINDOW
+ * chunks are in flight, which bounds both queues and the reorder buffer.
+ */
+
+struct ingest_record
+{
+    jx_value *obj;
+    jx_value *keywords;
+};
+
+struct ingest_chunk
+{
+    long seq, first_line;
+    size_t n_lines, n_ok;
+    char *text;
+    size_t text_size, text_capacity;
+    size_t offsets[INGEST_CHUNK_LINES + 1];
+    struct ingest_record records[INGEST_CHUNK_LINES];
+};
+
+struct ingest_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct ingest_chunk *items[INGEST_WINDOW];
+    size_t head, count;
+    bool closed;
+};
+
+static struct ingest_queue ingest_parse_queue, ingest_write_queue;
+
+static sem_t ingest_credits;
+
+static FILE *ingest_fp;
+
+static bool ingest_derive_keywords;
+
+static int ingest_n_workers, ingest_live_workers;
+
+static volatile bool ingest_aborted;
+
+static void ingest_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-k] [-b batch_size] [-t threads] database [file.ndjson]\n", name);
+}
+
+static void ingest_queue_init(struct ingest_queue *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void ingest_queue_push(struct ingest_queue *q, struct ingest_chunk *chunk)
+{
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count == INGEST_WINDOW)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    q->items[(q->head + q->count++) % INGEST_WINDOW] = chunk;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Returns NULL once the queue is closed and drained.
+ */
+static struct ingest_chunk *ingest_queue_pop(struct ingest_queue *q)
+{
+    struct ingest_chunk *chunk = NULL;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    if (q->count > 0) {
+        chunk = q->items[q->head];
+        q->head = (q->head + 1) % INGEST_WINDOW;
+        q->count--;
+
+        pthread_cond_signal(&q->not_full);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return chunk;
+}
+
+static void ingest_queue_close(struct ingest_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+
+    q->closed = true;
+
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void ingest_chunk_free(struct ingest_chunk *chunk)
+{
+    size_t i;
+
+    for (i = 0; i < chunk->n_lines; i++) {
+        jxv_free(chunk->records[i].obj);
+        jxv_free(chunk->records[i].keywords);
+    }
+
+    free(chunk->text);
+    free(chunk);
+}
+
+static bool ingest_chunk_append(struct ingest_chunk *chunk, const char *line, size_t length)
+{
+    size_t capacity;
+
+    char *text;
+
+    if (chunk->text_size + length + 1 > chunk->text_capacity) {
+        capacity = (chunk->text_capacity == 0) ? 65536 : chunk->text_capacity;
+
+        while (capacity < chunk->text_size + length + 1)
+            capacity *= 2;
+
+        if ((text = realloc(chunk->text, capacity)) == NULL)
+            return false;
+
+        chunk->text = text;
+        chunk->text_capacity = capacity;
+    }
+
+    memcpy(chunk->text + chunk->text_size, line, length + 1);
+
+    chunk->offsets[chunk->n_lines++] = chunk->text_size;
+    chunk->text_size += length + 1;
+    chunk->offsets[chunk->n_lines] = chunk->text_size;
+
+    return true;
+}
+
+static void *ingest_reader_main(void *arg)
+{
+    struct ingest_chunk *chunk;
+
+    char *line = NULL;
+
+    size_t line_size = 0;
+
+    ssize_t length = 0;
+
+    long seq = 0, line_no = 1;
+
+    while (length != -1) {
+        sem_wait(&ingest_credits);
+
+        if (ingest_aborted || (chunk = calloc(1, sizeof(struct ingest_chunk))) == NULL)
+            break;
+
+        chunk->seq = seq++;
+        chunk->first_line = line_no;
+
+        while (chunk->n_lines < INGEST_CHUNK_LINES && (length = getline(&line, &line_size, ingest_fp)) != -1) {
+            if (!ingest_chunk_append(chunk, line, length)) {
+                fprintf(stderr, "kws-ingest: line %ld: out of memory\n", line_no);
+                ingest_aborted = true;
+                break;
+            }
+
+            line_no++;
+        }
+
+        ingest_queue_push(&ingest_parse_queue, chunk);
+    }
+
+    free(line);
+
+    ingest_queue_close(&ingest_parse_queue);
+
+    return NULL;
+}
+
+static bool ingest_add_token(char *token, void *ptr)
+{
+    if (strlen(token) <= TOK_MAX_LENGTH && !tok_is_stopword(token))
+        jxa_push(ptr, jxs_new(token));
+
+    return true;
+}
+
+/*
+ * Keywords for a record: the ones given in the input, plus, with -k,
+ * every non-stopword token of the question.
+ */
+static jx_value *ingest_get_keywords(jx_value *obj, const char *question)
+{
+    jx_value *given, *keywords;
+
+    size_t i;
+
+    if (!ingest_derive_keywords)
+        return NULL;
+
+    given = jxd_get(obj, "keywords");
+
+    if (jxv_get_type(given) != JX_TYPE_ARRAY)
+        given = NULL;
+
+    keywords = jxa_new(16);
+
+    for (i = 0; given != NULL && i < jxa_get_length(given); i++) {
+        if (jxv_get_type(jxa_get(given, i)) == JX_TYPE_STRING)
+            jxa_push(keywords, jxs_new(jxs_get_str(jxa_get(given, i))));
+    }
+
+    tok_split(question, ingest_add_token, keywords);
+
+    return keywords;
+}
+
+static bool ingest_parse_record(struct ingest_record *record, const char *line, size_t length, long line_no)
+{
+    jx_cntx *cntx;
+
+    char *question;
+
+    bool found;
+
+    if (strspn(line, " \t\r\n") == length)
+        return true;
+
+    if ((cntx = jx_new()) == NULL)
+        return false;
+
+    if (jx_parse_json(cntx, line, length) == -1 || (record->obj = jx_get_result(cntx)) == NULL)
+        fprintf(stderr, "kws-ingest: line %ld: %s\n", line_no, jx_get_error_message(cntx));
+
+    jx_free(cntx);
+
+    if (record->obj == NULL)
+        return false;
+
+    if (jxv_get_type(record->obj) != JX_TYPE_OBJECT) {
+        fprintf(stderr, "kws-ingest: line %ld: expected an object\n", line_no);
+        return false;
+    }
+
+    question = jxd_get_string(record->obj, "question", &found);
+
+    if (!found) {
+        fprintf(stderr, "kws-ingest: line %ld: missing question\n", line_no);
+        return false;
+    }
+
+    record->keywords = ingest_get_keywords(record->obj, question);
+
+    return true;
+}
+
+static void *ingest_worker_main(void *arg)
+{
+    struct ingest_chunk *chunk;
+
+    size_t i, length;
+
+    while ((chunk = ingest_queue_pop(&ingest_parse_queue)) != NULL) {
+        for (i = 0; i < chunk->n_lines && !ingest_aborted; i++) {
+            length = chunk->offsets[i + 1] - chunk->offsets[i] - 1;
+
+            if (!ingest_parse_record(&chunk->records[i], chunk->text + chunk->offsets[i], length, chunk->first_line + i))
+                break;
+        }
+
+        chunk->n_ok = i;
+
+        ingest_queue_push(&ingest_write_queue, chunk);
+    }
+
+    if (__atomic_sub_fetch(&ingest_live_workers, 1, __ATOMIC_ACQ_REL) == 0)
+        ingest_queue_close(&ingest_write_queue);
+
+    return NULL;
+}
+
+static jx_value *ingest_get_array(jx_value *obj, char *key)
+{
+    jx_value *value = jxd_get(obj, key);
+
+    return (jxv_get_type(value) == JX_TYPE_ARRAY) ? value : NULL;
+}
+
+/*
+ * Writes the records of one chunk, committing every batch_size questions.
+ */
+static bool ingest_write_chunk(struct ingest_chunk *chunk, long batch_size, long *n_questions, long *in_batch)
+{
+    struct ingest_record *record;
+
+    size_t i;
+
+    for (i = 0; i < chunk->n_ok; i++) {
+        record = &chunk->records[i];
+
+        if (record->obj == NULL)
+            continue;
+
+        if (!db_ingest_add(jxd_get_string(record->obj, "question", NULL), ingest_get_array(record->obj, "answers"),
+            (record->keywords != NULL) ? record->keywords : ingest_get_array(record->obj, "keywords"))) {
+            fprintf(stderr, "kws-ingest: line %ld: %s\n", chunk->first_line + (long)i, db_get_error_msg());
+            return false;
+        }
+
+        if (++(*in_batch) == batch_size) {
+            if (db_commit() != DB_STATUS_OK || db_begin() != DB_STATUS_OK) {
+                fprintf(stderr, "kws-ingest: %s\n", db_get_error_msg());
+                return false;
+            }
+
+            *n_questions += *in_batch;
+            *in_batch = 0;
+        }
+    }
+
+    return chunk->n_ok == chunk->n_lines;
+}
+
+/*
+ * Loads questions from NDJSON, one object per line:
+ *
+ *   {"question": "...", "answers": ["...", ...], "keywords": ["...", ...]}
+ *
+ * Rows are written in transactions of batch_size questions, and the
+ * secondary indexes are rebuilt once at the end.
+ */
+int main(int argc, char **argv)
+{
+    struct ingest_chunk *chunk, *pending[INGEST_WINDOW] = { NULL };
+
+    pthread_t reader, workers[INGEST_MAX_WORKERS];
+
+    long batch_size = INGEST_DEFAULT_BATCH, n_questions = 0, in_batch = 0, next_seq = 0;
+
+    struct timespec start, end;
+
+    bool ok = true;
+
+    int opt, i;
+
+    ingest_fp = stdin;
+    ingest_n_workers = sysconf(_SC_NPROCESSORS_ONLN) - 2;
+
+    while ((opt = getopt(argc, argv, "b:kt:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch_size = atol(optarg);
+                break;
+            case 'k':
+                ingest_derive_keywords = true;
+                break;
+            case 't':
+                ingest_n_workers = atoi(optarg);
+                break;
+            default:
+                ingest_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (batch_size < 1 || argc - optind < 1 || argc - optind > 2) {
+        ingest_usage(argv[0]);
+        return 1;
+    }
+
+    if (ingest_n_workers < 1)
+        ingest_n_workers = 1;
+    else if (ingest_n_workers > INGEST_MAX_WORKERS)
+        ingest_n_workers = INGEST_MAX_WORKERS;
+
+    if (argc - optind == 2 && (ingest_fp = fopen(argv[optind + 1], "r")) == NULL) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    db_set_path("%s", argv[optind]);
+
+    /* opens the first batch, which the indexes are dropped in */
+    if (!db_open() || !db_ingest_begin()) {
+        fprintf(stderr, "kws-ingest: Database access error: %s\n", db_get_error_msg());
+        db_close();
+        return 1;
+    }
+
+    /* jxutil initializes its shared null and bool values lazily */
+    jxv_null();
+    jxv_bool_new(true);
+
+    ingest_queue_init(&ingest_parse_queue);
+    ingest_queue_init(&ingest_write_queue);
+
+    sem_init(&ingest_credits, 0, INGEST_WINDOW);
+
+    ingest_live_workers = ingest_n_workers;
+
+    for (i = 0; i < ingest_n_workers; i++)
+        pthread_create(&workers[i], NULL, ingest_worker_main, NULL);
+
+    pthread_create(&reader, NULL, ingest_reader_main, NULL);
+
+    while ((chunk = ingest_queue_pop(&ingest_write_queue)) != NULL) {
+        pending[chunk->seq % INGEST_WINDOW] = chunk;
+
+        while (ok && (chunk = pending[next_seq % INGEST_WINDOW]) != NULL && chunk->seq == next_seq) {
+            pending[next_seq++ % INGEST_WINDOW] = NULL;
+
+            if (!ingest_write_chunk(chunk, batch_size, &n_questions, &in_batch)) {
+                ingest_aborted = true;
+                ok = false;
+            }
+
+            ingest_chunk_free(chunk);
+
+            sem_post(&ingest_credits);
+        }
+
+        if (!ok) {
+            for (i = 0; i < INGEST_WINDOW; i++) {
+                if (pending[i] != NULL) {
+                    ingest_chunk_free(pending[i]);
+                    pending[i] = NULL;
+                    sem_post(&ingest_credits);
+                }
+            }
+        }
+    }
+
+    pthread_join(reader, NULL);
+
+    for (i = 0; i < ingest_n_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    if (ingest_fp != stdin)
+        fclose(ingest_fp);
+
+    if (ok && !ingest_aborted && db_commit() == DB_STATUS_OK) {
+        n_questions += in_batch;
+    }
+    else {
+        db_rollback();
+        ok = false;
+    }
+
+    if (!db_ingest_end()) {
+        fprintf(stderr, "kws-ingest: Index rebuild error: %s\n", db_get_error_msg());
+        ok = false;
+    }
+
+    db_close();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fprintf(stderr, "kws-ingest: %ld questions loaded in %.2fs (%d workers)\n", n_questions,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, ingest_n_workers);
+
+    return ok ? 0 : 1;
+}
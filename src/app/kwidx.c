@@ -0,0 +1,1789 @@
+/*
+ * kwidx.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "kwidx.h"
+#include "mph.h"
+#include "rank.h"
+#include "roaring.h"
+
+#include <jx_value.h>
+
+#if defined(__x86_64__) && !defined(KWS_NO_SIMD)
+#define KWIDX_X86
+#include <immintrin.h>
+#endif
+
+#define KWIDX_MIN_CAPACITY      1024
+
+/* docs per bit-packed posting block, 32 per SSE2 lane */
+#define KWIDX_BLOCK_SIZE        128
+#define KWIDX_LANES             4
+
+#define KWIDX_NO_DOC            UINT32_MAX
+
+/* 32-bit words per skip entry: last doc, data offset, shortest doc */
+#define KWIDX_SKIP_WORDS        3
+
+/* keywords in at least 1 / ratio of the docs are stored as roaring containers */
+#define KWIDX_DENSE_RATIO       16
+
+#define KWIDX_BM25_K1           1.2
+#define KWIDX_BM25_B            0.75
+
+/* keeps score bounds above scores computed in a different order */
+#define KWIDX_BOUND_SLACK       1e-9
+
+#define KWIDX_FILE_MAGIC        "KWSIDX\0\0"
+#define KWIDX_FILE_VERSION      7
+#define KWIDX_FILE_BYTE_ORDER   0x01020304
+
+enum kwidx_format
+{
+    KWIDX_FORMAT_PACKED,
+    KWIDX_FORMAT_ROARING
+};
+
+enum kwidx_section
+{
+    KWIDX_SECTION_KW_TEXT,
+    KWIDX_SECTION_KW_PILOTS,
+    KWIDX_SECTION_KW_SLOTS,
+    KWIDX_SECTION_POST_OFFSETS,
+    KWIDX_SECTION_POST_DATA,
+    KWIDX_SECTION_KW_IDF,
+    KWIDX_SECTION_DOC_QIDS,
+    KWIDX_SECTION_DOC_LENGTHS,
+    KWIDX_SECTION_DOC_TEXT,
+    KWIDX_SECTION_DOC_ANSWERS,
+    KWIDX_SECTION_ANS_TEXT,
+    KWIDX_SECTION_SA_KW,
+    KWIDX_SECTION_SA_OFF,
+    KWIDX_SECTION_TEXT,
+    KWIDX_SECTION_GUARD
+};
+
+/*
+ * Snapshot file layout: this header, followed by each array in section
+ * order, every section starting on an 8 byte boundary. Integers are in
+ * the byte order of the machine that wrote the file.
+ */
+struct kwidx_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    uint32_t n_keywords;
+    uint32_t n_docs;
+    uint32_t n_answers;
+    uint32_t n_postings;
+    uint32_t n_suffixes;
+    uint32_t mph_seed;
+    uint64_t text_size;
+    uint64_t post_size;
+
+    uint64_t offsets[KWIDX_SECTION_GUARD];
+    uint64_t sizes[KWIDX_SECTION_GUARD];
+};
+
+struct kwidx_suffix
+{
+    const char *str;
+    uint32_t kw;
+    uint32_t off;
+};
+
+/*
+ * Per-thread search scratch space: a bitmap over the docs, rounded up to
+ * whole roaring containers. It is all zero between searches.
+ */
+struct kwidx_scratch
+{
+    uint64_t *bits;
+    size_t n_words;
+};
+
+static __thread struct kwidx_scratch kwidx_scratch;
+
+/*
+ * Reads the compressed postings of one keyword, a block at a time into
+ * docs, or skipping ahead to a doc with kwidx_postings_seek().
+ */
+struct kwidx_postings
+{
+    const uint8_t *skips, *tail;
+    uint32_t n, n_full, min_length;
+
+    /* set for dense lists, which are read through roaring instead */
+    bool dense;
+    struct roaring_reader roaring;
+
+    /* next block to decode, and the last doc before it */
+    uint32_t block, base;
+
+    uint32_t docs[KWIDX_BLOCK_SIZE];
+    uint32_t n_docs, pos;
+};
+
+/*
+ * One query token during a search, positioned on doc (KWIDX_NO_DOC once
+ * exhausted). The docs of a single keyword are read from its postings;
+ * a like token matching several keywords has their union in docs.
+ * max_score bounds the token's BM25 score in any doc.
+ */
+struct kwidx_term
+{
+    struct kwidx_postings postings;
+    uint32_t *docs, n_docs, pos;
+    uint32_t n, doc;
+    double idf, max_score;
+
+    /* query tokens the term stands for */
+    uint32_t weight;
+};
+
+size_t kwidx_grow(size_t capacity, size_t needed)
+{
+    if (capacity < KWIDX_MIN_CAPACITY)
+        capacity = KWIDX_MIN_CAPACITY;
+
+    while (capacity < needed)
+        capacity *= 2;
+
+    return capacity;
+}
+
+bool kwidx_resize(void **ptr, size_t n, size_t size)
+{
+    void *p = realloc(*ptr, n * size);
+
+    if (p == NULL)
+        return false;
+
+    *ptr = p;
+
+    return true;
+}
+
+bool kwidx_add_text(struct kwidx *idx, const char *str, uint64_t *offset)
+{
+    size_t size, capacity;
+
+    if (str == NULL)
+        str = "";
+
+    size = strlen(str) + 1;
+
+    if (idx->text_size + size > idx->text_capacity) {
+        capacity = kwidx_grow(idx->text_capacity, idx->text_size + size);
+
+        if (!kwidx_resize((void **)&idx->text, capacity, 1))
+            return false;
+
+        idx->text_capacity = capacity;
+    }
+
+    memcpy(idx->text + idx->text_size, str, size);
+
+    *offset = idx->text_size;
+
+    idx->text_size += size;
+
+    return true;
+}
+
+long kwidx_find_doc(struct kwidx *idx, int qid)
+{
+    uint32_t lo = 0, hi = idx->n_docs, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (idx->doc_qids[mid] < (uint32_t)qid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < idx->n_docs && idx->doc_qids[lo] == (uint32_t)qid)
+        return lo;
+
+    return -1;
+}
+
+/*
+ * Finds a keyword's id. Finished indexes take one probe of the perfect
+ * hash and one comparison; while building, the keywords are searched.
+ */
+long kwidx_find_keyword(struct kwidx *idx, const char *keyword)
+{
+    uint32_t lo = 0, hi = idx->n_keywords, mid;
+
+    int r;
+
+    if (idx->kw_slots != NULL) {
+        if (idx->n_keywords == 0)
+            return -1;
+
+        mid = idx->kw_slots[mph_get_slot(idx->kw_pilots, idx->n_keywords, mph_hash(keyword, idx->mph_seed))];
+
+        return (strcmp(idx->text + idx->kw_text[mid], keyword) == 0) ? (long)mid : -1;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        r = strcmp(idx->text + idx->kw_text[mid], keyword);
+
+        if (r == 0)
+            return mid;
+
+        if (r < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+struct kwidx *kwidx_new()
+{
+    return calloc(1, sizeof(struct kwidx));
+}
+
+/*
+ * Questions must be added in ascending qid order.
+ */
+bool kwidx_add_question(struct kwidx *idx, int qid, const char *question)
+{
+    size_t capacity;
+
+    if (qid < 0 || (idx->n_docs > 0 && (uint32_t)qid <= idx->doc_qids[idx->n_docs - 1]))
+        return false;
+
+    if (idx->n_docs + 1 > idx->doc_capacity) {
+        capacity = kwidx_grow(idx->doc_capacity, idx->n_docs + 1);
+
+        if (!kwidx_resize((void **)&idx->doc_qids, capacity, sizeof(uint32_t)))
+            return false;
+
+        if (!kwidx_resize((void **)&idx->doc_text, capacity, sizeof(uint64_t)))
+            return false;
+
+        idx->doc_capacity = capacity;
+    }
+
+    if (!kwidx_add_text(idx, question, &idx->doc_text[idx->n_docs]))
+        return false;
+
+    idx->doc_qids[idx->n_docs++] = qid;
+
+    return true;
+}
+
+/*
+ * Answers must be added after all questions, in ascending qid order.
+ * Answers to unknown questions are ignored.
+ */
+bool kwidx_add_answer(struct kwidx *idx, int qid, const char *answer)
+{
+    long doc;
+
+    size_t capacity;
+
+    doc = kwidx_find_doc(idx, qid);
+
+    if (doc < 0)
+        return true;
+
+    if (idx->n_answers > 0 && (uint32_t)doc < idx->ans_docs[idx->n_answers - 1])
+        return false;
+
+    if (idx->n_answers + 1 > idx->ans_capacity) {
+        capacity = kwidx_grow(idx->ans_capacity, idx->n_answers + 1);
+
+        if (!kwidx_resize((void **)&idx->ans_docs, capacity, sizeof(uint32_t)))
+            return false;
+
+        if (!kwidx_resize((void **)&idx->ans_text, capacity, sizeof(uint64_t)))
+            return false;
+
+        idx->ans_capacity = capacity;
+    }
+
+    if (!kwidx_add_text(idx, answer, &idx->ans_text[idx->n_answers]))
+        return false;
+
+    idx->ans_docs[idx->n_answers++] = doc;
+
+    return true;
+}
+
+/*
+ * Keywords must be added after all questions, ordered by keyword (byte
+ * order) and then by qid. Keywords of unknown questions are ignored.
+ */
+bool kwidx_add_keyword(struct kwidx *idx, const char *keyword, int qid)
+{
+    long doc;
+
+    int r;
+
+    size_t capacity;
+
+    doc = kwidx_find_doc(idx, qid);
+
+    if (doc < 0 || keyword == NULL)
+        return true;
+
+    r = (idx->n_keywords > 0) ? strcmp(keyword, idx->text + idx->kw_text[idx->n_keywords - 1]) : 1;
+
+    if (r < 0)
+        return false;
+
+    if (r > 0) {
+        if (idx->n_keywords + 2 > idx->kw_capacity) {
+            capacity = kwidx_grow(idx->kw_capacity, idx->n_keywords + 2);
+
+            if (!kwidx_resize((void **)&idx->kw_text, capacity, sizeof(uint64_t)))
+                return false;
+
+            if (!kwidx_resize((void **)&idx->post_first, capacity, sizeof(uint32_t)))
+                return false;
+
+            idx->kw_capacity = capacity;
+        }
+
+        if (!kwidx_add_text(idx, keyword, &idx->kw_text[idx->n_keywords]))
+            return false;
+
+        idx->post_first[idx->n_keywords++] = idx->n_postings;
+    }
+    else if (idx->n_postings > idx->post_first[idx->n_keywords - 1]) {
+        /* the same keyword listed twice for one question only counts once */
+        if ((uint32_t)doc == idx->post_docs[idx->n_postings - 1])
+            return true;
+
+        if ((uint32_t)doc < idx->post_docs[idx->n_postings - 1])
+            return false;
+    }
+
+    if (idx->n_postings + 1 > idx->post_capacity) {
+        capacity = kwidx_grow(idx->post_capacity, idx->n_postings + 1);
+
+        if (!kwidx_resize((void **)&idx->post_docs, capacity, sizeof(uint32_t)))
+            return false;
+
+        idx->post_capacity = capacity;
+    }
+
+    idx->post_docs[idx->n_postings++] = doc;
+
+    return true;
+}
+
+int kwidx_compare_suffixes(const void *a, const void *b)
+{
+    const struct kwidx_suffix *x = a, *y = b;
+
+    return strcmp(x->str, y->str);
+}
+
+/*
+ * Sorts every suffix of every keyword so that the keywords containing a
+ * substring form one contiguous range of the array.
+ */
+bool kwidx_build_suffixes(struct kwidx *idx)
+{
+    struct kwidx_suffix *suffixes;
+
+    uint64_t n;
+    uint32_t k, off, i;
+
+    const char *kw;
+
+    for (n = 0, k = 0; k < idx->n_keywords; k++)
+        n += strlen(idx->text + idx->kw_text[k]);
+
+    if (n > UINT32_MAX)
+        return false;
+
+    suffixes = malloc((n + 1) * sizeof(struct kwidx_suffix));
+
+    if (suffixes == NULL)
+        return false;
+
+    for (i = 0, k = 0; k < idx->n_keywords; k++) {
+        kw = idx->text + idx->kw_text[k];
+
+        for (off = 0; kw[off] != '\0'; off++, i++) {
+            suffixes[i].str = kw + off;
+            suffixes[i].kw = k;
+            suffixes[i].off = off;
+        }
+    }
+
+    qsort(suffixes, n, sizeof(struct kwidx_suffix), kwidx_compare_suffixes);
+
+    if (!kwidx_resize((void **)&idx->sa_kw, n + 1, sizeof(uint32_t)) ||
+        !kwidx_resize((void **)&idx->sa_off, n + 1, sizeof(uint32_t))) {
+        free(suffixes);
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        idx->sa_kw[i] = suffixes[i].kw;
+        idx->sa_off[i] = suffixes[i].off;
+    }
+
+    idx->n_suffixes = n;
+
+    free(suffixes);
+
+    return true;
+}
+
+/*
+ * BM25 with every keyword occurring once in its docs: a keyword found in
+ * df of the n_docs docs scores idf(df) * weight(length) in a doc with
+ * length keywords.
+ */
+double kwidx_idf(struct kwidx *idx, uint32_t df)
+{
+    return log(1.0 + (idx->n_docs - df + 0.5) / (df + 0.5));
+}
+
+double kwidx_length_weight(struct kwidx *idx, uint32_t length)
+{
+    double avg = (idx->n_docs > 0) ? (double)idx->n_postings / idx->n_docs : 0;
+
+    if (avg == 0)
+        return 1.0;
+
+    return (KWIDX_BM25_K1 + 1) / (1 + KWIDX_BM25_K1 * (1 - KWIDX_BM25_B + KWIDX_BM25_B * length / avg));
+}
+
+static size_t kwidx_put_varint(uint8_t *out, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = v | 0x80;
+        v >>= 7;
+    }
+
+    out[n++] = v;
+
+    return n;
+}
+
+static const uint8_t *kwidx_get_varint(const uint8_t *in, uint32_t *v)
+{
+    uint32_t shift = 0;
+
+    *v = 0;
+
+    do {
+        *v |= (uint32_t)(*in & 0x7F) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+
+    return in;
+}
+
+/*
+ * Packs KWIDX_BLOCK_SIZE values of bits bits each into 16 * bits bytes.
+ * Value i goes to lane i % 4, each lane filling its own run of 32-bit
+ * words, and the lanes' words are interleaved so that four consecutive
+ * values are unpacked at once.
+ */
+static void kwidx_pack(uint8_t *out, const uint32_t *in, uint32_t bits)
+{
+    uint32_t words[KWIDX_BLOCK_SIZE], lane, i, pos, w, shift;
+
+    bzero(words, sizeof(words));
+
+    for (lane = 0; lane < KWIDX_LANES; lane++) {
+        for (i = 0, pos = 0; i < KWIDX_BLOCK_SIZE / KWIDX_LANES; i++, pos += bits) {
+            w = pos / 32;
+            shift = pos % 32;
+
+            words[w * KWIDX_LANES + lane] |= in[i * KWIDX_LANES + lane] << shift;
+
+            if (shift + bits > 32)
+                words[(w + 1) * KWIDX_LANES + lane] |= in[i * KWIDX_LANES + lane] >> (32 - shift);
+        }
+    }
+
+    memcpy(out, words, 16 * bits);
+}
+
+#ifndef KWIDX_X86
+static void kwidx_unpack_scalar(uint32_t *out, const uint8_t *in, uint32_t bits, uint32_t base)
+{
+    uint32_t words[KWIDX_BLOCK_SIZE], mask, lane, i, pos, w, shift, v;
+
+    memcpy(words, in, 16 * bits);
+
+    mask = (bits == 32) ? UINT32_MAX : (1u << bits) - 1;
+
+    for (lane = 0; lane < KWIDX_LANES; lane++) {
+        for (i = 0, pos = 0; i < KWIDX_BLOCK_SIZE / KWIDX_LANES; i++, pos += bits) {
+            w = pos / 32;
+            shift = pos % 32;
+
+            v = words[w * KWIDX_LANES + lane] >> shift;
+
+            if (shift + bits > 32)
+                v |= words[(w + 1) * KWIDX_LANES + lane] << (32 - shift);
+
+            out[i * KWIDX_LANES + lane] = v & mask;
+        }
+    }
+
+    for (i = 0; i < KWIDX_BLOCK_SIZE; i++) {
+        base += out[i];
+        out[i] = base;
+    }
+}
+#else
+/*
+ * Unpacks four deltas per step and turns them into docs with an in
+ * register prefix sum. Always inlined so that each width gets its own
+ * copy with constant shifts.
+ */
+static inline __attribute__((always_inline))
+void kwidx_unpack_sse2_bits(uint32_t *out, const uint8_t *in, const uint32_t bits, uint32_t base)
+{
+    const __m128i *src = (const __m128i *)in;
+
+    __m128i word, v, mask, sum;
+
+    uint32_t i, shift = 0;
+
+    mask = _mm_set1_epi32((bits == 32) ? UINT32_MAX : (1u << bits) - 1);
+    sum = _mm_set1_epi32(base);
+    word = _mm_loadu_si128(src++);
+
+    for (i = 0; i < KWIDX_BLOCK_SIZE / KWIDX_LANES; i++) {
+        v = _mm_srli_epi32(word, shift);
+
+        shift += bits;
+
+        if (shift > 32) {
+            word = _mm_loadu_si128(src++);
+            shift -= 32;
+            v = _mm_or_si128(v, _mm_slli_epi32(word, bits - shift));
+        }
+        else if (shift == 32 && i + 1 < KWIDX_BLOCK_SIZE / KWIDX_LANES) {
+            word = _mm_loadu_si128(src++);
+            shift = 0;
+        }
+
+        v = _mm_and_si128(v, mask);
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, sum);
+
+        _mm_storeu_si128((__m128i *)(out + i * KWIDX_LANES), v);
+
+        sum = _mm_shuffle_epi32(v, 0xFF);
+    }
+}
+
+#define KWIDX_UNPACK_CASE(b) case b: kwidx_unpack_sse2_bits(out, in, b, base); break;
+
+static void kwidx_unpack_sse2(uint32_t *out, const uint8_t *in, uint32_t bits, uint32_t base)
+{
+    switch (bits) {
+    KWIDX_UNPACK_CASE(1)  KWIDX_UNPACK_CASE(2)  KWIDX_UNPACK_CASE(3)  KWIDX_UNPACK_CASE(4)
+    KWIDX_UNPACK_CASE(5)  KWIDX_UNPACK_CASE(6)  KWIDX_UNPACK_CASE(7)  KWIDX_UNPACK_CASE(8)
+    KWIDX_UNPACK_CASE(9)  KWIDX_UNPACK_CASE(10) KWIDX_UNPACK_CASE(11) KWIDX_UNPACK_CASE(12)
+    KWIDX_UNPACK_CASE(13) KWIDX_UNPACK_CASE(14) KWIDX_UNPACK_CASE(15) KWIDX_UNPACK_CASE(16)
+    KWIDX_UNPACK_CASE(17) KWIDX_UNPACK_CASE(18) KWIDX_UNPACK_CASE(19) KWIDX_UNPACK_CASE(20)
+    KWIDX_UNPACK_CASE(21) KWIDX_UNPACK_CASE(22) KWIDX_UNPACK_CASE(23) KWIDX_UNPACK_CASE(24)
+    KWIDX_UNPACK_CASE(25) KWIDX_UNPACK_CASE(26) KWIDX_UNPACK_CASE(27) KWIDX_UNPACK_CASE(28)
+    KWIDX_UNPACK_CASE(29) KWIDX_UNPACK_CASE(30) KWIDX_UNPACK_CASE(31) KWIDX_UNPACK_CASE(32)
+    }
+}
+#endif
+
+/*
+ * Decodes a block packed by kwidx_pack(), adding the deltas up from base.
+ */
+static void kwidx_unpack(uint32_t *out, const uint8_t *in, uint32_t bits, uint32_t base)
+{
+    uint32_t i;
+
+    if (bits == 0) {
+        for (i = 0; i < KWIDX_BLOCK_SIZE; i++)
+            out[i] = base;
+
+        return;
+    }
+
+#ifdef KWIDX_X86
+    kwidx_unpack_sse2(out, in, bits, base);
+#else
+    kwidx_unpack_scalar(out, in, bits, base);
+#endif
+}
+
+/*
+ * Writes docs[0, n) as a packed list: gaps from the previous doc (the
+ * first from 0) in
+ *
+ *   n / 128 skip entries: the last doc of each full block, the offset of
+ *           its data from the first skip entry, and the fewest keywords
+ *           of any of its docs (3 x uint32_t)
+ *   n / 128 full blocks: a byte with the bit width of its largest gap,
+ *           then the 128 gaps bit-packed by kwidx_pack()
+ *   n % 128 varint gaps
+ */
+uint8_t *kwidx_encode_packed(struct kwidx *idx, uint8_t *p, const uint32_t *docs, uint32_t n)
+{
+    uint32_t gaps[KWIDX_BLOCK_SIZE], skip[KWIDX_SKIP_WORDS], b, i, n_full, prev, all, bits, min;
+
+    uint8_t *skips;
+
+    n_full = n / KWIDX_BLOCK_SIZE;
+
+    skips = p;
+    p += n_full * sizeof(skip);
+
+    for (b = 0, prev = 0; b < n_full; b++, docs += KWIDX_BLOCK_SIZE) {
+        for (i = 0, all = 0, min = UINT32_MAX; i < KWIDX_BLOCK_SIZE; i++) {
+            gaps[i] = docs[i] - prev;
+            prev = docs[i];
+            all |= gaps[i];
+
+            if (idx->doc_lengths[docs[i]] < min)
+                min = idx->doc_lengths[docs[i]];
+        }
+
+        bits = (all == 0) ? 0 : 32 - __builtin_clz(all);
+
+        skip[0] = prev;
+        skip[1] = p - skips;
+        skip[2] = min;
+
+        memcpy(skips + b * sizeof(skip), skip, sizeof(skip));
+
+        *p++ = bits;
+
+        kwidx_pack(p, gaps, bits);
+
+        p += 16 * bits;
+    }
+
+    for (i = 0; i < n % KWIDX_BLOCK_SIZE; i++) {
+        p += kwidx_put_varint(p, docs[i] - prev);
+        prev = docs[i];
+    }
+
+    return p;
+}
+
+/*
+ * Compresses the postings of every keyword, each as
+ *
+ *   varint  n, the number of docs (the keyword's document frequency)
+ *   varint  the fewest keywords of any of the docs
+ *   byte    the format, packed or roaring
+ *
+ * followed by the list. Keywords found in at least 1 / KWIDX_DENSE_RATIO
+ * of the docs are stored as roaring containers, which are intersected
+ * and merged a bitmap at a time; the others as packed lists, which are
+ * smaller and cheaper to skip through. The doc lengths bound BM25
+ * scores, for a list and for each of its blocks or containers.
+ */
+bool kwidx_encode_postings(struct kwidx *idx)
+{
+    uint32_t k, i, n, min, *docs;
+
+    size_t size = 0, capacity = 0, needed, dense_size;
+
+    uint8_t *data = NULL, *p;
+
+    bool dense;
+
+    if (!kwidx_resize((void **)&idx->post_offsets, idx->n_keywords + 1, sizeof(uint64_t)))
+        return false;
+
+    for (k = 0; k < idx->n_keywords; k++) {
+        docs = idx->post_docs + idx->post_first[k];
+        n = ((k + 1 < idx->n_keywords) ? idx->post_first[k + 1] : idx->n_postings) - idx->post_first[k];
+
+        dense = n >= KWIDX_BLOCK_SIZE && (uint64_t)n * KWIDX_DENSE_RATIO >= idx->n_docs;
+
+        if (dense) {
+            dense_size = roaring_encode(NULL, docs, n, idx->doc_lengths);
+            needed = size + 11 + dense_size;
+        }
+        else {
+            needed = size + 11 + (size_t)(n / KWIDX_BLOCK_SIZE) * (KWIDX_SKIP_WORDS * sizeof(uint32_t) + 1 + 16 * 32) +
+                     (size_t)(n % KWIDX_BLOCK_SIZE) * 5;
+        }
+
+        if (needed > capacity) {
+            capacity = kwidx_grow(capacity, needed);
+
+            if (!kwidx_resize((void **)&data, capacity, 1))
+                goto error;
+        }
+
+        idx->post_offsets[k] = size;
+
+        for (i = 0, min = UINT32_MAX; i < n; i++) {
+            if (idx->doc_lengths[docs[i]] < min)
+                min = idx->doc_lengths[docs[i]];
+        }
+
+        p = data + size;
+        p += kwidx_put_varint(p, n);
+        p += kwidx_put_varint(p, min);
+
+        *p++ = dense ? KWIDX_FORMAT_ROARING : KWIDX_FORMAT_PACKED;
+
+        if (dense)
+            p += roaring_encode(p, docs, n, idx->doc_lengths);
+        else
+            p = kwidx_encode_packed(idx, p, docs, n);
+
+        size = p - data;
+    }
+
+    idx->post_offsets[idx->n_keywords] = size;
+
+    if (size > 0)
+        kwidx_resize((void **)&data, size, 1);
+
+    idx->post_data = data;
+    idx->post_size = size;
+
+    free(idx->post_first);
+    free(idx->post_docs);
+
+    idx->post_first = NULL;
+    idx->post_docs = NULL;
+
+    return true;
+
+error:
+    free(data);
+
+    return false;
+}
+
+static uint32_t kwidx_skip_entry(struct kwidx_postings *p, uint32_t block, int field)
+{
+    uint32_t skip[KWIDX_SKIP_WORDS];
+
+    memcpy(skip, p->skips + block * sizeof(skip), sizeof(skip));
+
+    return skip[field];
+}
+
+void kwidx_postings_open(struct kwidx *idx, uint32_t k, struct kwidx_postings *p)
+{
+    const uint8_t *last;
+
+    p->skips = kwidx_get_varint(idx->post_data + idx->post_offsets[k], &p->n);
+    p->skips = kwidx_get_varint(p->skips, &p->min_length);
+    p->dense = *p->skips++ == KWIDX_FORMAT_ROARING;
+
+    if (p->dense) {
+        roaring_open(&p->roaring, p->skips);
+
+        p->n_full = 0;
+        p->n_docs = 0;
+        p->pos = 0;
+
+        return;
+    }
+
+    p->n_full = p->n / KWIDX_BLOCK_SIZE;
+    p->tail = p->skips + p->n_full * KWIDX_SKIP_WORDS * sizeof(uint32_t);
+
+    if (p->n_full > 0) {
+        last = p->skips + kwidx_skip_entry(p, p->n_full - 1, 1);
+        p->tail = last + 1 + 16 * last[0];
+    }
+
+    p->block = 0;
+    p->base = 0;
+    p->n_docs = 0;
+    p->pos = 0;
+}
+
+/*
+ * Decodes the next block into p->docs. Returns its number of docs, 0 at
+ * the end of the list.
+ */
+uint32_t kwidx_postings_next(struct kwidx_postings *p)
+{
+    const uint8_t *in;
+
+    uint32_t i, gap;
+
+    if (p->dense) {
+        p->n_docs = roaring_next(&p->roaring, p->docs, KWIDX_BLOCK_SIZE);
+        p->pos = 0;
+
+        return p->n_docs;
+    }
+
+    if (p->block < p->n_full) {
+        in = p->skips + kwidx_skip_entry(p, p->block, 1);
+
+        kwidx_unpack(p->docs, in + 1, in[0], p->base);
+
+        p->n_docs = KWIDX_BLOCK_SIZE;
+        p->base = p->docs[KWIDX_BLOCK_SIZE - 1];
+    }
+    else if (p->block == p->n_full && p->n % KWIDX_BLOCK_SIZE > 0) {
+        p->n_docs = p->n % KWIDX_BLOCK_SIZE;
+
+        for (i = 0, in = p->tail; i < p->n_docs; i++) {
+            in = kwidx_get_varint(in, &gap);
+            p->base += gap;
+            p->docs[i] = p->base;
+        }
+    }
+    else {
+        p->n_docs = 0;
+        p->pos = 0;
+
+        return 0;
+    }
+
+    p->block++;
+    p->pos = 0;
+
+    return p->n_docs;
+}
+
+/*
+ * Moves to the first doc >= target, using the skip entries to pass over
+ * whole blocks without decoding them. Returns false if there is none.
+ */
+bool kwidx_postings_seek(struct kwidx_postings *p, uint32_t target, uint32_t *doc)
+{
+    for (;;) {
+        if (p->pos < p->n_docs && p->docs[p->n_docs - 1] >= target) {
+            while (p->docs[p->pos] < target)
+                p->pos++;
+
+            *doc = p->docs[p->pos];
+
+            return true;
+        }
+
+        if (p->dense)
+            roaring_seek(&p->roaring, target);
+
+        while (p->block < p->n_full && kwidx_skip_entry(p, p->block, 0) < target)
+            p->base = kwidx_skip_entry(p, p->block++, 0);
+
+        if (kwidx_postings_next(p) == 0)
+            return false;
+    }
+}
+
+/*
+ * Counts the keywords of every doc and the idf of every keyword, for
+ * BM25. Keywords are unique per doc, so a keyword's document frequency
+ * is the length of its posting list.
+ */
+bool kwidx_build_stats(struct kwidx *idx)
+{
+    uint32_t k, p, n;
+
+    idx->doc_lengths = calloc(idx->n_docs + 1, sizeof(uint32_t));
+    idx->kw_idf = malloc((idx->n_keywords + 1) * sizeof(float));
+
+    if (idx->doc_lengths == NULL || idx->kw_idf == NULL)
+        return false;
+
+    for (p = 0; p < idx->n_postings; p++)
+        idx->doc_lengths[idx->post_docs[p]]++;
+
+    for (k = 0; k < idx->n_keywords; k++) {
+        n = ((k + 1 < idx->n_keywords) ? idx->post_first[k + 1] : idx->n_postings) - idx->post_first[k];
+        idx->kw_idf[k] = kwidx_idf(idx, n);
+    }
+
+    return true;
+}
+
+/*
+ * Builds the minimal perfect hash of the keywords, for exact lookups.
+ */
+bool kwidx_build_mph(struct kwidx *idx)
+{
+    const char **keys;
+
+    uint32_t k;
+
+    bool ok;
+
+    keys = malloc(((size_t)idx->n_keywords + 1) * sizeof(const char *));
+    idx->kw_pilots = malloc((size_t)mph_get_n_buckets(idx->n_keywords) * sizeof(uint32_t));
+    idx->kw_slots = malloc(((size_t)idx->n_keywords + 1) * sizeof(uint32_t));
+
+    if (keys == NULL || idx->kw_pilots == NULL || idx->kw_slots == NULL) {
+        free(keys);
+        return false;
+    }
+
+    for (k = 0; k < idx->n_keywords; k++)
+        keys[k] = idx->text + idx->kw_text[k];
+
+    ok = mph_build(keys, idx->n_keywords, idx->kw_pilots, idx->kw_slots, &idx->mph_seed);
+
+    free(keys);
+
+    return ok;
+}
+
+bool kwidx_finish(struct kwidx *idx)
+{
+    uint32_t d, a;
+
+    if (!kwidx_build_stats(idx) || !kwidx_encode_postings(idx))
+        return false;
+
+    if (!kwidx_resize((void **)&idx->doc_answers, idx->n_docs + 1, sizeof(uint32_t)))
+        return false;
+
+    for (d = 0, a = 0; d <= idx->n_docs; d++) {
+        while (a < idx->n_answers && idx->ans_docs[a] < d)
+            a++;
+
+        idx->doc_answers[d] = a;
+    }
+
+    free(idx->ans_docs);
+
+    idx->ans_docs = NULL;
+
+    return kwidx_build_suffixes(idx) && kwidx_build_mph(idx);
+}
+
+void kwidx_free(struct kwidx *idx)
+{
+    if (idx == NULL)
+        return;
+
+    if (idx->map_base != NULL) {
+        munmap(idx->map_base, idx->map_size);
+        free(idx);
+        return;
+    }
+
+    free(idx->kw_text);
+    free(idx->kw_pilots);
+    free(idx->kw_slots);
+    free(idx->post_offsets);
+    free(idx->post_data);
+    free(idx->post_first);
+    free(idx->post_docs);
+    free(idx->kw_idf);
+    free(idx->doc_lengths);
+    free(idx->doc_qids);
+    free(idx->doc_text);
+    free(idx->doc_answers);
+    free(idx->ans_text);
+    free(idx->ans_docs);
+    free(idx->sa_kw);
+    free(idx->sa_off);
+    free(idx->text);
+    free(idx);
+}
+
+void kwidx_get_sections(struct kwidx *idx, void **ptrs, uint64_t *sizes)
+{
+    ptrs[KWIDX_SECTION_KW_TEXT] = idx->kw_text;
+    ptrs[KWIDX_SECTION_KW_PILOTS] = idx->kw_pilots;
+    ptrs[KWIDX_SECTION_KW_SLOTS] = idx->kw_slots;
+    ptrs[KWIDX_SECTION_POST_OFFSETS] = idx->post_offsets;
+    ptrs[KWIDX_SECTION_POST_DATA] = idx->post_data;
+    ptrs[KWIDX_SECTION_KW_IDF] = idx->kw_idf;
+    ptrs[KWIDX_SECTION_DOC_QIDS] = idx->doc_qids;
+    ptrs[KWIDX_SECTION_DOC_LENGTHS] = idx->doc_lengths;
+    ptrs[KWIDX_SECTION_DOC_TEXT] = idx->doc_text;
+    ptrs[KWIDX_SECTION_DOC_ANSWERS] = idx->doc_answers;
+    ptrs[KWIDX_SECTION_ANS_TEXT] = idx->ans_text;
+    ptrs[KWIDX_SECTION_SA_KW] = idx->sa_kw;
+    ptrs[KWIDX_SECTION_SA_OFF] = idx->sa_off;
+    ptrs[KWIDX_SECTION_TEXT] = idx->text;
+
+    sizes[KWIDX_SECTION_KW_TEXT] = (uint64_t)idx->n_keywords * sizeof(uint64_t);
+    sizes[KWIDX_SECTION_KW_PILOTS] = (uint64_t)mph_get_n_buckets(idx->n_keywords) * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_KW_SLOTS] = (uint64_t)idx->n_keywords * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_POST_OFFSETS] = ((uint64_t)idx->n_keywords + 1) * sizeof(uint64_t);
+    sizes[KWIDX_SECTION_POST_DATA] = idx->post_size;
+    sizes[KWIDX_SECTION_KW_IDF] = (uint64_t)idx->n_keywords * sizeof(float);
+    sizes[KWIDX_SECTION_DOC_QIDS] = (uint64_t)idx->n_docs * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_DOC_LENGTHS] = (uint64_t)idx->n_docs * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_DOC_TEXT] = (uint64_t)idx->n_docs * sizeof(uint64_t);
+    sizes[KWIDX_SECTION_DOC_ANSWERS] = ((uint64_t)idx->n_docs + 1) * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_ANS_TEXT] = (uint64_t)idx->n_answers * sizeof(uint64_t);
+    sizes[KWIDX_SECTION_SA_KW] = (uint64_t)idx->n_suffixes * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_SA_OFF] = (uint64_t)idx->n_suffixes * sizeof(uint32_t);
+    sizes[KWIDX_SECTION_TEXT] = idx->text_size;
+}
+
+/*
+ * Writes a finished index to path. The file is written under a
+ * temporary name and renamed into place, so processes that map the old
+ * snapshot keep a consistent view.
+ */
+bool kwidx_save(struct kwidx *idx, const char *path)
+{
+    static const uint8_t padding[8];
+
+    struct kwidx_file_header header;
+
+    void *ptrs[KWIDX_SECTION_GUARD];
+
+    uint64_t offset;
+
+    char *tmp_path;
+
+    FILE *fp;
+
+    int i;
+
+    bool ok;
+
+    bzero(&header, sizeof(header));
+
+    memcpy(header.magic, KWIDX_FILE_MAGIC, sizeof(header.magic));
+
+    header.version = KWIDX_FILE_VERSION;
+    header.byte_order = KWIDX_FILE_BYTE_ORDER;
+    header.n_keywords = idx->n_keywords;
+    header.n_docs = idx->n_docs;
+    header.n_answers = idx->n_answers;
+    header.n_postings = idx->n_postings;
+    header.n_suffixes = idx->n_suffixes;
+    header.text_size = idx->text_size;
+    header.post_size = idx->post_size;
+    header.mph_seed = idx->mph_seed;
+
+    kwidx_get_sections(idx, ptrs, header.sizes);
+
+    offset = sizeof(header);
+
+    for (i = 0; i < KWIDX_SECTION_GUARD; i++) {
+        offset = (offset + 7) & ~(uint64_t)7;
+        header.offsets[i] = offset;
+        offset += header.sizes[i];
+    }
+
+    tmp_path = alloca(strlen(path) + 5);
+
+    sprintf(tmp_path, "%s.tmp", path);
+
+    if ((fp = fopen(tmp_path, "wb")) == NULL)
+        return false;
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    offset = sizeof(header);
+
+    for (i = 0; ok && i < KWIDX_SECTION_GUARD; i++) {
+        ok = fwrite(padding, 1, header.offsets[i] - offset, fp) == header.offsets[i] - offset;
+
+        if (ok && header.sizes[i] > 0)
+            ok = fwrite(ptrs[i], header.sizes[i], 1, fp) == 1;
+
+        offset = header.offsets[i] + header.sizes[i];
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Maps a snapshot written by kwidx_save(). The mapping is shared and read
+ * only, so every process serving from the same file shares its pages.
+ */
+struct kwidx *kwidx_map(const char *path)
+{
+    int fd, i;
+
+    struct stat st;
+    struct kwidx_file_header *header;
+    struct kwidx *idx;
+
+    uint64_t sizes[KWIDX_SECTION_GUARD];
+    void *ptrs[KWIDX_SECTION_GUARD];
+    uint8_t *base;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct kwidx_file_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    header = (struct kwidx_file_header *)base;
+    idx = calloc(1, sizeof(struct kwidx));
+
+    if (idx == NULL)
+        goto error;
+
+    if (memcmp(header->magic, KWIDX_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != KWIDX_FILE_VERSION || header->byte_order != KWIDX_FILE_BYTE_ORDER)
+        goto error;
+
+    idx->n_keywords = header->n_keywords;
+    idx->n_docs = header->n_docs;
+    idx->n_answers = header->n_answers;
+    idx->n_postings = header->n_postings;
+    idx->n_suffixes = header->n_suffixes;
+    idx->text_size = header->text_size;
+    idx->post_size = header->post_size;
+    idx->mph_seed = header->mph_seed;
+
+    kwidx_get_sections(idx, ptrs, sizes);
+
+    for (i = 0; i < KWIDX_SECTION_GUARD; i++) {
+        if (header->sizes[i] != sizes[i] || header->offsets[i] % 8 != 0 ||
+            header->offsets[i] > (uint64_t)st.st_size || sizes[i] > (uint64_t)st.st_size - header->offsets[i])
+            goto error;
+    }
+
+    if (idx->text_size > 0 && base[header->offsets[KWIDX_SECTION_TEXT] + idx->text_size - 1] != '\0')
+        goto error;
+
+    if (((uint64_t *)(base + header->offsets[KWIDX_SECTION_POST_OFFSETS]))[idx->n_keywords] != idx->post_size)
+        goto error;
+
+    idx->kw_text = (uint64_t *)(base + header->offsets[KWIDX_SECTION_KW_TEXT]);
+    idx->kw_pilots = (uint32_t *)(base + header->offsets[KWIDX_SECTION_KW_PILOTS]);
+    idx->kw_slots = (uint32_t *)(base + header->offsets[KWIDX_SECTION_KW_SLOTS]);
+    idx->post_offsets = (uint64_t *)(base + header->offsets[KWIDX_SECTION_POST_OFFSETS]);
+    idx->post_data = base + header->offsets[KWIDX_SECTION_POST_DATA];
+    idx->kw_idf = (float *)(base + header->offsets[KWIDX_SECTION_KW_IDF]);
+    idx->doc_qids = (uint32_t *)(base + header->offsets[KWIDX_SECTION_DOC_QIDS]);
+    idx->doc_lengths = (uint32_t *)(base + header->offsets[KWIDX_SECTION_DOC_LENGTHS]);
+    idx->doc_text = (uint64_t *)(base + header->offsets[KWIDX_SECTION_DOC_TEXT]);
+    idx->doc_answers = (uint32_t *)(base + header->offsets[KWIDX_SECTION_DOC_ANSWERS]);
+    idx->ans_text = (uint64_t *)(base + header->offsets[KWIDX_SECTION_ANS_TEXT]);
+    idx->sa_kw = (uint32_t *)(base + header->offsets[KWIDX_SECTION_SA_KW]);
+    idx->sa_off = (uint32_t *)(base + header->offsets[KWIDX_SECTION_SA_OFF]);
+    idx->text = (char *)(base + header->offsets[KWIDX_SECTION_TEXT]);
+
+    idx->map_base = base;
+    idx->map_size = st.st_size;
+
+    return idx;
+
+error:
+    free(idx);
+
+    munmap(base, st.st_size);
+
+    return NULL;
+}
+
+bool kwidx_reserve_scratch(uint32_t n_docs)
+{
+    struct kwidx_scratch *s = &kwidx_scratch;
+
+    size_t n_words = ((size_t)(n_docs >> 16) + 1) * ROARING_CHUNK_WORDS;
+
+    if (s->n_words >= n_words && s->bits != NULL)
+        return true;
+
+    free(s->bits);
+
+    s->bits = calloc(n_words, sizeof(uint64_t));
+    s->n_words = (s->bits != NULL) ? n_words : 0;
+
+    return s->bits != NULL;
+}
+
+const char *kwidx_get_suffix(struct kwidx *idx, uint32_t i)
+{
+    return idx->text + idx->kw_text[idx->sa_kw[i]] + idx->sa_off[i];
+}
+
+/*
+ * Finds the range [*first, *last) of suffixes that start with str, which
+ * is the set of keywords containing str (a keyword may appear more than
+ * once).
+ */
+void kwidx_find_suffixes(struct kwidx *idx, const char *str, uint32_t *first, uint32_t *last)
+{
+    uint32_t lo, hi, mid;
+
+    size_t len = strlen(str);
+
+    lo = 0;
+    hi = idx->n_suffixes;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (strncmp(kwidx_get_suffix(idx, mid), str, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *first = lo;
+
+    hi = idx->n_suffixes;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (strncmp(kwidx_get_suffix(idx, mid), str, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *last = lo;
+}
+
+int kwidx_compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+uint32_t kwidx_postings_count(struct kwidx *idx, uint32_t k)
+{
+    uint32_t n;
+
+    kwidx_get_varint(idx->post_data + idx->post_offsets[k], &n);
+
+    return n;
+}
+
+/*
+ * Moves term to its first doc >= target.
+ */
+void kwidx_term_seek(struct kwidx_term *term, uint32_t target)
+{
+    uint32_t lo, hi, mid;
+
+    if (term->doc == KWIDX_NO_DOC || term->doc >= target)
+        return;
+
+    if (term->docs == NULL) {
+        if (!kwidx_postings_seek(&term->postings, target, &term->doc))
+            term->doc = KWIDX_NO_DOC;
+
+        return;
+    }
+
+    lo = term->pos;
+    hi = term->n_docs;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (term->docs[mid] < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    term->pos = lo;
+    term->doc = (lo < term->n_docs) ? term->docs[lo] : KWIDX_NO_DOC;
+}
+
+void kwidx_term_open(struct kwidx *idx, struct kwidx_term *term, uint32_t k)
+{
+    kwidx_postings_open(idx, k, &term->postings);
+
+    term->docs = NULL;
+    term->n = term->postings.n;
+    term->doc = 0;
+    term->weight = 1;
+    term->idf = idx->kw_idf[k];
+    term->max_score = term->idf * kwidx_length_weight(idx, term->postings.min_length);
+
+    if (!kwidx_postings_seek(&term->postings, 0, &term->doc))
+        term->doc = KWIDX_NO_DOC;
+}
+
+/*
+ * Opens a term over every keyword containing token. Returns false, with
+ * *ok still true, if no keyword does. The lists are merged in the scratch
+ * bitmap, dense ones a container at a time.
+ */
+bool kwidx_term_open_like(struct kwidx *idx, struct kwidx_term *term, const char *token, bool *ok)
+{
+    struct kwidx_scratch *s = &kwidx_scratch;
+    struct kwidx_postings p;
+
+    uint32_t first, last, i, j, n, d, min, *kids;
+
+    uint64_t df;
+
+    *ok = true;
+
+    kwidx_find_suffixes(idx, token, &first, &last);
+
+    if (first == last)
+        return false;
+
+    n = last - first;
+    kids = malloc(n * sizeof(uint32_t));
+
+    if (kids == NULL) {
+        *ok = false;
+        return false;
+    }
+
+    memcpy(kids, idx->sa_kw + first, n * sizeof(uint32_t));
+
+    qsort(kids, n, sizeof(uint32_t), kwidx_compare_ids);
+
+    for (i = 1, j = 1; i < n; i++) {
+        if (kids[i] != kids[j - 1])
+            kids[j++] = kids[i];
+    }
+
+    n = j;
+
+    if (n == 1) {
+        kwidx_term_open(idx, term, kids[0]);
+        free(kids);
+        return true;
+    }
+
+    for (i = 0, min = UINT32_MAX; i < n; i++) {
+        kwidx_postings_open(idx, kids[i], &p);
+
+        if (p.min_length < min)
+            min = p.min_length;
+
+        if (p.dense) {
+            roaring_or(s->bits, s->n_words, p.roaring.data);
+            continue;
+        }
+
+        while (kwidx_postings_next(&p) > 0) {
+            for (j = 0; j < p.n_docs; j++) {
+                d = p.docs[j];
+                s->bits[d / 64] |= (uint64_t)1 << (d % 64);
+            }
+        }
+    }
+
+    free(kids);
+
+    df = roaring_popcount(s->bits, s->n_words);
+
+    term->docs = malloc((df + 1) * sizeof(uint32_t));
+
+    if (term->docs == NULL) {
+        bzero(s->bits, s->n_words * sizeof(uint64_t));
+        *ok = false;
+        return false;
+    }
+
+    term->n_docs = roaring_extract(s->bits, s->n_words, term->docs);
+    term->n = term->n_docs;
+    term->pos = 0;
+    term->doc = term->docs[0];
+    term->weight = 1;
+    term->idf = kwidx_idf(idx, term->n_docs);
+    term->max_score = term->idf * kwidx_length_weight(idx, min);
+
+    return true;
+}
+
+/*
+ * Orders terms by their current doc. Only the terms that moved are out
+ * of place, so insertion sort is close to linear.
+ */
+void kwidx_sort_terms(struct kwidx_term **terms, uint32_t n)
+{
+    struct kwidx_term *term;
+
+    uint32_t i, j;
+
+    for (i = 1; i < n; i++) {
+        term = terms[i];
+
+        for (j = i; j > 0 && terms[j - 1]->doc > term->doc; j--)
+            terms[j] = terms[j - 1];
+
+        terms[j] = term;
+    }
+}
+
+/*
+ * Bounds the term's score in the docs from target to *last, the end of
+ * the block (or roaring container) holding target, from the skip entries
+ * or container headers alone. Union terms and the varint tail of a list
+ * only have their overall bound.
+ */
+double kwidx_term_block_bound(struct kwidx *idx, struct kwidx_term *term, uint32_t target, uint32_t *last)
+{
+    struct kwidx_postings *p = &term->postings;
+
+    uint32_t b, min;
+
+    *last = KWIDX_NO_DOC - 1;
+
+    if (term->docs != NULL)
+        return term->max_score;
+
+    if (p->dense) {
+        if (p->pos < p->n_docs && p->docs[p->n_docs - 1] >= target) {
+            *last = p->docs[p->n_docs - 1];
+            return term->max_score;
+        }
+
+        if (roaring_bound(&p->roaring, target, last, &min))
+            return term->idf * kwidx_length_weight(idx, min);
+
+        return term->max_score;
+    }
+
+    /* starting from the decoded block, which may still hold target */
+    for (b = (p->block > 0) ? p->block - 1 : 0; b < p->n_full; b++) {
+        if (kwidx_skip_entry(p, b, 0) >= target) {
+            *last = kwidx_skip_entry(p, b, 0);
+            return term->idf * kwidx_length_weight(idx, kwidx_skip_entry(p, b, 2));
+        }
+    }
+
+    return term->max_score;
+}
+
+/*
+ * Keeps the best docs after the cursor matching at least required terms,
+ * using block-max WAND. With the terms ordered by their current doc, the
+ * pivot is the first doc at which enough terms could be present, with
+ * large enough score bounds, to beat the worst kept hit. If the bounds of
+ * the blocks holding the pivot rule it out after all, the terms skip past
+ * the nearest block end; otherwise the terms before the pivot skip to it.
+ * Docs that cannot enter the heap are never scored, and skipped blocks
+ * are never decoded.
+ */
+void kwidx_wand(struct kwidx *idx, struct kwidx_term *terms, struct kwidx_term **order, uint32_t n,
+    uint32_t required, struct kws_cursor *cursor, struct rank_heap *heap)
+{
+    uint32_t p, i, pivot, next, last, matched;
+
+    double bound, threshold, score;
+
+    for (;;) {
+        kwidx_sort_terms(order, n);
+
+        threshold = (heap->size < heap->capacity) ? -1 : heap->hits[0].rank;
+
+        for (p = 0, bound = 0, matched = 0; p < n && order[p]->doc != KWIDX_NO_DOC; p++) {
+            bound += order[p]->max_score;
+            matched += order[p]->weight;
+
+            if (matched >= required && bound + KWIDX_BOUND_SLACK > threshold)
+                break;
+        }
+
+        if (p == n || order[p]->doc == KWIDX_NO_DOC)
+            return;
+
+        pivot = order[p]->doc;
+
+        while (p + 1 < n && order[p + 1]->doc == pivot)
+            p++;
+
+        for (i = 0, bound = 0, next = KWIDX_NO_DOC; i <= p; i++) {
+            bound += kwidx_term_block_bound(idx, order[i], pivot, &last);
+
+            if (last + 1 < next)
+                next = last + 1;
+        }
+
+        if (bound + KWIDX_BOUND_SLACK <= threshold) {
+            if (p + 1 < n && order[p + 1]->doc < next)
+                next = order[p + 1]->doc;
+
+            for (i = 0; i <= p; i++)
+                kwidx_term_seek(order[i], next);
+
+            continue;
+        }
+
+        if (order[0]->doc != pivot) {
+            for (i = 0; i < p; i++)
+                kwidx_term_seek(order[i], pivot);
+
+            continue;
+        }
+
+        /* summed in query order, so a doc's score does not depend on how it was reached */
+        for (i = 0, matched = 0, score = 0; i < n; i++) {
+            if (terms[i].doc == pivot) {
+                score += terms[i].idf;
+                matched += terms[i].weight;
+
+                kwidx_term_seek(&terms[i], pivot + 1);
+            }
+        }
+
+        score *= kwidx_length_weight(idx, idx->doc_lengths[pivot]);
+
+        if (matched >= required && db_is_after_cursor(cursor, score, idx->doc_qids[pivot]))
+            rank_heap_push(heap, score, pivot);
+    }
+}
+
+/*
+ * When every token must match, intersects the dense terms up front, a
+ * roaring container at a time in the scratch bitmap, into the first of
+ * them. It then stands for all of them (their idfs summed, in query
+ * order), and the others are left empty.
+ */
+bool kwidx_intersect_dense(struct kwidx *idx, struct kwidx_term *terms, uint32_t n)
+{
+    struct kwidx_scratch *s = &kwidx_scratch;
+    struct kwidx_term *first = NULL;
+
+    uint32_t i, k, size = UINT32_MAX, min = UINT32_MAX;
+
+    double idf = 0;
+
+    for (i = 0, k = 0; i < n; i++) {
+        if (terms[i].docs == NULL && terms[i].postings.dense) {
+            k++;
+
+            if (terms[i].n < size)
+                size = terms[i].n;
+        }
+    }
+
+    if (k < 2)
+        return true;
+
+    for (i = 0; i < n; i++) {
+        if (terms[i].docs != NULL || !terms[i].postings.dense)
+            continue;
+
+        if (first == NULL) {
+            first = &terms[i];
+            first->weight = 0;
+
+            roaring_or(s->bits, s->n_words, first->postings.roaring.data);
+        }
+        else {
+            roaring_and(s->bits, s->n_words, terms[i].postings.roaring.data);
+            terms[i].doc = KWIDX_NO_DOC;
+        }
+
+        idf += terms[i].idf;
+        first->weight++;
+    }
+
+    first->idf = idf;
+
+    first->docs = malloc(((size_t)size + 1) * sizeof(uint32_t));
+
+    if (first->docs == NULL) {
+        bzero(s->bits, s->n_words * sizeof(uint64_t));
+        return false;
+    }
+
+    first->n_docs = roaring_extract(s->bits, s->n_words, first->docs);
+    first->n = first->n_docs;
+    first->pos = 0;
+    first->doc = (first->n_docs > 0) ? first->docs[0] : KWIDX_NO_DOC;
+
+    for (i = 0; i < first->n_docs; i++) {
+        if (idx->doc_lengths[first->docs[i]] < min)
+            min = idx->doc_lengths[first->docs[i]];
+    }
+
+    first->max_score = first->idf * kwidx_length_weight(idx, min);
+
+    return true;
+}
+
+jx_value *kwidx_get_question(struct kwidx *idx, struct rank_hit *hit)
+{
+    uint32_t a;
+
+    jx_value *qt_object, *a_list;
+
+    qt_object = jxd_new();
+    a_list = jxa_new(10);
+
+    jxd_put_string(qt_object, "question", idx->text + idx->doc_text[hit->id]);
+    jxd_put_number(qt_object, "rank", hit->rank);
+
+    for (a = idx->doc_answers[hit->id]; a < idx->doc_answers[hit->id + 1]; a++) {
+        jxa_push(a_list, jxs_new(idx->text + idx->ans_text[a]));
+    }
+
+    jxd_put(qt_object, "answers", a_list);
+
+    return qt_object;
+}
+
+/*
+ * Ranks questions by BM25 over the query tokens they match, keeping
+ * those that match as many as the request's match mode requires. Exact
+ * searches match whole keywords, like searches match any keyword that
+ * contains the token. Pages are counted in questions, and only the
+ * questions up to the end of the requested page (or the page after the
+ * cursor) are kept and sorted.
+ */
+bool kwidx_search(struct kwidx *idx, jx_value *tokens, struct kws_response *response, struct kws_request *request)
+{
+    struct kwidx_term *terms, **order;
+    struct rank_heap heap;
+
+    uint32_t t, n_tokens, n_terms, i, first, last, required;
+
+    uint64_t total, offset;
+
+    long kid;
+
+    const char *token;
+
+    bool ok = true;
+
+    jx_value *qt_list;
+
+    if (!kwidx_reserve_scratch(idx->n_docs))
+        return false;
+
+    n_tokens = jxa_get_length(tokens);
+
+    terms = calloc(n_tokens + 1, sizeof(struct kwidx_term));
+    order = calloc(n_tokens + 1, sizeof(struct kwidx_term *));
+
+    if (terms == NULL || order == NULL) {
+        free(terms);
+        free(order);
+        return false;
+    }
+
+    for (t = 0, n_terms = 0, total = 0; ok && t < n_tokens; t++) {
+        token = jxs_get_str(jxa_get(tokens, t));
+
+        if (request->type == KW_SEARCH_TYPE_EXACT) {
+            if ((kid = kwidx_find_keyword(idx, token)) < 0)
+                continue;
+
+            kwidx_term_open(idx, &terms[n_terms], kid);
+        }
+        else if (!kwidx_term_open_like(idx, &terms[n_terms], token, &ok)) {
+            continue;
+        }
+
+        total += terms[n_terms].n;
+
+        order[n_terms] = &terms[n_terms];
+        n_terms++;
+    }
+
+    required = db_get_required_matches(request, n_tokens);
+
+    if (ok && required == n_tokens && n_terms == n_tokens)
+        ok = kwidx_intersect_dense(idx, terms, n_terms);
+
+    if (request->page_size > 0) {
+        offset = (request->page > 1 && !request->cursor.set) ? (uint64_t)request->page_size * (request->page - 1) : 0;
+
+        /* a page past the last doc is empty, and needs no ranking */
+        if (offset < idx->n_docs) {
+            first = offset;
+            last = (offset + request->page_size < idx->n_docs) ? offset + request->page_size : idx->n_docs;
+        }
+        else {
+            first = last = 0;
+        }
+    }
+    else {
+        first = 0;
+        last = (total < idx->n_docs) ? total : idx->n_docs;
+    }
+
+    if (last > idx->n_docs)
+        last = idx->n_docs;
+
+    if (first > last)
+        first = last;
+
+    ok = ok && rank_heap_init(&heap, last);
+
+    if (ok && required > 0 && n_terms >= required && heap.capacity > 0)
+        kwidx_wand(idx, terms, order, n_terms, required, &request->cursor, &heap);
+
+    for (i = 0; i < n_terms; i++)
+        free(terms[i].docs);
+
+    free(terms);
+    free(order);
+
+    if (!ok)
+        return false;
+
+    rank_heap_sort(&heap);
+
+    if (last > heap.size)
+        last = heap.size;
+
+    if (first > last)
+        first = last;
+
+    qt_list = jxa_new(10);
+
+    for (i = first; i < last; i++) {
+        jxa_push(qt_list, kwidx_get_question(idx, &heap.hits[i]));
+    }
+
+    if (request->page_size > 0 && last - first == (uint32_t)request->page_size) {
+        response->cursor.rank = heap.hits[last - 1].rank;
+        response->cursor.qid = idx->doc_qids[heap.hits[last - 1].id];
+        response->cursor.set = true;
+    }
+
+    rank_heap_free(&heap);
+
+    response->result = qt_list;
+    response->matches = n_terms;
+
+    return true;
+}
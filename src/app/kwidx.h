@@ -0,0 +1,100 @@
+/*
+ * kwidx.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct jx_value_t;
+typedef struct jx_value_t jx_value;
+
+struct kws_request;
+struct kws_response;
+
+/*
+ * In-memory inverted index over the keywords table. Questions are
+ * numbered 0..n_docs-1 in qid order ("doc ids"), keywords 0..n_keywords-1
+ * in byte order ("keyword ids"). All arrays are flat so that an index can
+ * be written to and read from a file as-is.
+ */
+struct kwidx
+{
+    uint32_t n_keywords;
+    uint32_t n_docs;
+    uint32_t n_answers;
+    uint32_t n_postings;
+    uint32_t n_suffixes;
+
+    /* keyword k is the string at text + kw_text[k] */
+    uint64_t *kw_text;
+
+    /*
+     * minimal perfect hash of the keywords (see mph.h): the keyword that
+     * hashes to slot s is kw_slots[s]
+     */
+    uint32_t *kw_pilots;
+    uint32_t *kw_slots;
+    uint32_t mph_seed;
+
+    /*
+     * docs containing keyword k, compressed: the bytes at post_data +
+     * post_offsets[k] (see kwidx_encode_postings())
+     */
+    uint64_t *post_offsets;
+    uint8_t *post_data;
+    uint64_t post_size;
+
+    /* BM25 statistics: idf of keyword k, number of keywords of doc d */
+    float *kw_idf;
+    uint32_t *doc_lengths;
+
+    /* question of doc d: text + doc_text[d] */
+    uint32_t *doc_qids;
+    uint64_t *doc_text;
+
+    /* answers of doc d: text + ans_text[a] for a in [doc_answers[d], doc_answers[d + 1]) */
+    uint32_t *doc_answers;
+    uint64_t *ans_text;
+
+    /*
+     * suffix array over the vocabulary: suffix i is the string at
+     * text + kw_text[sa_kw[i]] + sa_off[i], sorted in byte order
+     */
+    uint32_t *sa_kw;
+    uint32_t *sa_off;
+
+    char *text;
+    uint64_t text_size;
+
+    /* set when the arrays point into a mapped snapshot file */
+    void *map_base;
+    size_t map_size;
+
+    /* build state, unused once kwidx_finish() returns */
+    size_t kw_capacity, post_capacity, doc_capacity, ans_capacity, text_capacity;
+    uint32_t *ans_docs;
+
+    /* uncompressed postings of keyword k: post_docs[post_first[k] .. post_first[k + 1]) */
+    uint32_t *post_first;
+    uint32_t *post_docs;
+};
+
+struct kwidx *kwidx_new();
+
+bool kwidx_add_question(struct kwidx *idx, int qid, const char *question);
+
+bool kwidx_add_answer(struct kwidx *idx, int qid, const char *answer);
+
+bool kwidx_add_keyword(struct kwidx *idx, const char *keyword, int qid);
+
+bool kwidx_finish(struct kwidx *idx);
+
+void kwidx_free(struct kwidx *idx);
+
+bool kwidx_save(struct kwidx *idx, const char *path);
+
+struct kwidx *kwidx_map(const char *path);
+
+bool kwidx_search(struct kwidx *idx, jx_value *tokens, struct kws_response *response, struct kws_request *request);
@@ -0,0 +1,1088 @@
+/*
+ * kwsd.c
+ * Copyright (c) 2023, Cory Montgomery
+ *
+ * Standalone HTTP/1.1 server. Runs the search and index handlers
+ * in-process from a non-blocking epoll loop with keep-alive, and serves
+ * the static/ directory directly.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "cgi.h"
+#include "db.h"
+#include "rcache.h"
+
+#include <jx_value.h>
+
+#define KWSD_DEFAULT_PORT           "8080"
+#define KWSD_DEFAULT_STATIC_ROOT    "static"
+#define KWSD_MAX_EVENTS             64
+#define KWSD_READ_SIZE              8192
+#define KWSD_MAX_HEADER_SIZE        (16 * 1024)
+#define KWSD_MAX_BODY_SIZE          CGI_MAX_INPUT_SIZE
+#define KWSD_MAX_INPUT_SIZE         (KWSD_MAX_HEADER_SIZE + KWSD_MAX_BODY_SIZE)
+#define KWSD_MAX_PENDING_OUTPUT     (1024 * 1024)
+#define KWSD_IDLE_TIMEOUT           30
+#define KWSD_MAX_WORKERS            256
+
+void search_cgi_begin();
+void search_cgi_main();
+void search_cgi_end();
+
+void index_cgi_begin();
+void index_cgi_main();
+void index_cgi_end();
+
+static const struct cgi_handler search_app = { search_cgi_begin, search_cgi_main, search_cgi_end };
+static const struct cgi_handler index_app = { index_cgi_begin, index_cgi_main, index_cgi_end };
+
+struct kwsd_buf
+{
+    char *ptr;
+    size_t size, capacity;
+};
+
+struct kwsd_worker;
+
+struct kwsd_conn
+{
+    int fd;
+
+    struct kwsd_worker *worker;
+
+    struct kwsd_buf in, out;
+    size_t out_pos;
+
+    bool want_read;
+    bool want_write;
+    bool close_after_write;
+
+    /* the client has shut down its side; what is buffered is all there is */
+    bool peer_closed;
+
+    time_t last_active;
+
+    char remote_addr[INET6_ADDRSTRLEN];
+
+    struct kwsd_conn *prev, *next;
+};
+
+struct kwsd_request
+{
+    char *head;
+
+    char *method;
+    char *target;
+    char *path;
+    char *query;
+    char *protocol;
+
+    char *host;
+    char *cookie;
+    char *content_type;
+
+    const char *body;
+    size_t content_length;
+
+    bool keep_alive;
+    bool is_head;
+};
+
+/*
+ * Each worker thread runs its own event loop on its own SO_REUSEPORT
+ * listening socket, with its own read-only database connection, so
+ * workers never share connections or statements.
+ */
+struct kwsd_worker
+{
+    pthread_t thread;
+
+    int epoll_fd;
+    int listen_fd;
+
+    struct kwsd_conn *conns;
+
+    time_t last_idle_scan;
+};
+
+static const char *kwsd_address;
+static const char *kwsd_static_root = KWSD_DEFAULT_STATIC_ROOT;
+static const char *kwsd_port = KWSD_DEFAULT_PORT;
+static volatile sig_atomic_t kwsd_running = 1;
+static bool kwsd_use_db;
+
+const char *kwsd_status_string(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 302: return "Found";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+    }
+}
+
+const char *kwsd_mime_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+
+    if (ext == NULL)
+        return "application/octet-stream";
+
+    if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    if (strcmp(ext, ".js") == 0)
+        return "text/javascript";
+    if (strcmp(ext, ".html") == 0)
+        return "text/html";
+    if (strcmp(ext, ".json") == 0)
+        return "application/json";
+    if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    if (strcmp(ext, ".svg") == 0)
+        return "image/svg+xml";
+    if (strcmp(ext, ".ico") == 0)
+        return "image/x-icon";
+
+    return "application/octet-stream";
+}
+
+bool kwsd_buf_reserve(struct kwsd_buf *buf, size_t n)
+{
+    size_t capacity;
+    char *ptr;
+
+    if (buf->size + n <= buf->capacity)
+        return true;
+
+    capacity = (buf->capacity == 0) ? KWSD_READ_SIZE : buf->capacity;
+
+    while (capacity < buf->size + n)
+        capacity *= 2;
+
+    ptr = realloc(buf->ptr, capacity);
+
+    if (ptr == NULL)
+        return false;
+
+    buf->ptr = ptr;
+    buf->capacity = capacity;
+
+    return true;
+}
+
+bool kwsd_buf_append(struct kwsd_buf *buf, const void *data, size_t n)
+{
+    if (!kwsd_buf_reserve(buf, n))
+        return false;
+
+    memcpy(buf->ptr + buf->size, data, n);
+
+    buf->size += n;
+
+    return true;
+}
+
+bool kwsd_buf_printf(struct kwsd_buf *buf, const char *fmt, ...)
+{
+    va_list ap;
+
+    int size;
+
+    va_start(ap, fmt);
+    size = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (size < 0 || !kwsd_buf_reserve(buf, size + 1))
+        return false;
+
+    va_start(ap, fmt);
+    vsnprintf(buf->ptr + buf->size, size + 1, fmt, ap);
+    va_end(ap);
+
+    buf->size += size;
+
+    return true;
+}
+
+void kwsd_buf_consume(struct kwsd_buf *buf, size_t n)
+{
+    if (n >= buf->size) {
+        buf->size = 0;
+        return;
+    }
+
+    memmove(buf->ptr, buf->ptr + n, buf->size - n);
+
+    buf->size -= n;
+}
+
+void kwsd_begin_response(struct kwsd_conn *c, int status, bool keep_alive)
+{
+    kwsd_buf_printf(&c->out, "HTTP/1.1 %d %s\r\n", status, kwsd_status_string(status));
+    kwsd_buf_printf(&c->out, "Server: kwsd\r\n");
+    kwsd_buf_printf(&c->out, "Connection: %s\r\n", keep_alive ? "keep-alive" : "close");
+
+    if (!keep_alive)
+        c->close_after_write = true;
+}
+
+void kwsd_end_response(struct kwsd_conn *c, struct kwsd_request *r, const char *body, size_t size)
+{
+    kwsd_buf_printf(&c->out, "Content-Length: %lu\r\n\r\n", size);
+
+    if (r == NULL || !r->is_head)
+        kwsd_buf_append(&c->out, body, size);
+}
+
+void kwsd_send_error(struct kwsd_conn *c, struct kwsd_request *r, int status)
+{
+    const char *msg = kwsd_status_string(status);
+
+    kwsd_begin_response(c, status, r != NULL && r->keep_alive);
+    kwsd_buf_printf(&c->out, "Content-Type: text/plain\r\n");
+    kwsd_end_response(c, r, msg, strlen(msg));
+}
+
+/*
+ * Translates the CGI response produced by a handler (Status: line,
+ * headers, blank line, body) into an HTTP/1.1 response.
+ */
+void kwsd_send_cgi_response(struct kwsd_conn *c, struct kwsd_request *r, char *output, size_t size)
+{
+    int status = 200;
+
+    char *line, *end, *headers_end;
+
+    headers_end = (output != NULL) ? memmem(output, size, "\n\n", 2) : NULL;
+
+    if (headers_end == NULL) {
+        kwsd_send_error(c, r, 500);
+        return;
+    }
+
+    *headers_end = '\0';
+
+    for (line = output; line < headers_end; line = end + 1) {
+        if ((end = strchr(line, '\n')) == NULL)
+            end = headers_end;
+
+        *end = '\0';
+
+        if (strncasecmp(line, "Status:", 7) == 0)
+            status = (int)strtol(line + 7, NULL, 10);
+    }
+
+    kwsd_begin_response(c, status, r->keep_alive);
+
+    for (line = output; line < headers_end; line += strlen(line) + 1) {
+        if (strncasecmp(line, "Status:", 7) == 0 || strncasecmp(line, "Content-Length:", 15) == 0)
+            continue;
+
+        kwsd_buf_printf(&c->out, "%s\r\n", line);
+    }
+
+    kwsd_end_response(c, r, headers_end + 2, size - (headers_end + 2 - output));
+}
+
+void kwsd_put_param(jx_value *params, const char *key, const char *value)
+{
+    if (value != NULL)
+        jxd_put_string(params, (char *)key, (char *)value);
+}
+
+void kwsd_run_app(struct kwsd_conn *c, struct kwsd_request *r, const struct cgi_handler *app)
+{
+    jx_value *params;
+
+    FILE *out;
+    char *output = NULL, *server_name, *sep, length[24];
+    size_t output_size = 0;
+
+    params = jxd_new();
+
+    if (params == NULL || (out = open_memstream(&output, &output_size)) == NULL) {
+        jxv_free(params);
+        kwsd_send_error(c, r, 500);
+        return;
+    }
+
+    snprintf(length, sizeof(length), "%lu", r->content_length);
+
+    kwsd_put_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    kwsd_put_param(params, "SERVER_SOFTWARE", "kwsd");
+    kwsd_put_param(params, "SERVER_PROTOCOL", r->protocol);
+    kwsd_put_param(params, "SERVER_PORT", kwsd_port);
+    kwsd_put_param(params, "REQUEST_METHOD", r->method);
+    kwsd_put_param(params, "REQUEST_URI", r->target);
+    kwsd_put_param(params, "SCRIPT_NAME", r->path);
+    kwsd_put_param(params, "QUERY_STRING", (r->query != NULL) ? r->query : "");
+    kwsd_put_param(params, "CONTENT_LENGTH", length);
+    kwsd_put_param(params, "CONTENT_TYPE", r->content_type);
+    kwsd_put_param(params, "HTTP_COOKIE", r->cookie);
+    kwsd_put_param(params, "HTTP_HOST", r->host);
+    kwsd_put_param(params, "REMOTE_ADDR", c->remote_addr);
+
+    if (r->host != NULL) {
+        server_name = alloca(strlen(r->host) + 1);
+
+        strcpy(server_name, r->host);
+
+        if ((sep = strrchr(server_name, ':')) != NULL && strchr(sep, ']') == NULL)
+            *sep = '\0';
+
+        kwsd_put_param(params, "SERVER_NAME", server_name);
+    }
+
+    cgi_set_request(params, r->body, r->content_length, out);
+
+    cgi_handle_request(app);
+
+    cgi_close_stream();
+
+    fclose(out);
+
+    cgi_clear_request();
+
+    jxv_free(params);
+
+    kwsd_send_cgi_response(c, r, output, output_size);
+
+    free(output);
+}
+
+void kwsd_serve_file(struct kwsd_conn *c, struct kwsd_request *r)
+{
+    int fd;
+
+    struct stat st;
+
+    char *path, *body;
+    const char *rel;
+
+    ssize_t n;
+    size_t pos;
+
+    if (strcmp(r->method, "GET") != 0 && !r->is_head) {
+        kwsd_send_error(c, r, 405);
+        return;
+    }
+
+    if (strstr(r->path, "..") != NULL) {
+        kwsd_send_error(c, r, 403);
+        return;
+    }
+
+    rel = (strncmp(r->path, "/static/", 8) == 0) ? r->path + 7 : r->path;
+
+    path = alloca(strlen(kwsd_static_root) + strlen(rel) + 1);
+
+    sprintf(path, "%s%s", kwsd_static_root, rel);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        kwsd_send_error(c, r, 404);
+        return;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        kwsd_send_error(c, r, 404);
+        return;
+    }
+
+    body = malloc(st.st_size + 1);
+
+    if (body == NULL) {
+        close(fd);
+        kwsd_send_error(c, r, 500);
+        return;
+    }
+
+    for (pos = 0; pos < (size_t)st.st_size; pos += n) {
+        n = read(fd, body + pos, st.st_size - pos);
+
+        if (n <= 0)
+            break;
+    }
+
+    close(fd);
+
+    kwsd_begin_response(c, 200, r->keep_alive);
+    kwsd_buf_printf(&c->out, "Content-Type: %s\r\n", kwsd_mime_type(path));
+    kwsd_end_response(c, r, body, pos);
+
+    free(body);
+}
+
+void kwsd_dispatch(struct kwsd_conn *c, struct kwsd_request *r)
+{
+    if (strcmp(r->path, "/") == 0 || strcmp(r->path, "/index") == 0 || strcmp(r->path, "/index.cgi") == 0)
+        kwsd_run_app(c, r, &index_app);
+    else if (strcmp(r->path, "/search") == 0 || strcmp(r->path, "/search.cgi") == 0)
+        kwsd_run_app(c, r, &search_app);
+    else
+        kwsd_serve_file(c, r);
+}
+
+char *kwsd_next_token(char **ptr, const char *delim)
+{
+    char *tok = *ptr, *end;
+
+    end = strpbrk(tok, delim);
+
+    if (end == NULL) {
+        *ptr = tok + strlen(tok);
+    }
+    else {
+        *end = '\0';
+        *ptr = end + 1;
+    }
+
+    return tok;
+}
+
+/*
+ * Parses one request from the connection's input buffer. The request
+ * head is copied to r->head, which the caller frees; the body is left in
+ * the input buffer. Returns the number of bytes the request occupies, 0
+ * when more input is needed, or a negative HTTP status when the request
+ * is rejected.
+ */
+long kwsd_parse_request(struct kwsd_conn *c, struct kwsd_request *r)
+{
+    char *head_end, *line, *ptr, *name, *value, *connection;
+
+    size_t head_size;
+
+    bzero(r, sizeof(*r));
+
+    head_end = (c->in.size > 0) ? memmem(c->in.ptr, c->in.size, "\r\n\r\n", 4) : NULL;
+
+    if (head_end == NULL)
+        return (c->in.size > KWSD_MAX_HEADER_SIZE) ? -431 : 0;
+
+    head_size = head_end - c->in.ptr + 4;
+
+    if ((r->head = strndup(c->in.ptr, head_size - 4)) == NULL)
+        return -500;
+
+    ptr = r->head;
+    line = kwsd_next_token(&ptr, "\n");
+
+    r->method = kwsd_next_token(&line, " ");
+    r->target = kwsd_next_token(&line, " ");
+    r->protocol = kwsd_next_token(&line, "\r");
+
+    if (*r->method == '\0' || *r->target != '/')
+        return -400;
+
+    if (strcmp(r->protocol, "HTTP/1.1") == 0)
+        r->keep_alive = true;
+    else if (strcmp(r->protocol, "HTTP/1.0") != 0)
+        return -505;
+
+    connection = NULL;
+
+    while (*ptr != '\0') {
+        line = kwsd_next_token(&ptr, "\n");
+
+        name = kwsd_next_token(&line, ":");
+        value = kwsd_next_token(&line, "\r");
+
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (strcasecmp(name, "Host") == 0)
+            r->host = value;
+        else if (strcasecmp(name, "Cookie") == 0)
+            r->cookie = value;
+        else if (strcasecmp(name, "Content-Type") == 0)
+            r->content_type = value;
+        else if (strcasecmp(name, "Content-Length") == 0)
+            r->content_length = strtoul(value, NULL, 10);
+        else if (strcasecmp(name, "Connection") == 0)
+            connection = value;
+        else if (strcasecmp(name, "Transfer-Encoding") == 0)
+            return -501;
+    }
+
+    if (connection != NULL) {
+        if (strcasecmp(connection, "close") == 0)
+            r->keep_alive = false;
+        else if (strcasecmp(connection, "keep-alive") == 0)
+            r->keep_alive = true;
+    }
+
+    if (r->content_length > KWSD_MAX_BODY_SIZE)
+        return -413;
+
+    if (c->in.size < head_size + r->content_length)
+        return 0;
+
+    r->body = c->in.ptr + head_size;
+    r->is_head = strcmp(r->method, "HEAD") == 0;
+
+    r->path = kwsd_next_token(&r->target, "?");
+    r->query = (*r->target != '\0') ? r->target : NULL;
+    r->target = r->path;
+
+    return head_size + r->content_length;
+}
+
+void kwsd_close(struct kwsd_conn *c)
+{
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        c->worker->conns = c->next;
+
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+
+    close(c->fd);
+
+    free(c->in.ptr);
+    free(c->out.ptr);
+    free(c);
+}
+
+size_t kwsd_get_pending_output(struct kwsd_conn *c)
+{
+    return c->out.size - c->out_pos;
+}
+
+/*
+ * Input is only watched while it can be used: not after the client has
+ * shut down its side, and not while its responses are backed up.
+ */
+bool kwsd_set_events(struct kwsd_conn *c, bool want_write)
+{
+    struct epoll_event ev;
+
+    bool want_read = !c->peer_closed && kwsd_get_pending_output(c) < KWSD_MAX_PENDING_OUTPUT;
+
+    if (c->want_read == want_read && c->want_write == want_write)
+        return true;
+
+    ev.events = (want_read ? EPOLLIN | EPOLLRDHUP : 0) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+
+    if (epoll_ctl(c->worker->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        return false;
+
+    c->want_read = want_read;
+    c->want_write = want_write;
+
+    return true;
+}
+
+/*
+ * Returns false when the connection has been closed.
+ */
+bool kwsd_flush(struct kwsd_conn *c)
+{
+    ssize_t n;
+
+    while (c->out_pos < c->out.size) {
+        n = write(c->fd, c->out.ptr + c->out_pos, c->out.size - c->out_pos);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!kwsd_set_events(c, true))
+                    break;
+
+                return true;
+            }
+
+            break;
+        }
+
+        c->out_pos += n;
+    }
+
+    if (c->out_pos < c->out.size || c->close_after_write) {
+        kwsd_close(c);
+        return false;
+    }
+
+    c->out.size = 0;
+    c->out_pos = 0;
+
+    if (!kwsd_set_events(c, false)) {
+        kwsd_close(c);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Answers the complete requests in the input buffer, pipelined ones
+ * included, until KWSD_MAX_PENDING_OUTPUT bytes of responses are waiting
+ * to be written; the rest is parsed once they are. Returns false when the
+ * connection has been closed.
+ */
+bool kwsd_process(struct kwsd_conn *c)
+{
+    struct kwsd_request r;
+
+    long n;
+
+    bool backed_up;
+
+    for (;;) {
+        backed_up = false;
+
+        while (!c->close_after_write) {
+            if (kwsd_get_pending_output(c) >= KWSD_MAX_PENDING_OUTPUT) {
+                backed_up = true;
+                break;
+            }
+
+            n = kwsd_parse_request(c, &r);
+
+            if (n <= 0) {
+                free(r.head);
+
+                if (n < 0)
+                    kwsd_send_error(c, NULL, (int)-n);
+
+                break;
+            }
+
+            /* nothing can follow the last buffered request of a closed peer */
+            if (c->peer_closed && (size_t)n == c->in.size)
+                r.keep_alive = false;
+
+            kwsd_dispatch(c, &r);
+
+            free(r.head);
+
+            kwsd_buf_consume(&c->in, n);
+        }
+
+        if (c->peer_closed && !backed_up)
+            c->close_after_write = true;
+
+        if (!kwsd_flush(c))
+            return false;
+
+        /* kwsd_flush() empties the buffer once everything is written */
+        if (!backed_up || c->out.size > 0)
+            return true;
+    }
+}
+
+void kwsd_on_readable(struct kwsd_conn *c)
+{
+    ssize_t n;
+
+    bool eof = false;
+
+    /*
+     * Reading stops at KWSD_MAX_INPUT_SIZE even if more is pending: by then
+     * kwsd_parse_request() either has a request or rejects the input, and
+     * the rest is read on the next (level triggered) wakeup.
+     */
+    while (c->in.size <= KWSD_MAX_INPUT_SIZE) {
+        if (!kwsd_buf_reserve(&c->in, KWSD_READ_SIZE)) {
+            kwsd_close(c);
+            return;
+        }
+
+        n = read(c->fd, c->in.ptr + c->in.size, KWSD_READ_SIZE);
+
+        if (n > 0) {
+            c->in.size += n;
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            eof = true;
+
+        break;
+    }
+
+    c->last_active = time(NULL);
+
+    /* requests already buffered are still answered before closing */
+    if (eof)
+        c->peer_closed = true;
+
+    kwsd_process(c);
+}
+
+void kwsd_accept(struct kwsd_worker *w)
+{
+    int fd, on = 1;
+
+    struct sockaddr_storage addr;
+    socklen_t size;
+
+    struct kwsd_conn *c;
+    struct epoll_event ev;
+
+    for (;;) {
+        size = sizeof(addr);
+
+        fd = accept4(w->listen_fd, (struct sockaddr *)&addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            return;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        c = calloc(1, sizeof(*c));
+
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->worker = w;
+        c->want_read = true;
+        c->last_active = time(NULL);
+
+        if (addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, c->remote_addr, sizeof(c->remote_addr));
+        else if (addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, c->remote_addr, sizeof(c->remote_addr));
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        c->next = w->conns;
+
+        if (w->conns != NULL)
+            w->conns->prev = c;
+
+        w->conns = c;
+    }
+}
+
+void kwsd_close_idle(struct kwsd_worker *w)
+{
+    struct kwsd_conn *c, *next;
+
+    time_t now = time(NULL);
+
+    if (now == w->last_idle_scan)
+        return;
+
+    w->last_idle_scan = now;
+
+    for (c = w->conns; c != NULL; c = next) {
+        next = c->next;
+
+        if (now - c->last_active > KWSD_IDLE_TIMEOUT)
+            kwsd_close(c);
+    }
+}
+
+int kwsd_listen(const char *host, const char *port)
+{
+    int fd, on = 1;
+
+    struct addrinfo hints, *info, *ai;
+
+    bzero(&hints, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host, port, &hints, &info) != 0)
+        return -1;
+
+    fd = -1;
+
+    for (ai = info; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+
+        if (fd == -1)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(info);
+
+    return fd;
+}
+
+void kwsd_stop(int sig)
+{
+    kwsd_running = 0;
+}
+
+bool kwsd_worker_init(struct kwsd_worker *w)
+{
+    struct epoll_event ev;
+
+    if ((w->listen_fd = kwsd_listen(kwsd_address, kwsd_port)) == -1) {
+        fprintf(stderr, "kwsd: Unable to listen on port %s: %s\n", kwsd_port, strerror(errno));
+        return false;
+    }
+
+    if ((w->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fprintf(stderr, "kwsd: epoll_create1: %s\n", strerror(errno));
+        return false;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) == -1) {
+        fprintf(stderr, "kwsd: epoll_ctl: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void *kwsd_worker_main(void *ptr)
+{
+    int i, n;
+
+    struct kwsd_worker *w = ptr;
+    struct kwsd_conn *c;
+    struct db_context *db_cntx;
+
+    struct epoll_event events[KWSD_MAX_EVENTS];
+
+    db_cntx = db_context_new();
+
+    db_set_context(db_cntx);
+
+    if (db_cntx == NULL || (kwsd_use_db && !db_open_read_only())) {
+        fprintf(stderr, "kwsd: Database access error: %s\n", db_get_error_msg());
+        kwsd_running = 0;
+        return NULL;
+    }
+
+    while (kwsd_running) {
+        n = epoll_wait(w->epoll_fd, events, KWSD_MAX_EVENTS, 1000);
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c == NULL) {
+                kwsd_accept(w);
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR) {
+                kwsd_close(c);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                c->last_active = time(NULL);
+
+                if (!kwsd_flush(c))
+                    continue;
+
+                /* requests left unparsed while the output was backed up, or the close after them */
+                if (c->out.size == 0 && (c->in.size > 0 || c->peer_closed) && !kwsd_process(c))
+                    continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                kwsd_on_readable(c);
+        }
+
+        kwsd_close_idle(w);
+    }
+
+    while (w->conns != NULL)
+        kwsd_close(w->conns);
+
+    db_set_context(NULL);
+
+    db_context_free(db_cntx);
+
+    return NULL;
+}
+
+void kwsd_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-a address] [-p port] [-s static_root] [-t threads]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, n_workers, n_started;
+
+    const char *db_path, *index_path, *engine, *cache_name;
+
+    struct kwsd_worker *workers;
+
+    n_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "a:p:s:t:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                kwsd_address = optarg;
+                break;
+            case 'p':
+                kwsd_port = optarg;
+                break;
+            case 's':
+                kwsd_static_root = optarg;
+                break;
+            case 't':
+                n_workers = (int)strtol(optarg, NULL, 10);
+                break;
+            default:
+                kwsd_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (n_workers < 1)
+        n_workers = 1;
+    else if (n_workers > KWSD_MAX_WORKERS)
+        n_workers = KWSD_MAX_WORKERS;
+
+    index_path = getenv("KWS_INDEX_PATH");
+    db_path = getenv("KWS_DB_PATH");
+
+    if (index_path != NULL) {
+        if (!db_map_index(index_path)) {
+            fprintf(stderr, "kwsd: Index load error: %s\n", db_get_error_msg());
+            return 1;
+        }
+    }
+    else if (db_path == NULL) {
+        fprintf(stderr, "kwsd: No path to database set in environment\n");
+        return 1;
+    }
+
+    if (db_path != NULL) {
+        db_set_path("%s", db_path);
+
+        if (!db_set_profile((getenv("KWS_DB_PROFILE") != NULL) ? getenv("KWS_DB_PROFILE") : "default")) {
+            fprintf(stderr, "kwsd: Unknown database profile %s\n", getenv("KWS_DB_PROFILE"));
+            return 1;
+        }
+
+        if (!db_open_read_only()) {
+            fprintf(stderr, "kwsd: Database access error: %s\n", db_get_error_msg());
+            return 1;
+        }
+
+        db_report_profile(stderr, "kwsd");
+        db_close();
+
+        kwsd_use_db = true;
+    }
+
+    engine = getenv("KWS_ENGINE");
+
+    if (index_path == NULL && engine != NULL && strcmp(engine, "index") == 0) {
+        if (!db_open_read_only() || !db_load_index()) {
+            fprintf(stderr, "kwsd: Index load error: %s\n", db_get_error_msg());
+            return 1;
+        }
+
+        db_close();
+    }
+
+    cache_name = getenv("KWS_RESULT_CACHE");
+
+    if (cache_name != NULL && !rcache_open(cache_name, (index_path != NULL) ? index_path : db_path))
+        fprintf(stderr, "kwsd: Unable to open result cache %s, continuing without it\n", cache_name);
+
+    /* jxutil initializes its shared null and bool values lazily */
+    jxv_null();
+    jxv_bool_new(true);
+
+    workers = calloc(n_workers, sizeof(struct kwsd_worker));
+
+    if (workers == NULL)
+        return 1;
+
+    for (i = 0; i < n_workers; i++) {
+        if (!kwsd_worker_init(&workers[i]))
+            return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, kwsd_stop);
+    signal(SIGTERM, kwsd_stop);
+
+    for (n_started = 0; n_started < n_workers; n_started++) {
+        if (pthread_create(&workers[n_started].thread, NULL, kwsd_worker_main, &workers[n_started]) != 0) {
+            fprintf(stderr, "kwsd: pthread_create: %s\n", strerror(errno));
+            kwsd_running = 0;
+            break;
+        }
+    }
+
+    for (i = 0; i < n_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        close(workers[i].epoll_fd);
+        close(workers[i].listen_fd);
+    }
+
+    free(workers);
+
+    db_free_index();
+
+    rcache_close();
+
+    return 0;
+}
@@ -4,107 +4,150 @@
  * All Rights Reserved.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include "db.h"
 #include "cgi.h"
 #include "util.h"
+#include "fcgi.h"
+#include "rcache.h"
 
-extern int _cgi_http_status;
-extern char *_cgi_http_status_str;
-extern enum http_content_type _cgi_http_content_type;
-extern bool _cgi_exit;
+static const struct cgi_handler app = { cgi_begin, cgi_main, cgi_end };
 
-bool should_dumpenv()
-{
-    return cgi_is_debug() && cgi_get_int_from_query_string("dumpenv", NULL) == 1;
-}
-
-void cgi_send_error_response(const char *err_msg)
+/*
+ * Persistent mode: the database handle and its statement cache stay warm
+ * across requests, and only the per-request cgi state is reset.
+ */
+int fcgi_main()
 {
-    _cgi_exit = true;
-
-    cgi_set_status(500);
-    
-    cgi_set_content_type(HTTP_CONTENT_TYPE_TEXT_PLAIN);
+    struct fcgi_request req = { .fd = -1 };
 
-    cgi_begin_http_headers();
+    FILE *out;
+    char *output;
+    size_t output_size;
 
-    cgi_open_stream();
+    while (fcgi_accept(&req)) {
+        output = NULL;
+        output_size = 0;
 
-    cgi_printf(err_msg);
+        out = open_memstream(&output, &output_size);
 
-    cgi_end_http_headers();
+        if (out == NULL) {
+            fcgi_finish(&req, NULL, 0);
+            continue;
+        }
 
-    cgi_dump_stream(stdout);
+        cgi_set_request(req.params, req.input, req.input_size, out);
 
-    cgi_close_stream();
-}
+        cgi_handle_request(&app);
 
-void cgi_send_redirect_response(const char *url)
-{
-    _cgi_exit = true;
+        cgi_close_stream();
 
-    printf("Status: 302\n");
-    printf("Location: %s\n", url);
-    printf("\n"); 
-}
+        fclose(out);
 
-int main(int argc, char **argv)
-{ 
-    const char *db_path;
+        cgi_clear_request();
 
-    db_path = getenv("KWS_DB_PATH");
+        fcgi_finish(&req, output, output_size);
 
-    if (db_path == NULL) {
-        cgi_send_error_response("No path to database set in environment");
-        return 0;
+        free(output);
     }
 
-    db_set_path("%s", db_path);
+    fcgi_close();
 
-    if (!db_open()) {
-        cgi_send_error_response("Database access error");
-        return 0;
-    }
+    return 0;
+}
 
-    cgi_open_stream();
+int main(int argc, char **argv)
+{ 
+    const char *db_path, *index_path, *engine, *cache_name;
 
-    cgi_set_status(200);
+    bool persistent;
 
-    cgi_begin();
+    persistent = fcgi_open();
 
-    if (_cgi_exit) {
-        goto exit;
+    index_path = getenv("KWS_INDEX_PATH");
+    db_path = getenv("KWS_DB_PATH");
+    engine = getenv("KWS_ENGINE");
+    cache_name = getenv("KWS_RESULT_CACHE");
+
+    if (cache_name != NULL && !rcache_open(cache_name, (index_path != NULL) ? index_path : db_path) && persistent)
+        fprintf(stderr, "kws: Unable to open result cache %s, continuing without it\n", cache_name);
+
+    if (index_path != NULL) {
+        if (!db_map_index(index_path)) {
+            if (persistent) {
+                fprintf(stderr, "kws: Index load error: %s\n", db_get_error_msg());
+                return 1;
+            }
+
+            cgi_send_error_response("Index load error");
+            return 0;
+        }
     }
-
-    if (should_dumpenv()) {
-        cgi_dump_env();
+    else {
+        if (db_path == NULL) {
+            if (persistent) {
+                fprintf(stderr, "kws: No path to database set in environment\n");
+                return 1;
+            }
+
+            cgi_send_error_response("No path to database set in environment");
+            return 0;
+        }
+
+        db_set_path("%s", db_path);
+
+        if (!db_set_profile((getenv("KWS_DB_PROFILE") != NULL) ? getenv("KWS_DB_PROFILE") : "default")) {
+            if (persistent) {
+                fprintf(stderr, "kws: Unknown database profile %s\n", getenv("KWS_DB_PROFILE"));
+                return 1;
+            }
+
+            cgi_send_error_response("Unknown database profile");
+            return 0;
+        }
+
+        if (!persistent && rcache_is_open() && (engine == NULL || strcmp(engine, "index") != 0)) {
+            db_open_deferred();
+        }
+        else if (!db_open()) {
+            if (persistent) {
+                fprintf(stderr, "kws: Database access error: %s\n", db_get_error_msg());
+                return 1;
+            }
+
+            cgi_send_error_response("Database access error");
+            return 0;
+        }
+
+        if (persistent)
+            db_report_profile(stderr, "kws");
+
+        if (engine != NULL && strcmp(engine, "index") == 0 && !db_load_index()) {
+            if (persistent) {
+                fprintf(stderr, "kws: Index load error: %s\n", db_get_error_msg());
+                return 1;
+            }
+
+            cgi_send_error_response("Index load error");
+            return 0;
+        }
     }
 
-    cgi_main();
-
-    if (_cgi_exit) {
-        goto exit;
+    if (persistent) {
+        fcgi_main();
     }
-
-    cgi_end();
-
-    if (_cgi_exit) {
-        goto exit;
+    else {
+        cgi_handle_request(&app);
     }
 
-    cgi_begin_http_headers();
-
-    cgi_end_http_headers();
-
-    cgi_dump_stream(stdout);
+    db_close();
 
-    cgi_close_stream();
+    db_free_index();
 
-exit:
-    db_close();
+    rcache_close();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,151 @@
+/*
+ * mkfold.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <locale.h>
+#include <wctype.h>
+#include <iconv.h>
+
+#define FOLD_MAX_CP         0xFFFF
+#define FOLD_BLOCK_SHIFT    6
+#define FOLD_BLOCK_SIZE     (1 << FOLD_BLOCK_SHIFT)
+#define FOLD_N_BLOCKS       ((FOLD_MAX_CP + 1) / FOLD_BLOCK_SIZE)
+
+/*
+ * Generates the folding tables compiled into tok.c. Each BMP code point
+ * maps to its lowercase form with Latin diacritics removed (light accent
+ * folding: only where the transliteration is a single ASCII letter), to
+ * a space for punctuation and spaces, or to 0 (deleted) for combining
+ * marks. Tables come from the C library's Unicode data at build time.
+ */
+
+static iconv_t fold_translit;
+
+static uint16_t fold_accent(uint32_t cp)
+{
+    char out[8] = { 0 }, *in_ptr = (char *)&cp, *out_ptr = out;
+
+    size_t in_left = sizeof(cp), out_left = sizeof(out) - 1;
+
+    iconv(fold_translit, NULL, NULL, NULL, NULL);
+
+    if (iconv(fold_translit, &in_ptr, &in_left, &out_ptr, &out_left) == (size_t)-1)
+        return 0;
+
+    if (out_ptr - out != 1 || !((out[0] >= 'a' && out[0] <= 'z') || (out[0] >= 'A' && out[0] <= 'Z')))
+        return 0;
+
+    return out[0] | 0x20;
+}
+
+static uint16_t fold_code_point(uint32_t cp)
+{
+    uint32_t lower;
+
+    uint16_t base;
+
+    if (cp >= 0xD800 && cp <= 0xDFFF)
+        return cp;
+
+    if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+        (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE20 && cp <= 0xFE2F))
+        return 0;
+
+    if (!iswalnum(cp) && (iswpunct(cp) || iswspace(cp) || iswblank(cp)))
+        return ' ';
+
+    lower = towlower(cp);
+
+    if (lower > FOLD_MAX_CP || (lower >= 0xD800 && lower <= 0xDFFF))
+        lower = cp;
+
+    if (iswalpha(cp) && (base = fold_accent(lower)) != 0)
+        return base;
+
+    return lower;
+}
+
+int main(int argc, char **argv)
+{
+    static uint16_t map[FOLD_MAX_CP + 1];
+
+    uint8_t stage1[FOLD_N_BLOCKS];
+
+    int blocks[FOLD_N_BLOCKS], n_blocks = 0, b, i, j;
+
+    uint32_t cp;
+
+    if (setlocale(LC_ALL, "C.UTF-8") == NULL) {
+        fprintf(stderr, "kws-mkfold: C.UTF-8 locale is not available\n");
+        return 1;
+    }
+
+    if ((fold_translit = iconv_open("ASCII//TRANSLIT", "UTF-32LE")) == (iconv_t)-1) {
+        perror("kws-mkfold: iconv_open");
+        return 1;
+    }
+
+    for (cp = 0; cp <= FOLD_MAX_CP; cp++)
+        map[cp] = (cp < 0x80) ? cp : fold_code_point(cp);
+
+    iconv_close(fold_translit);
+
+    /* stage1 entry 0 means the block maps to itself; others are 1 + the stage2 block */
+    for (b = 0; b < FOLD_N_BLOCKS; b++) {
+        stage1[b] = 0;
+
+        for (i = 0; i < FOLD_BLOCK_SIZE; i++) {
+            if (map[b * FOLD_BLOCK_SIZE + i] != b * FOLD_BLOCK_SIZE + i)
+                break;
+        }
+
+        if (i == FOLD_BLOCK_SIZE)
+            continue;
+
+        for (j = 0; j < n_blocks; j++) {
+            if (memcmp(&map[blocks[j] * FOLD_BLOCK_SIZE], &map[b * FOLD_BLOCK_SIZE], FOLD_BLOCK_SIZE * sizeof(uint16_t)) == 0)
+                break;
+        }
+
+        if (j == n_blocks) {
+            if (n_blocks == 255) {
+                fprintf(stderr, "kws-mkfold: too many blocks\n");
+                return 1;
+            }
+
+            blocks[n_blocks++] = b;
+        }
+
+        stage1[b] = j + 1;
+    }
+
+    printf("/* generated by kws-mkfold, do not edit */\n\n");
+    printf("#define TOK_FOLD_BLOCK_SHIFT %d\n\n", FOLD_BLOCK_SHIFT);
+
+    printf("static const uint8_t tok_fold_stage1[%d] =\n{", FOLD_N_BLOCKS);
+
+    for (b = 0; b < FOLD_N_BLOCKS; b++)
+        printf("%s%d,", (b % 16 == 0) ? "\n    " : " ", stage1[b]);
+
+    printf("\n};\n\n");
+
+    printf("static const uint16_t tok_fold_stage2[%d][%d] =\n{\n", n_blocks, FOLD_BLOCK_SIZE);
+
+    for (j = 0; j < n_blocks; j++) {
+        printf("    {");
+
+        for (i = 0; i < FOLD_BLOCK_SIZE; i++)
+            printf("%s0x%04x,", (i % 12 == 0) ? "\n        " : " ", map[blocks[j] * FOLD_BLOCK_SIZE + i]);
+
+        printf("\n    },\n");
+    }
+
+    printf("};\n");
+
+    return 0;
+}
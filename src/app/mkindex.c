@@ -0,0 +1,47 @@
+/*
+ * mkindex.c
+ * Copyright (c) 2023, Cory Montgomery
+ * All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * Builds the keyword index from a database and writes it as a snapshot
+ * that search.cgi and kwsd can map with KWS_INDEX_PATH.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s database index\n", argv[0]);
+        return 1;
+    }
+
+    db_set_path("%s", argv[1]);
+
+    if (!db_open_read_only()) {
+        fprintf(stderr, "kws-mkindex: Database access error: %s\n", db_get_error_msg());
+        return 1;
+    }
+
+    if (!db_load_index()) {
+        fprintf(stderr, "kws-mkindex: Index load error: %s\n", db_get_error_msg());
+        db_close();
+        return 1;
+    }
+
+    db_close();
+
+    if (!db_save_index(argv[2])) {
+        fprintf(stderr, "kws-mkindex: %s\n", db_get_error_msg());
+        db_free_index();
+        return 1;
+    }
+
+    db_free_index();
+
+    return 0;
+}
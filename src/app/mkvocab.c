@@ -0,0 +1,43 @@
+/*
+ * mkvocab.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * Builds the vocabulary filter that searches use to drop unknown tokens
+ * before querying the database. It is written next to the database
+ * (<database>.vocab), and is only trusted until the database changes.
+ */
+int main(int argc, char **argv)
+{
+    char path[4096];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s database\n", argv[0]);
+        return 1;
+    }
+
+    db_set_path("%s", argv[1]);
+
+    if (!db_open_read_only()) {
+        fprintf(stderr, "kws-mkvocab: Database access error: %s\n", db_get_error_msg());
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s.vocab", argv[1]);
+
+    if (!db_save_vocab_filter(path)) {
+        fprintf(stderr, "kws-mkvocab: %s\n", db_get_error_msg());
+        db_close();
+        return 1;
+    }
+
+    db_close();
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * mph.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mph.h"
+
+/* seeds tried before giving up, and pilots tried per bucket and seed */
+#define MPH_MAX_SEEDS       64
+#define MPH_MAX_PILOT       (1u << 28)
+
+#define MPH_NO_KEY          UINT32_MAX
+
+static uint64_t mph_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+uint32_t mph_get_n_buckets(uint32_t n_keys)
+{
+    return n_keys / MPH_BUCKET_SIZE + 1;
+}
+
+uint64_t mph_hash(const char *key, uint32_t seed)
+{
+    const unsigned char *p = (const unsigned char *)key;
+
+    uint64_t h = 0xcbf29ce484222325ull ^ mph_mix(seed + 1);
+
+    while (*p != '\0') {
+        h ^= *(p++);
+        h *= 0x100000001b3ull;
+    }
+
+    return mph_mix(h);
+}
+
+static uint32_t mph_get_bucket(uint32_t n_buckets, uint64_t h)
+{
+    return (uint32_t)(((h >> 32) * n_buckets) >> 32);
+}
+
+static uint32_t mph_place(uint64_t h, uint32_t pilot, uint32_t n_keys)
+{
+    return (uint32_t)((h ^ mph_mix(pilot)) % n_keys);
+}
+
+uint32_t mph_get_slot(const uint32_t *pilots, uint32_t n_keys, uint64_t h)
+{
+    return mph_place(h, pilots[mph_get_bucket(mph_get_n_buckets(n_keys), h)], n_keys);
+}
+
+/*
+ * Finds the first pilot that puts every key of a bucket on a free slot,
+ * distinct from each other. Returns false if none does (e.g. two keys
+ * share a hash).
+ */
+static bool mph_place_bucket(const uint64_t *hashes, const uint32_t *members, uint32_t size,
+    uint32_t *slots, uint32_t n, uint32_t *pilot, uint32_t *taken)
+{
+    uint32_t p, i, j;
+
+    for (p = 0; p < MPH_MAX_PILOT; p++) {
+        for (i = 0; i < size; i++) {
+            taken[i] = mph_place(hashes[members[i]], p, n);
+
+            if (slots[taken[i]] != MPH_NO_KEY)
+                break;
+
+            for (j = 0; j < i && taken[j] != taken[i]; j++)
+                ;
+
+            if (j < i)
+                break;
+        }
+
+        if (i == size) {
+            for (i = 0; i < size; i++)
+                slots[taken[i]] = members[i];
+
+            *pilot = p;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool mph_build(const char **keys, uint32_t n, uint32_t *pilots, uint32_t *slots, uint32_t *seed)
+{
+    uint32_t n_buckets = mph_get_n_buckets(n), i, b, size, max_size, *first, *members, *order, *taken;
+
+    uint64_t *hashes;
+
+    bool ok = false;
+
+    hashes = malloc(((size_t)n + 1) * sizeof(uint64_t));
+    first = malloc(((size_t)n_buckets + 1) * sizeof(uint32_t));
+    members = malloc(((size_t)n + 1) * sizeof(uint32_t));
+    order = malloc((size_t)n_buckets * sizeof(uint32_t));
+    taken = malloc(((size_t)n + 1) * sizeof(uint32_t));
+
+    if (hashes == NULL || first == NULL || members == NULL || order == NULL || taken == NULL)
+        goto exit;
+
+    for (*seed = 0; *seed < MPH_MAX_SEEDS && !ok; (*seed)++) {
+        /* group the keys by bucket, counting sort style */
+        bzero(first, ((size_t)n_buckets + 1) * sizeof(uint32_t));
+
+        for (i = 0; i < n; i++) {
+            hashes[i] = mph_hash(keys[i], *seed);
+            first[mph_get_bucket(n_buckets, hashes[i]) + 1]++;
+        }
+
+        for (b = 0, max_size = 0; b < n_buckets; b++) {
+            if (first[b + 1] > max_size)
+                max_size = first[b + 1];
+
+            first[b + 1] += first[b];
+        }
+
+        for (i = 0; i < n; i++)
+            members[first[mph_get_bucket(n_buckets, hashes[i])]++] = i;
+
+        /* first[b] is now the end of bucket b */
+        for (b = n_buckets; b > 0; b--)
+            first[b] = first[b - 1];
+
+        first[0] = 0;
+
+        /* largest buckets first, while most slots are still free */
+        for (size = max_size + 1, i = 0; size-- > 0; ) {
+            for (b = 0; b < n_buckets; b++) {
+                if (first[b + 1] - first[b] == size)
+                    order[i++] = b;
+            }
+        }
+
+        memset(slots, 0xFF, (size_t)n * sizeof(uint32_t));
+
+        for (i = 0, ok = true; ok && i < n_buckets; i++) {
+            b = order[i];
+            pilots[b] = 0;
+
+            if (first[b + 1] > first[b])
+                ok = mph_place_bucket(hashes, members + first[b], first[b + 1] - first[b], slots, n, &pilots[b], taken);
+        }
+    }
+
+    (*seed)--;
+
+exit:
+    free(hashes);
+    free(first);
+    free(members);
+    free(order);
+    free(taken);
+
+    return ok;
+}
@@ -0,0 +1,30 @@
+/*
+ * mph.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Minimal perfect hash over a fixed set of n strings, mapping each to a
+ * distinct slot in [0, n), CHD style: keys are hashed into buckets of
+ * about MPH_BUCKET_SIZE, and each bucket stores the pilot (displacement)
+ * that moves all of its keys to free slots. A lookup costs one hash and
+ * one pilot read. Keys outside the set land on arbitrary slots, so
+ * callers compare against the key stored there.
+ */
+#define MPH_BUCKET_SIZE     4
+
+uint32_t mph_get_n_buckets(uint32_t n_keys);
+
+uint64_t mph_hash(const char *key, uint32_t seed);
+
+uint32_t mph_get_slot(const uint32_t *pilots, uint32_t n_keys, uint64_t h);
+
+/*
+ * Builds the hash of keys[0, n): pilots gets mph_get_n_buckets(n) entries,
+ * and slots[s] the index of the key hashed to slot s. Returns false if
+ * out of memory.
+ */
+bool mph_build(const char **keys, uint32_t n, uint32_t *pilots, uint32_t *slots, uint32_t *seed);
@@ -0,0 +1,39 @@
+/*
+ * normalize.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * Folds the keywords stored in a database (db_fold_keywords) so that they
+ * match query tokens. make db and make migrate run it; databases written
+ * only by kws-ingest are already folded.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s database\n", argv[0]);
+        return 1;
+    }
+
+    db_set_path("%s", argv[1]);
+
+    if (!db_open()) {
+        fprintf(stderr, "kws-normalize: Database access error: %s\n", db_get_error_msg());
+        return 1;
+    }
+
+    if (!db_fold_keywords()) {
+        fprintf(stderr, "kws-normalize: %s\n", db_get_error_msg());
+        db_close();
+        return 1;
+    }
+
+    db_close();
+
+    return 0;
+}
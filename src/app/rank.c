@@ -0,0 +1,213 @@
+/*
+ * rank.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rank.h"
+
+#define RANK_COUNTER_MIN_CAPACITY 256
+
+bool rank_hit_better(const struct rank_hit *a, const struct rank_hit *b)
+{
+    if (a->rank != b->rank)
+        return a->rank > b->rank;
+
+    return a->id < b->id;
+}
+
+int rank_compare_hits(const void *a, const void *b)
+{
+    if (rank_hit_better(a, b))
+        return -1;
+
+    return rank_hit_better(b, a) ? 1 : 0;
+}
+
+bool rank_heap_init(struct rank_heap *heap, size_t capacity)
+{
+    heap->size = 0;
+    heap->capacity = capacity;
+    heap->hits = malloc((capacity + 1) * sizeof(struct rank_hit));
+
+    return heap->hits != NULL;
+}
+
+void rank_heap_sift_down(struct rank_heap *heap, size_t i)
+{
+    struct rank_hit *h = heap->hits, tmp;
+
+    size_t worst, l, r;
+
+    for (;;) {
+        worst = i;
+        l = 2 * i + 1;
+        r = l + 1;
+
+        if (l < heap->size && rank_hit_better(&h[worst], &h[l]))
+            worst = l;
+
+        if (r < heap->size && rank_hit_better(&h[worst], &h[r]))
+            worst = r;
+
+        if (worst == i)
+            return;
+
+        tmp = h[i];
+        h[i] = h[worst];
+        h[worst] = tmp;
+
+        i = worst;
+    }
+}
+
+/*
+ * O(log k) per hit; a hit that is not better than the worst kept hit is
+ * rejected after a single comparison.
+ */
+void rank_heap_push(struct rank_heap *heap, double rank, uint32_t id)
+{
+    struct rank_hit *h = heap->hits, hit = { rank, id };
+
+    size_t i, parent;
+
+    if (heap->capacity == 0)
+        return;
+
+    if (heap->size == heap->capacity) {
+        if (!rank_hit_better(&hit, &h[0]))
+            return;
+
+        h[0] = hit;
+
+        rank_heap_sift_down(heap, 0);
+
+        return;
+    }
+
+    i = heap->size++;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+
+        if (!rank_hit_better(&h[parent], &hit))
+            break;
+
+        h[i] = h[parent];
+        i = parent;
+    }
+
+    h[i] = hit;
+}
+
+/*
+ * Orders the kept hits best first. The heap may not be pushed to again.
+ */
+void rank_heap_sort(struct rank_heap *heap)
+{
+    qsort(heap->hits, heap->size, sizeof(struct rank_hit), rank_compare_hits);
+}
+
+void rank_heap_free(struct rank_heap *heap)
+{
+    free(heap->hits);
+
+    heap->hits = NULL;
+    heap->size = heap->capacity = 0;
+}
+
+bool rank_counter_init(struct rank_counter *counter)
+{
+    counter->size = 0;
+    counter->capacity = RANK_COUNTER_MIN_CAPACITY;
+    counter->ids = calloc(counter->capacity, sizeof(uint32_t));
+    counter->counts = calloc(counter->capacity, sizeof(uint32_t));
+
+    if (counter->ids == NULL || counter->counts == NULL) {
+        rank_counter_free(counter);
+        return false;
+    }
+
+    return true;
+}
+
+size_t rank_counter_slot(uint32_t *ids, size_t capacity, uint32_t key)
+{
+    size_t i = (key * 2654435761u) & (capacity - 1);
+
+    while (ids[i] != 0 && ids[i] != key)
+        i = (i + 1) & (capacity - 1);
+
+    return i;
+}
+
+bool rank_counter_grow(struct rank_counter *counter)
+{
+    uint32_t *ids, *counts;
+
+    size_t capacity, i, slot;
+
+    capacity = counter->capacity * 2;
+    ids = calloc(capacity, sizeof(uint32_t));
+    counts = calloc(capacity, sizeof(uint32_t));
+
+    if (ids == NULL || counts == NULL) {
+        free(ids);
+        free(counts);
+        return false;
+    }
+
+    for (i = 0; i < counter->capacity; i++) {
+        if (counter->ids[i] == 0)
+            continue;
+
+        slot = rank_counter_slot(ids, capacity, counter->ids[i]);
+
+        ids[slot] = counter->ids[i];
+        counts[slot] = counter->counts[i];
+    }
+
+    free(counter->ids);
+    free(counter->counts);
+
+    counter->ids = ids;
+    counter->counts = counts;
+    counter->capacity = capacity;
+
+    return true;
+}
+
+bool rank_counter_add(struct rank_counter *counter, uint32_t id)
+{
+    size_t slot;
+
+    uint32_t key = id + 1;
+
+    if (key == 0)
+        return false;
+
+    if ((counter->size + 1) * 2 > counter->capacity && !rank_counter_grow(counter))
+        return false;
+
+    slot = rank_counter_slot(counter->ids, counter->capacity, key);
+
+    if (counter->ids[slot] == 0) {
+        counter->ids[slot] = key;
+        counter->size++;
+    }
+
+    counter->counts[slot]++;
+
+    return true;
+}
+
+void rank_counter_free(struct rank_counter *counter)
+{
+    free(counter->ids);
+    free(counter->counts);
+
+    counter->ids = counter->counts = NULL;
+    counter->size = counter->capacity = 0;
+}
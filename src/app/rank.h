@@ -0,0 +1,52 @@
+/*
+ * rank.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A ranked question. Higher ranks come first, ties go to the lower id.
+ */
+struct rank_hit
+{
+    double rank;
+    uint32_t id;
+};
+
+/*
+ * Keeps the best capacity hits pushed into it, as a min-heap with the
+ * worst kept hit at the root.
+ */
+struct rank_heap
+{
+    struct rank_hit *hits;
+    size_t size, capacity;
+};
+
+/*
+ * Counts occurrences of ids (open addressing, ids are stored plus one so
+ * that zero marks an empty slot).
+ */
+struct rank_counter
+{
+    uint32_t *ids;
+    uint32_t *counts;
+    size_t size, capacity;
+};
+
+bool rank_heap_init(struct rank_heap *heap, size_t capacity);
+
+void rank_heap_push(struct rank_heap *heap, double rank, uint32_t id);
+
+void rank_heap_sort(struct rank_heap *heap);
+
+void rank_heap_free(struct rank_heap *heap);
+
+bool rank_counter_init(struct rank_counter *counter);
+
+bool rank_counter_add(struct rank_counter *counter, uint32_t id);
+
+void rank_counter_free(struct rank_counter *counter);
@@ -0,0 +1,417 @@
+/*
+ * rcache.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rcache.h"
+
+/*
+ * Result cache shared by every process serving the same data, in a
+ * POSIX shared memory segment. Slots are grouped in sets of
+ * RCACHE_WAYS; a key can only live in the set its hash selects, and a
+ * full set evicts its least recently used slot.
+ *
+ * Each slot is guarded by a seqlock: readers never block and simply miss
+ * if a writer touched the slot while they copied it, writers take a slot
+ * by moving its sequence from even to odd and give up if another writer
+ * holds it. The writer's pid is stored with the odd sequence, in the same
+ * atomic word, so a slot whose writer died mid-update can be taken over
+ * instead of staying locked for good.
+ */
+
+#define RCACHE_MAGIC            "KWSRCACHE"
+#define RCACHE_VERSION          3
+#define RCACHE_SETS             256
+#define RCACHE_WAYS             8
+#define RCACHE_SLOT_DATA_SIZE   8192
+
+/* how often the data source is checked for changes, in nanoseconds */
+#define RCACHE_CHECK_INTERVAL   1000000000ull
+
+struct rcache_slot
+{
+    /* sequence in the low half, the writer's pid in the high half while odd */
+    atomic_ullong seq;
+    uint32_t hash;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint64_t generation;
+    atomic_ullong last_used;
+    char data[RCACHE_SLOT_DATA_SIZE];
+};
+
+struct rcache_header
+{
+    char magic[16];
+    uint32_t version;
+    uint32_t n_slots;
+
+    /* entries from older generations are misses */
+    atomic_ullong generation;
+    atomic_ullong source_stamp;
+
+    /* rcache_now() of the last source check */
+    atomic_ullong source_checked_at;
+
+    struct rcache_slot slots[RCACHE_SETS * RCACHE_WAYS];
+};
+
+static struct rcache_header *rcache;
+static char *rcache_source_path;
+static __thread uint64_t rcache_generation;
+
+uint64_t rcache_hash(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *p = data;
+
+    while (size-- > 0) {
+        h ^= *(p++);
+        h *= 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+uint64_t rcache_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Fingerprint of the data source, taken without opening it: the file's
+ * identity and mtime, SQLite's file change counter (header bytes 24-27)
+ * and the WAL file, if any. PRAGMA data_version would need a database
+ * connection, which plain CGI processes do not open on a cache hit, and
+ * says nothing about index snapshots, which are not SQLite files.
+ */
+uint64_t rcache_get_source_stamp()
+{
+    struct stat st;
+
+    unsigned char counter[4] = { 0 };
+
+    char wal_path[4096];
+
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    int fd;
+
+    if (stat(rcache_source_path, &st) == -1)
+        return 0;
+
+    h = rcache_hash(&st.st_ino, sizeof(st.st_ino), h);
+    h = rcache_hash(&st.st_size, sizeof(st.st_size), h);
+    h = rcache_hash(&st.st_mtim, sizeof(st.st_mtim), h);
+
+    if ((fd = open(rcache_source_path, O_RDONLY | O_CLOEXEC)) != -1) {
+        if (pread(fd, counter, sizeof(counter), 24) == sizeof(counter))
+            h = rcache_hash(counter, sizeof(counter), h);
+
+        close(fd);
+    }
+
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", rcache_source_path);
+
+    if (stat(wal_path, &st) == 0) {
+        h = rcache_hash(&st.st_size, sizeof(st.st_size), h);
+        h = rcache_hash(&st.st_mtim, sizeof(st.st_mtim), h);
+    }
+
+    return h;
+}
+
+/*
+ * Moves the cache to a new generation if the data source has changed.
+ * The source is checked by one request per RCACHE_CHECK_INTERVAL across
+ * all processes, the others use the current generation, so results can
+ * be served for up to that long after the data changes.
+ */
+uint64_t rcache_sync_generation()
+{
+    unsigned long long stamp, old, now, checked_at;
+
+    now = rcache_now();
+    checked_at = atomic_load(&rcache->source_checked_at);
+
+    if (now - checked_at < RCACHE_CHECK_INTERVAL ||
+        !atomic_compare_exchange_strong(&rcache->source_checked_at, &checked_at, now))
+        return atomic_load(&rcache->generation);
+
+    stamp = rcache_get_source_stamp();
+    old = atomic_load(&rcache->source_stamp);
+
+    if (stamp != old && atomic_compare_exchange_strong(&rcache->source_stamp, &old, stamp))
+        atomic_fetch_add(&rcache->generation, 1);
+
+    return atomic_load(&rcache->generation);
+}
+
+/*
+ * Maps the named segment, creating it if needed. Whoever creates it
+ * initializes it and publishes the magic last; a process that finds the
+ * segment half initialized runs without the cache.
+ */
+bool rcache_open(const char *name, const char *source_path)
+{
+    int fd;
+
+    bool created = true;
+
+    struct stat st;
+    struct rcache_header *header;
+
+    if (rcache != NULL || source_path == NULL)
+        return false;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        created = false;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    }
+
+    if (fd == -1)
+        return false;
+
+    if (created && ftruncate(fd, sizeof(struct rcache_header)) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(struct rcache_header)) {
+        close(fd);
+        return false;
+    }
+
+    header = mmap(NULL, sizeof(struct rcache_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (header == MAP_FAILED)
+        return false;
+
+    if (created) {
+        header->version = RCACHE_VERSION;
+        header->n_slots = RCACHE_SETS * RCACHE_WAYS;
+
+        atomic_thread_fence(memory_order_release);
+
+        memcpy(header->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC));
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (memcmp(header->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC)) != 0 ||
+        header->version != RCACHE_VERSION || header->n_slots != RCACHE_SETS * RCACHE_WAYS) {
+        munmap(header, sizeof(struct rcache_header));
+        return false;
+    }
+
+    rcache_source_path = strdup(source_path);
+
+    if (rcache_source_path == NULL) {
+        munmap(header, sizeof(struct rcache_header));
+        return false;
+    }
+
+    rcache = header;
+
+    return true;
+}
+
+bool rcache_is_open()
+{
+    return rcache != NULL;
+}
+
+struct rcache_slot *rcache_get_set(uint64_t hash)
+{
+    return &rcache->slots[(hash % RCACHE_SETS) * RCACHE_WAYS];
+}
+
+/*
+ * Returns a malloc'd, NUL terminated copy of the value stored for key,
+ * or NULL on a miss. Also fixes the generation a later rcache_put() from
+ * this thread will be stored under, so a result computed while the data
+ * changed is never served as current.
+ */
+char *rcache_get(const char *key, size_t *size)
+{
+    struct rcache_slot *set, *slot;
+
+    size_t key_size;
+
+    uint64_t hash;
+
+    unsigned long long seq;
+
+    char *value;
+
+    int i;
+
+    if (rcache == NULL)
+        return NULL;
+
+    rcache_generation = rcache_sync_generation();
+
+    key_size = strlen(key);
+
+    if (key_size > RCACHE_SLOT_DATA_SIZE)
+        return NULL;
+
+    hash = rcache_hash(key, key_size, 0xcbf29ce484222325ull);
+    set = rcache_get_set(hash);
+
+    for (i = 0; i < RCACHE_WAYS; i++) {
+        slot = &set[i];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if ((seq & 1) || slot->hash != (uint32_t)hash || slot->key_size != key_size ||
+            slot->generation != rcache_generation || slot->value_size > RCACHE_SLOT_DATA_SIZE - key_size)
+            continue;
+
+        if (memcmp(slot->data, key, key_size) != 0)
+            continue;
+
+        value = malloc(slot->value_size + 1);
+
+        if (value == NULL)
+            return NULL;
+
+        *size = slot->value_size;
+
+        memcpy(value, slot->data + key_size, *size);
+
+        value[*size] = '\0';
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            free(value);
+            return NULL;
+        }
+
+        atomic_store_explicit(&slot->last_used, rcache_now(), memory_order_relaxed);
+
+        return value;
+    }
+
+    return NULL;
+}
+
+/*
+ * True if an odd seq was left by a writer process that no longer exists.
+ */
+bool rcache_is_abandoned(unsigned long long seq)
+{
+    pid_t owner = (pid_t)(seq >> 32);
+
+    return owner > 0 && kill(owner, 0) == -1 && errno == ESRCH;
+}
+
+/*
+ * Stores a value that fits in a slot, replacing a stale or the least
+ * recently used slot of the key's set.
+ */
+void rcache_put(const char *key, const char *value, size_t size)
+{
+    struct rcache_slot *set, *slot, *victim;
+
+    size_t key_size;
+
+    uint64_t hash, last_used, oldest;
+
+    unsigned long long seq, locked;
+
+    int i;
+
+    if (rcache == NULL)
+        return;
+
+    key_size = strlen(key);
+
+    if (key_size + size > RCACHE_SLOT_DATA_SIZE)
+        return;
+
+    hash = rcache_hash(key, key_size, 0xcbf29ce484222325ull);
+    set = rcache_get_set(hash);
+    victim = NULL;
+    oldest = UINT64_MAX;
+
+    for (i = 0; i < RCACHE_WAYS; i++) {
+        slot = &set[i];
+
+        if (slot->generation != rcache_generation) {
+            victim = slot;
+            break;
+        }
+
+        if (slot->hash == (uint32_t)hash && slot->key_size == key_size && memcmp(slot->data, key, key_size) == 0) {
+            victim = slot;
+            break;
+        }
+
+        last_used = atomic_load_explicit(&slot->last_used, memory_order_relaxed);
+
+        if (last_used < oldest) {
+            oldest = last_used;
+            victim = slot;
+        }
+    }
+
+    seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+
+    if ((seq & 1) && !rcache_is_abandoned(seq))
+        return;
+
+    /* taking over an abandoned slot skips to the next odd sequence */
+    locked = (unsigned long long)getpid() << 32 | (uint32_t)(seq + 1 + (seq & 1));
+
+    if (!atomic_compare_exchange_strong(&victim->seq, &seq, locked))
+        return;
+
+    atomic_thread_fence(memory_order_release);
+
+    victim->hash = (uint32_t)hash;
+    victim->key_size = key_size;
+    victim->value_size = size;
+    victim->generation = rcache_generation;
+
+    memcpy(victim->data, key, key_size);
+    memcpy(victim->data + key_size, value, size);
+
+    atomic_store_explicit(&victim->last_used, rcache_now(), memory_order_relaxed);
+    atomic_compare_exchange_strong_explicit(&victim->seq, &locked, (uint32_t)(locked + 1),
+        memory_order_release, memory_order_relaxed);
+}
+
+void rcache_close()
+{
+    if (rcache == NULL)
+        return;
+
+    munmap(rcache, sizeof(struct rcache_header));
+
+    free(rcache_source_path);
+
+    rcache = NULL;
+    rcache_source_path = NULL;
+}
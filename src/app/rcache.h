@@ -0,0 +1,17 @@
+/*
+ * rcache.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool rcache_open(const char *name, const char *source_path);
+
+bool rcache_is_open();
+
+char *rcache_get(const char *key, size_t *size);
+
+void rcache_put(const char *key, const char *value, size_t size);
+
+void rcache_close();
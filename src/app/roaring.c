@@ -0,0 +1,560 @@
+/*
+ * roaring.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "roaring.h"
+
+#if defined(__x86_64__) && !defined(KWS_NO_SIMD)
+#define ROARING_X86
+#include <immintrin.h>
+#endif
+
+/* containers holding more ids than this are bitmaps, unless runs are smaller */
+#define ROARING_ARRAY_MAX       4096
+
+enum roaring_type
+{
+    ROARING_TYPE_ARRAY,
+    ROARING_TYPE_BITMAP,
+    ROARING_TYPE_RUN
+};
+
+/*
+ * Encoded layout: a uint32_t container count, one header per container,
+ * then the payloads. Arrays are uint16_t low bits, bitmaps are
+ * ROARING_CHUNK_WORDS uint64_t words, runs are uint16_t pairs of (start,
+ * length - 1). Nothing is aligned; all reads go through memcpy() or
+ * unaligned loads.
+ */
+struct roaring_header
+{
+    uint16_t key;
+    uint16_t type;
+
+    /* ids of an array or bitmap, runs of a run container */
+    uint32_t count;
+
+    /* payload offset from the start of the encoded data */
+    uint32_t offset;
+
+    uint32_t value;
+};
+
+static void roaring_get_header(const uint8_t *data, uint32_t c, struct roaring_header *h)
+{
+    memcpy(h, data + sizeof(uint32_t) + c * sizeof(struct roaring_header), sizeof(*h));
+}
+
+static uint16_t roaring_get_u16(const uint8_t *p, uint32_t i)
+{
+    uint16_t v;
+
+    memcpy(&v, p + i * sizeof(uint16_t), sizeof(v));
+
+    return v;
+}
+
+static uint64_t roaring_get_word(const uint8_t *p, uint32_t i)
+{
+    uint64_t v;
+
+    memcpy(&v, p + i * sizeof(uint64_t), sizeof(v));
+
+    return v;
+}
+
+size_t roaring_encode(uint8_t *out, const uint32_t *ids, uint32_t n, const uint32_t *values)
+{
+    struct roaring_header h;
+
+    uint64_t words[ROARING_CHUNK_WORDS];
+
+    uint32_t i, j, end, n_containers, n_runs, low, min;
+
+    size_t size, array_size, run_size;
+
+    uint8_t *payload = NULL;
+
+    for (i = 0, n_containers = 0; i < n; i = end, n_containers++) {
+        for (end = i + 1; end < n && ids[end] >> 16 == ids[i] >> 16; end++)
+            ;
+    }
+
+    size = sizeof(uint32_t) + n_containers * sizeof(struct roaring_header);
+
+    if (out != NULL) {
+        memcpy(out, &n_containers, sizeof(uint32_t));
+        payload = out + sizeof(uint32_t);
+    }
+
+    for (i = 0; i < n; i = end) {
+        for (end = i + 1, n_runs = 1, min = UINT32_MAX; end < n && ids[end] >> 16 == ids[i] >> 16; end++) {
+            if (ids[end] != ids[end - 1] + 1)
+                n_runs++;
+        }
+
+        for (j = i; values != NULL && j < end; j++) {
+            if (values[ids[j]] < min)
+                min = values[ids[j]];
+        }
+
+        h.key = ids[i] >> 16;
+        h.offset = size;
+        h.value = (values != NULL) ? min : 0;
+
+        array_size = (size_t)(end - i) * sizeof(uint16_t);
+        run_size = (size_t)n_runs * 2 * sizeof(uint16_t);
+
+        if (run_size < array_size && run_size < sizeof(words)) {
+            h.type = ROARING_TYPE_RUN;
+            h.count = n_runs;
+            size += run_size;
+        }
+        else if (end - i <= ROARING_ARRAY_MAX) {
+            h.type = ROARING_TYPE_ARRAY;
+            h.count = end - i;
+            size += array_size;
+        }
+        else {
+            h.type = ROARING_TYPE_BITMAP;
+            h.count = end - i;
+            size += sizeof(words);
+        }
+
+        if (out == NULL)
+            continue;
+
+        memcpy(payload, &h, sizeof(h));
+        payload += sizeof(h);
+
+        if (h.type == ROARING_TYPE_ARRAY) {
+            for (j = i; j < end; j++) {
+                low = ids[j] & 0xFFFF;
+                memcpy(out + h.offset + (j - i) * sizeof(uint16_t), &low, sizeof(uint16_t));
+            }
+        }
+        else if (h.type == ROARING_TYPE_BITMAP) {
+            bzero(words, sizeof(words));
+
+            for (j = i; j < end; j++) {
+                low = ids[j] & 0xFFFF;
+                words[low / 64] |= (uint64_t)1 << (low % 64);
+            }
+
+            memcpy(out + h.offset, words, sizeof(words));
+        }
+        else {
+            uint16_t run[2];
+
+            for (j = i, n_runs = 0; j < end; n_runs++) {
+                run[0] = ids[j] & 0xFFFF;
+
+                for (j++; j < end && ids[j] == ids[j - 1] + 1; j++)
+                    ;
+
+                run[1] = (ids[j - 1] & 0xFFFF) - run[0];
+
+                memcpy(out + h.offset + n_runs * sizeof(run), run, sizeof(run));
+            }
+        }
+    }
+
+    return size;
+}
+
+void roaring_open(struct roaring_reader *r, const uint8_t *data)
+{
+    r->data = data;
+
+    memcpy(&r->n_containers, data, sizeof(uint32_t));
+
+    r->c = 0;
+    r->pos = 0;
+    r->run_offset = 0;
+}
+
+static void roaring_next_container(struct roaring_reader *r)
+{
+    r->c++;
+    r->pos = 0;
+    r->run_offset = 0;
+}
+
+uint32_t roaring_next(struct roaring_reader *r, uint32_t *out, uint32_t max)
+{
+    struct roaring_header h;
+
+    const uint8_t *p;
+
+    uint32_t n = 0, base, start, length;
+
+    uint64_t word;
+
+    while (n < max && r->c < r->n_containers) {
+        roaring_get_header(r->data, r->c, &h);
+
+        p = r->data + h.offset;
+        base = (uint32_t)h.key << 16;
+
+        if (h.type == ROARING_TYPE_ARRAY) {
+            while (n < max && r->pos < h.count)
+                out[n++] = base | roaring_get_u16(p, r->pos++);
+
+            if (r->pos < h.count)
+                break;
+        }
+        else if (h.type == ROARING_TYPE_BITMAP) {
+            while (n < max && r->pos < ROARING_CHUNK_SIZE) {
+                word = roaring_get_word(p, r->pos / 64) >> (r->pos % 64);
+
+                if (word == 0) {
+                    r->pos = (r->pos / 64 + 1) * 64;
+                    continue;
+                }
+
+                r->pos += __builtin_ctzll(word);
+                out[n++] = base | r->pos++;
+            }
+
+            if (r->pos < ROARING_CHUNK_SIZE)
+                break;
+        }
+        else {
+            while (n < max && r->pos < h.count) {
+                start = roaring_get_u16(p, r->pos * 2);
+                length = roaring_get_u16(p, r->pos * 2 + 1);
+
+                while (n < max && r->run_offset <= length)
+                    out[n++] = base | (start + r->run_offset++);
+
+                if (r->run_offset > length) {
+                    r->pos++;
+                    r->run_offset = 0;
+                }
+            }
+
+            if (r->pos < h.count)
+                break;
+        }
+
+        roaring_next_container(r);
+    }
+
+    return n;
+}
+
+void roaring_seek(struct roaring_reader *r, uint32_t target)
+{
+    struct roaring_header h;
+
+    const uint8_t *p;
+
+    uint32_t key = target >> 16, low = target & 0xFFFF, lo, hi, mid, start, length;
+
+    for (; r->c < r->n_containers; roaring_next_container(r)) {
+        roaring_get_header(r->data, r->c, &h);
+
+        if (h.key >= key)
+            break;
+    }
+
+    if (r->c == r->n_containers || h.key > key)
+        return;
+
+    p = r->data + h.offset;
+
+    if (h.type == ROARING_TYPE_ARRAY) {
+        lo = r->pos;
+        hi = h.count;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (roaring_get_u16(p, mid) < low)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        r->pos = lo;
+    }
+    else if (h.type == ROARING_TYPE_BITMAP) {
+        if (r->pos < low)
+            r->pos = low;
+    }
+    else {
+        for (; r->pos < h.count; r->pos++, r->run_offset = 0) {
+            start = roaring_get_u16(p, r->pos * 2);
+            length = roaring_get_u16(p, r->pos * 2 + 1);
+
+            if (start + length >= low) {
+                if (start + r->run_offset < low)
+                    r->run_offset = low - start;
+
+                break;
+            }
+        }
+    }
+}
+
+bool roaring_bound(struct roaring_reader *r, uint32_t target, uint32_t *last, uint32_t *value)
+{
+    struct roaring_header h;
+
+    uint32_t c;
+
+    for (c = r->c; c < r->n_containers; c++) {
+        roaring_get_header(r->data, c, &h);
+
+        if (h.key >= target >> 16) {
+            *last = ((uint32_t)h.key << 16) | 0xFFFF;
+            *value = h.value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Expands an array or run container into a chunk of a flat bitmap.
+ */
+static void roaring_fill(uint64_t *words, const struct roaring_header *h, const uint8_t *p)
+{
+    uint32_t i, low, start, length;
+
+    if (h->type == ROARING_TYPE_ARRAY) {
+        for (i = 0; i < h->count; i++) {
+            low = roaring_get_u16(p, i);
+            words[low / 64] |= (uint64_t)1 << (low % 64);
+        }
+
+        return;
+    }
+
+    for (i = 0; i < h->count; i++) {
+        start = roaring_get_u16(p, i * 2);
+        length = roaring_get_u16(p, i * 2 + 1);
+
+        for (low = start; low <= start + length; low++)
+            words[low / 64] |= (uint64_t)1 << (low % 64);
+    }
+}
+
+#ifdef ROARING_X86
+__attribute__((target("avx2")))
+static void roaring_or_avx2(uint64_t *dst, const uint8_t *src)
+{
+    __m256i *d = (__m256i *)dst;
+
+    const __m256i *s = (const __m256i *)src;
+
+    size_t i;
+
+    for (i = 0; i < ROARING_CHUNK_WORDS / 4; i++)
+        _mm256_storeu_si256(d + i, _mm256_or_si256(_mm256_loadu_si256(d + i), _mm256_loadu_si256(s + i)));
+}
+
+__attribute__((target("avx2")))
+static void roaring_and_avx2(uint64_t *dst, const uint8_t *src)
+{
+    __m256i *d = (__m256i *)dst;
+
+    const __m256i *s = (const __m256i *)src;
+
+    size_t i;
+
+    for (i = 0; i < ROARING_CHUNK_WORDS / 4; i++)
+        _mm256_storeu_si256(d + i, _mm256_and_si256(_mm256_loadu_si256(d + i), _mm256_loadu_si256(s + i)));
+}
+
+/*
+ * Counts bits a nibble at a time through a shuffle lookup table.
+ */
+__attribute__((target("avx2")))
+static uint64_t roaring_popcount_avx2(const uint64_t *bits, size_t n_words)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i acc = _mm256_setzero_si256(), x, count;
+
+    uint64_t total;
+
+    size_t i;
+
+    for (i = 0; i + 4 <= n_words; i += 4) {
+        x = _mm256_loadu_si256((const __m256i *)(bits + i));
+
+        count = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, nibble)),
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(count, _mm256_setzero_si256()));
+    }
+
+    total = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+            _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+
+    for (; i < n_words; i++)
+        total += __builtin_popcountll(bits[i]);
+
+    return total;
+}
+
+static bool roaring_has_avx2()
+{
+    static int has_avx2 = -1;
+
+    if (has_avx2 == -1)
+        has_avx2 = __builtin_cpu_supports("avx2");
+
+    return has_avx2;
+}
+#endif
+
+static void roaring_or_words(uint64_t *dst, const uint8_t *src)
+{
+    size_t i;
+
+#ifdef ROARING_X86
+    if (roaring_has_avx2()) {
+        roaring_or_avx2(dst, src);
+        return;
+    }
+
+    for (i = 0; i < ROARING_CHUNK_WORDS; i += 2) {
+        _mm_storeu_si128((__m128i *)(dst + i),
+            _mm_or_si128(_mm_loadu_si128((__m128i *)(dst + i)), _mm_loadu_si128((const __m128i *)(src + i * 8))));
+    }
+#else
+    for (i = 0; i < ROARING_CHUNK_WORDS; i++)
+        dst[i] |= roaring_get_word(src, i);
+#endif
+}
+
+static void roaring_and_words(uint64_t *dst, const uint8_t *src)
+{
+    size_t i;
+
+#ifdef ROARING_X86
+    if (roaring_has_avx2()) {
+        roaring_and_avx2(dst, src);
+        return;
+    }
+
+    for (i = 0; i < ROARING_CHUNK_WORDS; i += 2) {
+        _mm_storeu_si128((__m128i *)(dst + i),
+            _mm_and_si128(_mm_loadu_si128((__m128i *)(dst + i)), _mm_loadu_si128((const __m128i *)(src + i * 8))));
+    }
+#else
+    for (i = 0; i < ROARING_CHUNK_WORDS; i++)
+        dst[i] &= roaring_get_word(src, i);
+#endif
+}
+
+void roaring_or(uint64_t *bits, size_t n_words, const uint8_t *data)
+{
+    struct roaring_header h;
+
+    uint32_t c, n;
+
+    uint64_t *words;
+
+    memcpy(&n, data, sizeof(uint32_t));
+
+    for (c = 0; c < n; c++) {
+        roaring_get_header(data, c, &h);
+
+        if ((size_t)h.key * ROARING_CHUNK_WORDS >= n_words)
+            return;
+
+        words = bits + (size_t)h.key * ROARING_CHUNK_WORDS;
+
+        if (h.type == ROARING_TYPE_BITMAP)
+            roaring_or_words(words, data + h.offset);
+        else
+            roaring_fill(words, &h, data + h.offset);
+    }
+}
+
+void roaring_and(uint64_t *bits, size_t n_words, const uint8_t *data)
+{
+    struct roaring_header h;
+
+    uint64_t mask[ROARING_CHUNK_WORDS];
+
+    uint32_t c, n;
+
+    size_t chunk, next = 0;
+
+    memcpy(&n, data, sizeof(uint32_t));
+
+    for (c = 0; c <= n; c++) {
+        if (c < n)
+            roaring_get_header(data, c, &h);
+        else
+            h.key = UINT16_MAX;
+
+        chunk = (c < n) ? (size_t)h.key * ROARING_CHUNK_WORDS : n_words;
+
+        if (chunk > n_words)
+            chunk = n_words;
+
+        /* chunks without a container have no ids in common */
+        if (chunk > next)
+            bzero(bits + next, (chunk - next) * sizeof(uint64_t));
+
+        if (chunk >= n_words)
+            return;
+
+        if (h.type == ROARING_TYPE_BITMAP) {
+            roaring_and_words(bits + chunk, data + h.offset);
+        }
+        else {
+            bzero(mask, sizeof(mask));
+
+            roaring_fill(mask, &h, data + h.offset);
+            roaring_and_words(bits + chunk, (const uint8_t *)mask);
+        }
+
+        next = chunk + ROARING_CHUNK_WORDS;
+    }
+}
+
+uint64_t roaring_popcount(const uint64_t *bits, size_t n_words)
+{
+    uint64_t total = 0;
+
+    size_t i;
+
+#ifdef ROARING_X86
+    if (roaring_has_avx2())
+        return roaring_popcount_avx2(bits, n_words);
+#endif
+
+    for (i = 0; i < n_words; i++)
+        total += __builtin_popcountll(bits[i]);
+
+    return total;
+}
+
+size_t roaring_extract(uint64_t *bits, size_t n_words, uint32_t *out)
+{
+    size_t i, n = 0;
+
+    uint64_t word;
+
+    for (i = 0; i < n_words; i++) {
+        for (word = bits[i]; word != 0; word &= word - 1)
+            out[n++] = i * 64 + __builtin_ctzll(word);
+
+        bits[i] = 0;
+    }
+
+    return n;
+}
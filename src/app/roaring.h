@@ -0,0 +1,70 @@
+/*
+ * roaring.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* ids per container, and the 64-bit words of a flat bitmap covering one */
+#define ROARING_CHUNK_SIZE      65536
+#define ROARING_CHUNK_WORDS     (ROARING_CHUNK_SIZE / 64)
+
+/*
+ * A sorted id list as roaring containers: the ids are split by their high
+ * 16 bits, and each chunk is stored as a sorted array of the low 16 bits,
+ * a 65536 bit bitmap, or a list of runs, whichever is smallest. Every
+ * container also carries the minimum of a caller-supplied per-id value
+ * (0 if none is given).
+ */
+struct roaring_reader
+{
+    const uint8_t *data;
+    uint32_t n_containers;
+
+    /* current container, and the position in it (array index, bit or run) */
+    uint32_t c, pos, run_offset;
+};
+
+/*
+ * Encodes ids[0, n) into out, or only measures it if out is NULL.
+ * Returns the encoded size. values, if not NULL, is indexed by id.
+ */
+size_t roaring_encode(uint8_t *out, const uint32_t *ids, uint32_t n, const uint32_t *values);
+
+void roaring_open(struct roaring_reader *r, const uint8_t *data);
+
+/*
+ * Writes up to max of the next ids to out. Returns how many, 0 at the end.
+ */
+uint32_t roaring_next(struct roaring_reader *r, uint32_t *out, uint32_t max);
+
+/*
+ * Moves forward so that the next id read is the first one >= target.
+ */
+void roaring_seek(struct roaring_reader *r, uint32_t target);
+
+/*
+ * Finds the container that would hold target, or the next one. Returns
+ * false if there is none; otherwise stores the last id it could hold and
+ * its minimum value.
+ */
+bool roaring_bound(struct roaring_reader *r, uint32_t target, uint32_t *last, uint32_t *value);
+
+/*
+ * Kernels over flat bitmaps of n_words words, which must cover whole
+ * containers (a multiple of ROARING_CHUNK_WORDS). Bitmap containers are
+ * combined with AVX2 or SSE2 when available.
+ */
+void roaring_or(uint64_t *bits, size_t n_words, const uint8_t *data);
+
+void roaring_and(uint64_t *bits, size_t n_words, const uint8_t *data);
+
+uint64_t roaring_popcount(const uint64_t *bits, size_t n_words);
+
+/*
+ * Writes the ids set in bits to out, in order, and clears bits. Returns
+ * the number of ids.
+ */
+size_t roaring_extract(uint64_t *bits, size_t n_words, uint32_t *out);
@@ -1,6 +1,7 @@
 #include "cgi.h"
 #include "util.h"
 #include "db.h"
+#include "rcache.h"
 
 #include <jx_util.h>
 
@@ -38,13 +39,17 @@ jx_value *get_input(jx_cntx *cntx)
 {
     ssize_t r;
 
+    char buf[2048];
+
     if (cntx == NULL) {
         return NULL;
     }
 
-    do {
-        r = jx_read(cntx, 0, 2048);
-    } while (r > 0);
+    while ((r = cgi_read_input(buf, sizeof(buf))) > 0) {
+        if (jx_parse_json(cntx, buf, r) == -1) {
+            return NULL;
+        }
+    }
 
     if (r < 0) {
         return NULL;
@@ -62,6 +67,63 @@ void output_json(jx_value *v)
     free(str);
 }
 
+int compare_tokens(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Result cache key: everything the response depends on, with the query
+ * reduced to its sorted set of tokens so that reordered or repeated
+ * words share an entry.
+ */
+char *get_cache_key(struct kws_request *request, const char *cursor)
+{
+    jx_value *tokens, *key;
+
+    char buf[128], **list, *r;
+
+    size_t i, n;
+
+    if (request->query == NULL)
+        return NULL;
+
+    tokens = db_get_tokens(request->query);
+    n = jxa_get_length(tokens);
+    list = malloc((n + 1) * sizeof(char *));
+
+    if (list == NULL) {
+        jxv_free(tokens);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        list[i] = jxs_get_str(jxa_get(tokens, i));
+    }
+
+    qsort(list, n, sizeof(char *), compare_tokens);
+
+    snprintf(buf, sizeof(buf), "%d|%d|%d|%d|%d|%s|", request->type, request->mode, request->min_match,
+        request->page, request->page_size, (cursor != NULL) ? cursor : "");
+
+    key = jxs_new(buf);
+
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            jxs_push(key, ' ');
+
+        jxs_append_str(key, list[i]);
+    }
+
+    r = strdup(jxs_get_str(key));
+
+    jxv_free(key);
+    jxv_free(tokens);
+    free(list);
+
+    return r;
+}
+
 void output_error(jx_cntx *cntx)
 {
     if (cntx != NULL) {
@@ -82,6 +144,10 @@ void cgi_main()
     jx_cntx *cntx;
     jx_value *obj, *params;
 
+    char cursor[64], *cursor_param, *key, *body = NULL;
+
+    size_t body_size;
+
     bzero(&request, sizeof(request));
     bzero(&response, sizeof(response));
 
@@ -102,21 +168,42 @@ void cgi_main()
     params = jxd_get(obj, "params");
 
     request.type = (int)jxd_get_number(params, "type", NULL);
+    request.mode = (int)jxd_get_number(params, "mode", NULL);
+    request.min_match = (int)jxd_get_number(params, "min_match", NULL);
     request.query = jxd_get_string(params, "search", NULL);
     request.page = (int)jxd_get_number(params, "page", NULL);
     request.page_size = (int)jxd_get_number(params, "page_size", NULL);
 
-    if (db_kw_search(&response, &request)) {
+    cursor_param = jxd_get_string(params, "cursor", NULL);
+
+    db_parse_cursor(cursor_param, &request.cursor);
+
+    key = rcache_is_open() ? get_cache_key(&request, cursor_param) : NULL;
+
+    if (key != NULL && (body = rcache_get(key, &body_size)) != NULL) {
+        cgi_printf("%s", body);
+    }
+    else if (db_kw_search(&response, &request)) {
         jx_value *r = jxd_new();
 
         jxd_put_number(r, "matches", response.matches);
 
+        if (response.cursor.set) {
+            db_format_cursor(&response.cursor, cursor, sizeof(cursor));
+            jxd_put_string(r, "cursor", cursor);
+        }
+
         if (response.result != NULL)
             jxd_put(r, "result", response.result);
         else
             jxd_put(r, "result", jxa_new(0));
 
-        output_json(r);
+        body = jx_serialize_json(r, false);
+
+        cgi_printf("%s", body);
+
+        if (key != NULL && body != NULL)
+            rcache_put(key, body, strlen(body));
 
         jxv_free(r);
     }
@@ -130,6 +217,9 @@ void cgi_main()
         jxv_free(r);
     }
 
+    free(body);
+    free(key);
+
     jxv_free(obj);
 
     jx_free(cntx);
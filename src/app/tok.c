@@ -0,0 +1,365 @@
+/*
+ * tok.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tok.h"
+
+/* tok_fold_stage1/2, generated by kws-mkfold */
+#include "fold_tables.h"
+
+#if defined(__x86_64__) && !defined(KWS_NO_SIMD)
+#define TOK_X86
+#include <immintrin.h>
+#endif
+
+#define TOK_STACK_BUF_SIZE  1024
+#define TOK_BLOCK_SIZE      32
+
+/* sorted, for bsearch() */
+static const char *tok_stopwords[] =
+{
+    "a", "about", "after", "all", "also", "an", "and", "any", "are", "as", "at",
+    "be", "been", "but", "by", "can", "could", "did", "do", "does", "for", "from",
+    "had", "has", "have", "how", "i", "if", "in", "into", "is", "it", "its",
+    "many", "more", "most", "much", "no", "not", "of", "on", "or", "other",
+    "should", "so", "some", "such", "than", "that", "the", "their", "them",
+    "then", "there", "these", "they", "this", "those", "to", "was", "were",
+    "what", "when", "where", "which", "who", "whom", "whose", "why", "will",
+    "with", "would", "you", "your"
+};
+
+static int tok_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+bool tok_is_stopword(const char *token)
+{
+    return bsearch(&token, tok_stopwords, sizeof(tok_stopwords) / sizeof(tok_stopwords[0]),
+        sizeof(tok_stopwords[0]), tok_compare) != NULL;
+}
+
+/*
+ * Token bytes are ASCII letters and digits, and every byte of a
+ * multibyte UTF-8 sequence. Everything else is a delimiter.
+ */
+static inline bool tok_is_token_byte(unsigned char c)
+{
+    return c >= 0x80 || (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10;
+}
+
+/*
+ * Bit i of the result is set when s[i] is a token byte, for n <= 32.
+ */
+static uint32_t tok_mask_scalar(const unsigned char *s, size_t n)
+{
+    uint32_t mask = 0;
+
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        mask |= (uint32_t)tok_is_token_byte(s[i]) << i;
+
+    return mask;
+}
+
+static inline char tok_lower_ascii(char c)
+{
+    return c + (((unsigned char)(c - 'A') < 26) ? 0x20 : 0);
+}
+
+/*
+ * Decodes one UTF-8 sequence of at most n bytes. Returns its length, or 0
+ * if it is malformed, overlong or a surrogate.
+ */
+static size_t tok_decode_utf8(const unsigned char *s, size_t n, uint32_t *cp)
+{
+    if (s[0] >= 0xC2 && s[0] <= 0xDF && n >= 2 && (s[1] & 0xC0) == 0x80) {
+        *cp = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        return 2;
+    }
+
+    if (s[0] >= 0xE0 && s[0] <= 0xEF && n >= 3 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+        *cp = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        return (*cp >= 0x800 && (*cp < 0xD800 || *cp > 0xDFFF)) ? 3 : 0;
+    }
+
+    return 0;
+}
+
+static size_t tok_encode_utf8(char *dst, uint32_t cp)
+{
+    if (cp < 0x80) {
+        dst[0] = cp;
+        return 1;
+    }
+
+    if (cp < 0x800) {
+        dst[0] = 0xC0 | (cp >> 6);
+        dst[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+
+    dst[0] = 0xE0 | (cp >> 12);
+    dst[1] = 0x80 | ((cp >> 6) & 0x3F);
+    dst[2] = 0x80 | (cp & 0x3F);
+    return 3;
+}
+
+static uint32_t tok_fold_code_point(uint32_t cp)
+{
+    uint8_t block = tok_fold_stage1[cp >> TOK_FOLD_BLOCK_SHIFT];
+
+    if (block == 0)
+        return cp;
+
+    return tok_fold_stage2[block - 1][cp & ((1 << TOK_FOLD_BLOCK_SHIFT) - 1)];
+}
+
+#ifdef TOK_X86
+static uint32_t tok_mask_sse2(const unsigned char *s)
+{
+    __m128i x, l, alpha, digit;
+
+    x = _mm_loadu_si128((const __m128i *)s);
+    l = _mm_or_si128(x, _mm_set1_epi8(0x20));
+
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+    digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+
+    /* the sign bit of x marks bytes >= 0x80 */
+    return (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), x));
+}
+
+/*
+ * Lowercases 16 bytes into dst if they are all ASCII; returns false,
+ * writing nothing, otherwise.
+ */
+static bool tok_fold_ascii_sse2(char *dst, const char *src)
+{
+    __m128i x, upper;
+
+    x = _mm_loadu_si128((const __m128i *)src);
+
+    if (_mm_movemask_epi8(x) != 0)
+        return false;
+
+    upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(x, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+
+    return true;
+}
+
+__attribute__((target("avx2")))
+static uint32_t tok_mask_avx2(const unsigned char *s)
+{
+    __m256i x, l, alpha, digit;
+
+    x = _mm256_loadu_si256((const __m256i *)s);
+    l = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+
+    alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+    digit = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+
+    return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), x));
+}
+
+__attribute__((target("avx2")))
+static bool tok_fold_ascii_avx2(char *dst, const char *src)
+{
+    __m256i x, upper;
+
+    x = _mm256_loadu_si256((const __m256i *)src);
+
+    if (_mm256_movemask_epi8(x) != 0)
+        return false;
+
+    upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi8(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+
+    return true;
+}
+
+static bool tok_has_avx2()
+{
+    static int has_avx2 = -1;
+
+    if (has_avx2 == -1)
+        has_avx2 = __builtin_cpu_supports("avx2");
+
+    return has_avx2;
+}
+#endif
+
+/*
+ * Token byte mask of a full block of TOK_BLOCK_SIZE bytes.
+ */
+static uint32_t tok_mask_block(const unsigned char *s)
+{
+#ifdef TOK_X86
+    if (tok_has_avx2())
+        return tok_mask_avx2(s);
+
+    return tok_mask_sse2(s) | (tok_mask_sse2(s + 16) << 16);
+#else
+    return tok_mask_scalar(s, TOK_BLOCK_SIZE);
+#endif
+}
+
+size_t tok_fold(char *dst, const char *src, size_t length)
+{
+    const unsigned char *s = (const unsigned char *)src;
+
+    size_t i = 0, o = 0, n;
+
+    uint32_t cp;
+
+    while (i < length) {
+#ifdef TOK_X86
+        /* pure ASCII runs are lowercased a block at a time */
+        if (tok_has_avx2() && i + 32 <= length && tok_fold_ascii_avx2(dst + o, src + i)) {
+            i += 32;
+            o += 32;
+            continue;
+        }
+
+        if (i + 16 <= length && tok_fold_ascii_sse2(dst + o, src + i)) {
+            i += 16;
+            o += 16;
+            continue;
+        }
+#endif
+
+        if (s[i] < 0x80) {
+            dst[o++] = tok_lower_ascii(src[i++]);
+            continue;
+        }
+
+        /* 4 byte sequences, malformed bytes and lone continuations pass through */
+        if ((n = tok_decode_utf8(s + i, length - i, &cp)) == 0) {
+            dst[o++] = src[i++];
+            continue;
+        }
+
+        i += n;
+
+        if ((cp = tok_fold_code_point(cp)) != 0)
+            o += tok_encode_utf8(dst + o, cp);
+    }
+
+    return o;
+}
+
+size_t tok_spans(const char *str, size_t length, struct tok_span *spans, size_t max)
+{
+    const unsigned char *s = (const unsigned char *)str;
+
+    size_t n = 0, block, n_bytes, pos, start = 0;
+
+    uint32_t mask, rest;
+
+    bool in_token = false;
+
+    for (block = 0; block < length; block += TOK_BLOCK_SIZE) {
+        n_bytes = length - block;
+
+        if (n_bytes >= TOK_BLOCK_SIZE) {
+            n_bytes = TOK_BLOCK_SIZE;
+            mask = tok_mask_block(s + block);
+        }
+        else {
+            mask = tok_mask_scalar(s + block, n_bytes);
+        }
+
+        /* alternate between the next token byte and the next delimiter */
+        for (pos = 0; pos < n_bytes; ) {
+            rest = (in_token ? ~mask : mask) >> pos;
+
+            if (rest == 0)
+                break;
+
+            pos += __builtin_ctz(rest);
+
+            if (pos >= n_bytes)
+                break;
+
+            if (!in_token) {
+                start = block + pos;
+            }
+            else {
+                if (n < max) {
+                    spans[n].start = start;
+                    spans[n].length = block + pos - start;
+                }
+
+                n++;
+            }
+
+            in_token = !in_token;
+        }
+    }
+
+    if (in_token) {
+        if (n < max) {
+            spans[n].start = start;
+            spans[n].length = length - start;
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
+bool tok_split(const char *str, tok_cb cb, void *ptr)
+{
+    char stack_buf[TOK_STACK_BUF_SIZE], *buf;
+
+    struct tok_span stack_spans[TOK_STACK_BUF_SIZE / 4], *spans = stack_spans;
+
+    size_t length = strlen(str), max, n, i;
+
+    bool ok = true;
+
+    /* folding grows a sequence by at most half (2 bytes to 3) */
+    buf = (length * 2 < sizeof(stack_buf)) ? stack_buf : malloc(length * 2 + 1);
+
+    if (buf == NULL)
+        return false;
+
+    length = tok_fold(buf, str, length);
+
+    max = length / 2 + 1;
+
+    if (max > sizeof(stack_spans) / sizeof(stack_spans[0]) && (spans = malloc(max * sizeof(struct tok_span))) == NULL) {
+        ok = false;
+        goto exit;
+    }
+
+    n = tok_spans(buf, length, spans, max);
+
+    for (i = 0; ok && i < n; i++) {
+        buf[spans[i].start + spans[i].length] = '\0';
+
+        ok = cb(buf + spans[i].start, ptr);
+    }
+
+exit:
+    if (buf != stack_buf)
+        free(buf);
+
+    if (spans != stack_spans)
+        free(spans);
+
+    return ok;
+}
@@ -0,0 +1,56 @@
+/*
+ * tok.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A token as a byte range of the input string.
+ */
+struct tok_span
+{
+    size_t start;
+    size_t length;
+};
+
+/*
+ * Longest token worth looking up, in bytes: keywords are at most
+ * VARCHAR(128). Callers drop longer tokens.
+ */
+#define TOK_MAX_LENGTH      128
+
+/*
+ * Called once per token with a NUL terminated, lowercased token. Returning
+ * false stops the split.
+ */
+typedef bool (*tok_cb)(char *token, void *ptr);
+
+/*
+ * The tokenizer shared by query parsing and keyword extraction, so that
+ * both normalize text the same way. Text is folded first (tok_fold), then
+ * split into runs of letters and digits; whitespace and punctuation only
+ * separate tokens. Block kernels use AVX2 or SSE2 when available, and
+ * scalar code otherwise (or with -DKWS_NO_SIMD).
+ */
+bool tok_split(const char *str, tok_cb cb, void *ptr);
+
+/*
+ * Finds the tokens of str[0, length) without copying. Returns the number
+ * of tokens; only the first max are written to spans. A string of n bytes
+ * has at most n / 2 + 1 tokens.
+ */
+size_t tok_spans(const char *str, size_t length, struct tok_span *spans, size_t max);
+
+/*
+ * Folds UTF-8 src[0, length) into dst: lowercase, Latin diacritics
+ * removed ("Ünïcode" becomes "unicode"), combining marks dropped and
+ * non-ASCII punctuation and spaces mapped to ' '. ASCII punctuation is
+ * copied unchanged; like ' ', tok_split() only treats it as a separator.
+ * Covers the BMP; other bytes are copied. dst needs room for 3 / 2 *
+ * length bytes. Returns the length written.
+ */
+size_t tok_fold(char *dst, const char *src, size_t length);
+
+bool tok_is_stopword(const char *token);
@@ -18,7 +18,7 @@ bool util_lookup_value_in_kv_string(const char *ptr, char *dst, size_t size, con
 {
     size_t i;
 
-    char *kv_string, *tok, *kv_sep, *val;
+    char *kv_string, *tok, *kv_sep, *val, *save_ptr;
 
     if (dst == NULL || size <= 0 || key == NULL)
         return false;
@@ -34,7 +34,7 @@ bool util_lookup_value_in_kv_string(const char *ptr, char *dst, size_t size, con
 
     val = NULL;
 
-    tok = strtok(kv_string, delim);
+    tok = strtok_r(kv_string, delim, &save_ptr);
 
     while (tok != NULL) {
         while (isspace(*tok))
@@ -49,7 +49,7 @@ bool util_lookup_value_in_kv_string(const char *ptr, char *dst, size_t size, con
             }
         }
 
-        tok = strtok(NULL, delim);
+        tok = strtok_r(NULL, delim, &save_ptr);
     }
 
     if (val != NULL) {
@@ -5,16 +5,28 @@ kwsContext = {
             type: 0,
             search: "",
             page: 1,
-            page_size: 1000
+            page_size: 25
         }
     },
     response: "",
     responseObj: {},
     model: [],
+    cursor: null,
+    loading: false,
+    generation: 0,
     fetch: (callback) => {
         let r = new XMLHttpRequest();
+        let generation = kwsContext.generation;
+
+        kwsContext.loading = true;
 
         r.addEventListener("load", () => {
+            /* a newer search has replaced the one this page belongs to */
+            if (generation != kwsContext.generation)
+                return;
+
+            kwsContext.loading = false;
+
             if (!r.responseText)
                 return;
 
@@ -26,6 +38,8 @@ kwsContext = {
                 return;
             }
 
+            kwsContext.cursor = kwsContext.responseObj.cursor || null;
+
             if (kwsContext.responseObj.result) {
                 kwsContext.model = kwsContext.responseObj.result;
             }
@@ -33,6 +47,11 @@ kwsContext = {
             callback();
         });
 
+        r.addEventListener("error", () => {
+            if (generation == kwsContext.generation)
+                kwsContext.loading = false;
+        });
+
         r.open("POST", getSearchURL(), true);
 
         r.send(JSON.stringify(kwsContext.data));
@@ -98,13 +117,40 @@ function addAppEventHandlers()
     let kwsInput = document.getElementById('kws');
 
     addExecuteAfterInputDelayHandler(kwsInput, () => {
+        kwsContext.generation++;
+        kwsContext.cursor = null;
         kwsContext.data.params.search = kwsInput.value;
 
+        delete kwsContext.data.params.cursor;
+
         kwsContext.fetch(() => {
             kwsContext.update();
+            fetchMoreResultsIfNeeded();
         });
     });
 
+    addEventListener("scroll", fetchMoreResultsIfNeeded);
+}
+
+/*
+ * Infinite scroll: once the end of the results is close to the bottom
+ * of the window, the next page is requested with the cursor returned by
+ * the previous one and appended.
+ */
+function fetchMoreResultsIfNeeded()
+{
+    if (kwsContext.loading || !kwsContext.cursor)
+        return;
+
+    if (window.innerHeight + window.scrollY < document.body.offsetHeight - 300)
+        return;
+
+    kwsContext.data.params.cursor = kwsContext.cursor;
+
+    kwsContext.fetch(() => {
+        addQuestions(document.getElementById('results'));
+        fetchMoreResultsIfNeeded();
+    });
 }
 
 function getSearchURL()
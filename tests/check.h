@@ -0,0 +1,73 @@
+/*
+ * check.h
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Assertions for the make check programs: a failed CHECK() prints where
+ * and is counted, and check_report() turns the count into the exit code.
+ */
+static int check_failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            if (check_failures++ < 20) \
+                fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+/*
+ * Fixed seed xorshift, so that a failure can be reproduced.
+ */
+static uint64_t check_rand_state = 0x9E3779B97F4A7C15ull;
+
+static inline uint32_t check_rand()
+{
+    check_rand_state ^= check_rand_state << 13;
+    check_rand_state ^= check_rand_state >> 7;
+    check_rand_state ^= check_rand_state << 17;
+
+    return (uint32_t)(check_rand_state >> 32);
+}
+
+/*
+ * Hash of everything the code under test returned. make check builds
+ * the programs twice, with and without -DKWS_NO_SIMD, and compares the
+ * digests, so the SIMD and scalar kernels have to agree byte for byte.
+ */
+static uint64_t check_digest_state = 0xcbf29ce484222325ull;
+
+static inline void check_digest(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    while (size-- > 0) {
+        check_digest_state ^= *(p++);
+        check_digest_state *= 0x100000001b3ull;
+    }
+}
+
+#ifdef KWS_NO_SIMD
+#define CHECK_BUILD     " (scalar)"
+#else
+#define CHECK_BUILD     ""
+#endif
+
+/*
+ * Prints "name: ok, output <digest>"; make check compares the last word
+ * of the two builds.
+ */
+static inline int check_report(const char *name)
+{
+    if (check_failures > 0)
+        fprintf(stderr, "%s%s: %d checks failed\n", name, CHECK_BUILD, check_failures);
+    else
+        printf("%s%s: ok, output %016llx\n", name, CHECK_BUILD, (unsigned long long)check_digest_state);
+
+    return check_failures > 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * db_tests.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "../src/app/db.h"
+
+#include <jx_util.h>
+
+#include "check.h"
+
+#define CHECK_N_QUESTIONS   6
+#define CHECK_MAX_KEYWORDS  3
+
+/*
+ * Keywords as stored, which kws-normalize (db_fold_keywords) has to split
+ * like a query, and the tokens they become. They are chosen so that like
+ * searches match several keywords per token, and several tokens per
+ * question.
+ */
+static const char *check_stored[CHECK_N_QUESTIONS][CHECK_MAX_KEYWORDS] =
+{
+    { "Moon", "diameter", NULL },
+    { "moonlight", "sun", NULL },
+    { "honeymoon", "mass", "massive" },
+    { "sun", "Temperature", NULL },
+    { "mass", "electron", "MASS" },
+    { "galaxy", "Milky-Way", NULL }
+};
+
+static const char *check_keywords[CHECK_N_QUESTIONS][CHECK_MAX_KEYWORDS] =
+{
+    { "moon", "diameter", NULL },
+    { "moonlight", "sun", NULL },
+    { "honeymoon", "mass", "massive" },
+    { "sun", "temperature", NULL },
+    { "mass", "electron", NULL },
+    { "galaxy", "milky", "way" }
+};
+
+static const char *check_queries[] =
+{
+    "moon", "oon", "mass", "ass moo", "sun moon", "oon ass", "temperature", "galaxy sun mass", "zzz", "moon zzz",
+    "milky-way", "way", "ilk"
+};
+
+static bool check_exec_file(sqlite3 *db, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    char *sql;
+
+    long size;
+
+    bool ok;
+
+    if (fp == NULL)
+        return false;
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    sql = calloc(size + 1, 1);
+    ok = sql != NULL && fread(sql, 1, size, fp) == (size_t)size && sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK;
+
+    free(sql);
+    fclose(fp);
+
+    return ok;
+}
+
+static bool check_create(const char *path)
+{
+    sqlite3 *db;
+
+    char sql[256];
+
+    int q, k;
+
+    bool ok;
+
+    unlink(path);
+
+    if (sqlite3_open(path, &db) != SQLITE_OK)
+        return false;
+
+    ok = check_exec_file(db, "sql/00_schema.sql");
+
+    for (q = 0; ok && q < CHECK_N_QUESTIONS; q++) {
+        snprintf(sql, sizeof(sql), "INSERT INTO questions (question) VALUES ('question %d');"
+            "INSERT INTO answers (qid, answer) VALUES (%d, 'answer %d');", q, q + 1, q);
+
+        ok = sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK;
+
+        for (k = 0; ok && k < CHECK_MAX_KEYWORDS && check_stored[q][k] != NULL; k++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO keywords (qid, keyword) VALUES (%d, '%s');", q + 1, check_stored[q][k]);
+
+            ok = sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK;
+        }
+    }
+
+    sqlite3_close(db);
+
+    return ok;
+}
+
+static bool check_fold(const char *path)
+{
+    bool ok;
+
+    db_set_path("%s", path);
+
+    if (!db_open())
+        return false;
+
+    ok = db_fold_keywords();
+
+    db_close();
+
+    return ok;
+}
+
+static bool check_migrate(const char *path)
+{
+    sqlite3 *db;
+
+    bool ok;
+
+    if (sqlite3_open(path, &db) != SQLITE_OK)
+        return false;
+
+    ok = check_exec_file(db, "sql/migrate/v2.sql");
+
+    sqlite3_close(db);
+
+    return ok;
+}
+
+/*
+ * The number of tokens of query found in keywords of question q, as
+ * substrings for like searches; -1 adds up the tokens found anywhere.
+ */
+static int check_count_tokens(const char *query, enum kw_search_type type, int q)
+{
+    char buf[64], *token, *save;
+
+    int n = 0, i, k;
+
+    bool found;
+
+    strcpy(buf, query);
+
+    for (token = strtok_r(buf, " -", &save); token != NULL; token = strtok_r(NULL, " -", &save)) {
+        for (i = (q < 0) ? 0 : q, found = false; !found && i < ((q < 0) ? CHECK_N_QUESTIONS : q + 1); i++) {
+            for (k = 0; !found && k < CHECK_MAX_KEYWORDS && check_keywords[i][k] != NULL; k++) {
+                found = (type == KW_SEARCH_TYPE_EXACT) ? strcmp(check_keywords[i][k], token) == 0 :
+                    strstr(check_keywords[i][k], token) != NULL;
+            }
+        }
+
+        n += found;
+    }
+
+    return n;
+}
+
+/*
+ * Runs every query, matching any token, and checks the match count and
+ * the questions returned, with their rank when the engine ranks by the
+ * number of tokens matched.
+ */
+static void check_search(enum kw_search_type type, bool counts_tokens)
+{
+    struct kws_request request = { .type = type, .mode = KW_MATCH_MODE_ANY };
+    struct kws_response response;
+
+    jx_value *item;
+
+    const char *question;
+
+    bool returned[CHECK_N_QUESTIONS];
+
+    int n, i, q;
+
+    for (n = 0; n < sizeof(check_queries) / sizeof(check_queries[0]); n++) {
+        bzero(&response, sizeof(response));
+        bzero(returned, sizeof(returned));
+
+        request.query = check_queries[n];
+
+        CHECK(db_kw_search(&response, &request));
+        CHECK(response.matches == check_count_tokens(request.query, type, -1));
+
+        for (i = 0; response.result != NULL && i < jxa_get_length(response.result); i++) {
+            item = jxa_get(response.result, i);
+            question = jxd_get_string(item, "question", NULL);
+
+            CHECK(question != NULL && sscanf(question, "question %d", &q) == 1 && q >= 0 && q < CHECK_N_QUESTIONS);
+
+            if (question == NULL || sscanf(question, "question %d", &q) != 1 || q < 0 || q >= CHECK_N_QUESTIONS)
+                continue;
+
+            CHECK(!returned[q]);
+            returned[q] = true;
+
+            if (counts_tokens)
+                CHECK((int)jxd_get_number(item, "rank", NULL) == check_count_tokens(request.query, type, q));
+
+            check_digest(&q, sizeof(q));
+        }
+
+        for (q = 0; q < CHECK_N_QUESTIONS; q++)
+            CHECK(returned[q] == (check_count_tokens(request.query, type, q) > 0));
+
+        jxv_free(response.result);
+    }
+}
+
+static void check_engines(const char *path)
+{
+    db_set_path("%s", path);
+
+    if (!db_open_read_only()) {
+        CHECK(!"database open failed");
+        return;
+    }
+
+    check_search(KW_SEARCH_TYPE_EXACT, true);
+    check_search(KW_SEARCH_TYPE_LIKE, true);
+
+    CHECK(db_load_index());
+
+    check_search(KW_SEARCH_TYPE_EXACT, false);
+    check_search(KW_SEARCH_TYPE_LIKE, false);
+
+    db_free_index();
+
+    db_close();
+}
+
+int main(int argc, char **argv)
+{
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.db", argv[0]);
+
+    /* schema v1, then the same keywords migrated to v2 before folding */
+    CHECK(check_create(path) && check_fold(path));
+    check_engines(path);
+
+    CHECK(check_create(path) && check_migrate(path) && check_fold(path));
+    check_engines(path);
+
+    unlink(path);
+
+    return check_report("db_tests");
+}
@@ -0,0 +1,168 @@
+/*
+ * kwidx_tests.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+/* included rather than linked, for the static pack kernels */
+#include "../src/app/kwidx.c"
+
+#include "check.h"
+
+#define CHECK_N_DOCS    100000
+
+/*
+ * Round trips a block through kwidx_pack() and kwidx_unpack() at every
+ * bit width, gaps of the full width included.
+ */
+static void check_pack()
+{
+    uint32_t gaps[KWIDX_BLOCK_SIZE], docs[KWIDX_BLOCK_SIZE], bits, mask, base, doc, i, round;
+
+    uint8_t packed[16 * 32];
+
+    for (bits = 0; bits <= 32; bits++) {
+        mask = (bits == 32) ? UINT32_MAX : (1u << bits) - 1;
+
+        for (round = 0; round < 16; round++) {
+            for (i = 0; i < KWIDX_BLOCK_SIZE; i++)
+                gaps[i] = (round == 0) ? mask : check_rand() & mask;
+
+            base = (round == 0) ? 0 : check_rand();
+
+            kwidx_pack(packed, gaps, bits);
+            kwidx_unpack(docs, packed, bits, base);
+            check_digest(docs, sizeof(docs));
+
+            for (i = 0, doc = base; i < KWIDX_BLOCK_SIZE; i++) {
+                doc += gaps[i];
+                CHECK(docs[i] == doc);
+            }
+        }
+    }
+}
+
+/*
+ * Picks n distinct docs, in order. Patterns other than random give long
+ * runs (roaring run containers) and gaps of every size.
+ */
+static uint32_t check_pick_docs(uint32_t *docs, uint32_t n, int pattern)
+{
+    static uint8_t used[CHECK_N_DOCS];
+
+    uint32_t i, d, count = 0;
+
+    bzero(used, sizeof(used));
+
+    for (i = 0; i < n; i++) {
+        if (pattern == 1) {
+            d = (CHECK_N_DOCS - n) / 2 + i;
+        }
+        else if (pattern == 2) {
+            d = (uint32_t)((uint64_t)i * (CHECK_N_DOCS - 1) / (n > 1 ? n - 1 : 1));
+        }
+        else {
+            do {
+                d = check_rand() % CHECK_N_DOCS;
+            } while (used[d]);
+        }
+
+        used[d] = 1;
+    }
+
+    for (d = 0; d < CHECK_N_DOCS; d++) {
+        if (used[d])
+            docs[count++] = d;
+    }
+
+    return count;
+}
+
+/*
+ * Builds an index whose posting lists cover packed lists with and without
+ * a partial last block and roaring lists, then reads every list back in
+ * full and through seeks.
+ */
+static void check_postings()
+{
+    static const uint32_t sizes[] = { 1, 2, 127, 128, 129, 255, 256, 1000, 6249, 6250, 20000, 99999, 100000 };
+
+    enum { N_SIZES = sizeof(sizes) / sizeof(sizes[0]), N_PATTERNS = 3 };
+
+    static uint32_t docs[N_SIZES * N_PATTERNS][CHECK_N_DOCS];
+
+    uint32_t n_docs[N_SIZES * N_PATTERNS], i, j, d, n, target, doc;
+
+    struct kwidx *idx = kwidx_new();
+    struct kwidx_postings p;
+
+    char name[32];
+
+    long k;
+
+    CHECK(idx != NULL);
+
+    for (d = 0; d < CHECK_N_DOCS; d++) {
+        snprintf(name, sizeof(name), "question %u", d);
+        CHECK(kwidx_add_question(idx, d + 1, name));
+    }
+
+    for (i = 0; i < N_SIZES * N_PATTERNS; i++) {
+        n_docs[i] = check_pick_docs(docs[i], sizes[i / N_PATTERNS], i % N_PATTERNS);
+
+        snprintf(name, sizeof(name), "k%03u", i);
+
+        for (j = 0; j < n_docs[i]; j++)
+            CHECK(kwidx_add_keyword(idx, name, docs[i][j] + 1));
+    }
+
+    CHECK(kwidx_finish(idx));
+
+    for (i = 0; i < N_SIZES * N_PATTERNS; i++) {
+        snprintf(name, sizeof(name), "k%03u", i);
+
+        k = kwidx_find_keyword(idx, name);
+
+        CHECK(k == (long)i);
+
+        if (k < 0)
+            continue;
+
+        kwidx_postings_open(idx, k, &p);
+
+        CHECK(p.n == n_docs[i]);
+
+        for (j = 0; (n = kwidx_postings_next(&p)) > 0; j += n) {
+            check_digest(p.docs, n * sizeof(uint32_t));
+
+            for (d = 0; d < n; d++)
+                CHECK(j + d < n_docs[i] && p.docs[d] == docs[i][j + d]);
+        }
+
+        CHECK(j == n_docs[i]);
+
+        kwidx_postings_open(idx, k, &p);
+
+        for (target = 0, j = 0; target < CHECK_N_DOCS; target += 1 + check_rand() % 2000) {
+            while (j < n_docs[i] && docs[i][j] < target)
+                j++;
+
+            if (kwidx_postings_seek(&p, target, &doc)) {
+                CHECK(j < n_docs[i] && doc == docs[i][j]);
+                check_digest(&doc, sizeof(doc));
+            }
+            else {
+                CHECK(j == n_docs[i]);
+            }
+        }
+    }
+
+    kwidx_free(idx);
+}
+
+int main()
+{
+    check_pack();
+    check_postings();
+
+    return check_report("kwidx_tests");
+}
@@ -0,0 +1,89 @@
+/*
+ * mph_tests.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/app/mph.h"
+
+#include "check.h"
+
+#define CHECK_MAX_KEYS  100000
+
+/*
+ * Builds the hash of keys[0, n) and looks every key up: each has to land
+ * on its own slot, and that slot has to point back at it.
+ */
+static void check_build(const char **keys, uint32_t n)
+{
+    uint32_t *pilots, *slots, seed, slot, i;
+
+    uint8_t *seen;
+
+    pilots = malloc((size_t)mph_get_n_buckets(n) * sizeof(uint32_t));
+    slots = malloc(((size_t)n + 1) * sizeof(uint32_t));
+    seen = calloc((size_t)n + 1, 1);
+
+    if (pilots == NULL || slots == NULL || seen == NULL) {
+        CHECK(!"out of memory");
+        goto exit;
+    }
+
+    CHECK(mph_build(keys, n, pilots, slots, &seed));
+
+    for (i = 0; i < n; i++) {
+        slot = mph_get_slot(pilots, n, mph_hash(keys[i], seed));
+
+        CHECK(slot < n);
+
+        if (slot >= n)
+            continue;
+
+        CHECK(!seen[slot] && slots[slot] == i);
+        check_digest(&slot, sizeof(slot));
+
+        seen[slot] = 1;
+    }
+
+    /* keys outside the set still land on some slot */
+    if (n > 0)
+        CHECK(mph_get_slot(pilots, n, mph_hash("not a key", seed)) < n);
+
+exit:
+    free(pilots);
+    free(slots);
+    free(seen);
+}
+
+int main()
+{
+    static char buf[CHECK_MAX_KEYS][16];
+
+    static const char *keys[CHECK_MAX_KEYS];
+
+    uint32_t i;
+
+    /* short keys that differ in a byte or two, the empty key among them */
+    for (i = 0; i < CHECK_MAX_KEYS; i++) {
+        if (i % 2 == 0)
+            snprintf(buf[i], sizeof(buf[i]), "%u", i);
+        else
+            snprintf(buf[i], sizeof(buf[i]), "k%x", i);
+
+        keys[i] = buf[i];
+    }
+
+    buf[0][0] = '\0';
+
+    check_build(keys, 0);
+    check_build(keys, 1);
+    check_build(keys + 1, 1);
+    check_build(keys, 2);
+    check_build(keys, MPH_BUCKET_SIZE + 1);
+    check_build(keys, 1000);
+    check_build(keys, CHECK_MAX_KEYS);
+
+    return check_report("mph_tests");
+}
@@ -0,0 +1,259 @@
+/*
+ * roaring_tests.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/app/roaring.h"
+
+#include "check.h"
+
+#define CHECK_N_CHUNKS  8
+#define CHECK_N_WORDS   (CHECK_N_CHUNKS * ROARING_CHUNK_WORDS)
+#define CHECK_N_IDS     (CHECK_N_CHUNKS * ROARING_CHUNK_SIZE)
+
+/*
+ * Fills a reference bitmap, one chunk pattern at a time, so that every
+ * container type shows up: sparse chunks are arrays, dense ones bitmaps,
+ * and runs or full chunks run containers. Some chunks stay empty.
+ */
+static void check_pick_bits(uint64_t *bits, int round)
+{
+    uint32_t chunk, base, low, length, pattern;
+
+    bzero(bits, CHECK_N_WORDS * sizeof(uint64_t));
+
+    for (chunk = 0; chunk < CHECK_N_CHUNKS; chunk++) {
+        pattern = (round == 0) ? chunk % 6 : check_rand() % 6;
+        base = chunk * ROARING_CHUNK_SIZE;
+
+        for (low = 0; low < ROARING_CHUNK_SIZE; low++) {
+            if ((pattern == 1 && check_rand() % 64 == 0) ||
+                (pattern == 2 && check_rand() % 2 == 0) ||
+                pattern == 5)
+                bits[(base + low) / 64] |= (uint64_t)1 << (low % 64);
+        }
+
+        if (pattern == 3) {
+            for (low = check_rand() % 1000; low < ROARING_CHUNK_SIZE; low += length + check_rand() % 1000 + 1) {
+                for (length = check_rand() % 2000 + 1; length > 0 && low < ROARING_CHUNK_SIZE; length--, low++)
+                    bits[(base + low) / 64] |= (uint64_t)1 << (low % 64);
+            }
+        }
+        else if (pattern == 4) {
+            /* the first and last id of the chunk only */
+            bits[base / 64] |= 1;
+            bits[(base + ROARING_CHUNK_SIZE - 1) / 64] |= (uint64_t)1 << 63;
+        }
+    }
+}
+
+static uint32_t check_get_ids(const uint64_t *bits, uint32_t *ids)
+{
+    uint32_t id, n = 0;
+
+    for (id = 0; id < CHECK_N_IDS; id++) {
+        if (bits[id / 64] >> (id % 64) & 1)
+            ids[n++] = id;
+    }
+
+    return n;
+}
+
+static uint8_t *check_encode(const uint32_t *ids, uint32_t n, const uint32_t *values)
+{
+    size_t size = roaring_encode(NULL, ids, n, values);
+
+    uint8_t *data = malloc(size);
+
+    CHECK(roaring_encode(data, ids, n, values) == size);
+
+    return data;
+}
+
+/*
+ * Reads the whole list back, in batches of every size up to a container.
+ */
+static void check_iterate(const uint8_t *data, const uint32_t *ids, uint32_t n, uint32_t *out)
+{
+    struct roaring_reader r;
+
+    uint32_t i = 0, got, max = 1;
+
+    roaring_open(&r, data);
+
+    while ((got = roaring_next(&r, out + i, max)) > 0) {
+        CHECK(got <= max && i + got <= n);
+
+        if (got > max || i + got > n)
+            return;
+
+        i += got;
+        max = (max < ROARING_CHUNK_SIZE) ? max * 3 + 1 : 1;
+    }
+
+    CHECK(i == n);
+    CHECK(memcmp(out, ids, (size_t)n * sizeof(uint32_t)) == 0);
+
+    check_digest(out, (size_t)i * sizeof(uint32_t));
+}
+
+/*
+ * Seeks to increasing targets, checking the next id read, and the
+ * container bound from the start, against a search of the sorted list.
+ */
+static void check_seek(const uint8_t *data, const uint32_t *ids, uint32_t n, const uint32_t *values)
+{
+    struct roaring_reader r, b;
+
+    uint32_t target, id, i, j, k, last, value, min;
+
+    roaring_open(&r, data);
+
+    for (target = check_rand() % 5000, i = 0; target < CHECK_N_IDS + 5000; target += check_rand() % 20000 + 1) {
+        for (; i < n && ids[i] < target; i++)
+            ;
+
+        /* from the start, the bound is the container of target's chunk even if its ids are all below target */
+        for (j = i; j > 0 && ids[j - 1] >> 16 >= target >> 16; j--)
+            ;
+
+        roaring_open(&b, data);
+
+        if (j < n) {
+            for (k = j, min = UINT32_MAX; k < n && ids[k] >> 16 == ids[j] >> 16; k++)
+                min = (values[ids[k]] < min) ? values[ids[k]] : min;
+
+            CHECK(roaring_bound(&b, target, &last, &value));
+            CHECK(last == (ids[j] | 0xFFFF) && value == min);
+        }
+        else {
+            CHECK(!roaring_bound(&b, target, &last, &value));
+        }
+
+        roaring_seek(&r, target);
+
+        if (i < n) {
+            CHECK(roaring_next(&r, &id, 1) == 1 && id == ids[i]);
+            check_digest(&id, sizeof(id));
+
+            /* the next target has to be past the id just read */
+            target = ids[i++];
+        }
+        else {
+            CHECK(roaring_next(&r, &id, 1) == 0);
+        }
+    }
+}
+
+/*
+ * Combines the list into another random bitmap, over all of it and over
+ * a prefix shorter than the list, then extracts the result.
+ */
+static void check_kernels(const uint8_t *data, const uint64_t *a, uint64_t *b, uint64_t *bits, uint32_t *out, uint32_t *ref)
+{
+    static const uint32_t sizes[] = { CHECK_N_WORDS, 3 * ROARING_CHUNK_WORDS };
+
+    uint32_t i, n, n_ref, n_words, s, intersect;
+
+    uint64_t count;
+
+    check_pick_bits(b, 1);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n_words = sizes[s];
+
+        for (intersect = 0; intersect <= 1; intersect++) {
+            memcpy(bits, b, CHECK_N_WORDS * sizeof(uint64_t));
+
+            if (intersect)
+                roaring_and(bits, n_words, data);
+            else
+                roaring_or(bits, n_words, data);
+
+            for (i = 0, count = 0; i < CHECK_N_WORDS; i++) {
+                if (i < n_words)
+                    CHECK(bits[i] == (intersect ? a[i] & b[i] : a[i] | b[i]));
+                else
+                    CHECK(bits[i] == b[i]);
+
+                count += (i < n_words) ? __builtin_popcountll(bits[i]) : 0;
+            }
+
+            check_digest(bits, CHECK_N_WORDS * sizeof(uint64_t));
+
+            CHECK(roaring_popcount(bits, n_words) == count);
+            CHECK(roaring_popcount(bits, n_words - 3) == count - __builtin_popcountll(bits[n_words - 1]) -
+                __builtin_popcountll(bits[n_words - 2]) - __builtin_popcountll(bits[n_words - 3]));
+
+            n_ref = check_get_ids(bits, ref);
+            n = roaring_extract(bits, CHECK_N_WORDS, out);
+
+            CHECK(n == n_ref && memcmp(out, ref, (size_t)n * sizeof(uint32_t)) == 0);
+            CHECK(roaring_popcount(bits, CHECK_N_WORDS) == 0);
+        }
+    }
+}
+
+int main()
+{
+    uint64_t *a, *b, *bits;
+
+    uint32_t *ids, *out, *ref, *values, i, n;
+
+    uint8_t *data;
+
+    int round;
+
+    a = malloc(CHECK_N_WORDS * sizeof(uint64_t));
+    b = malloc(CHECK_N_WORDS * sizeof(uint64_t));
+    bits = malloc(CHECK_N_WORDS * sizeof(uint64_t));
+    ids = malloc(CHECK_N_IDS * sizeof(uint32_t));
+    out = malloc(CHECK_N_IDS * sizeof(uint32_t));
+    ref = malloc(CHECK_N_IDS * sizeof(uint32_t));
+    values = malloc(CHECK_N_IDS * sizeof(uint32_t));
+
+    if (a == NULL || b == NULL || bits == NULL || ids == NULL || out == NULL || ref == NULL || values == NULL) {
+        fprintf(stderr, "roaring_tests: out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < CHECK_N_IDS; i++)
+        values[i] = check_rand();
+
+    for (round = 0; round < 8; round++) {
+        check_pick_bits(a, round);
+
+        n = check_get_ids(a, ids);
+        data = check_encode(ids, n, values);
+
+        check_iterate(data, ids, n, out);
+        check_seek(data, ids, n, values);
+        check_kernels(data, a, b, bits, out, ref);
+
+        free(data);
+    }
+
+    /* the empty list */
+    data = check_encode(ids, 0, NULL);
+
+    check_iterate(data, ids, 0, out);
+
+    memset(bits, 0xFF, CHECK_N_WORDS * sizeof(uint64_t));
+    roaring_and(bits, CHECK_N_WORDS, data);
+    CHECK(roaring_popcount(bits, CHECK_N_WORDS) == 0);
+
+    free(data);
+
+    free(a);
+    free(b);
+    free(bits);
+    free(ids);
+    free(out);
+    free(ref);
+    free(values);
+
+    return check_report("roaring_tests");
+}
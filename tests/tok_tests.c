@@ -0,0 +1,186 @@
+/*
+ * tok_tests.c
+ * Copyright (c) 2023, Cory Montgomery
+ */
+
+/* included rather than linked, for the static block kernels */
+#include "../src/app/tok.c"
+
+#include "check.h"
+
+#define CHECK_MAX_LENGTH    300
+
+/*
+ * Pieces random strings are made of: ASCII around the edges of the
+ * letter and digit ranges, long ASCII runs for the block fast paths,
+ * 2 and 3 byte UTF-8 (letters with diacritics, combining marks, spaces,
+ * symbols), and bytes that are not valid UTF-8.
+ */
+static const char *check_pieces[] =
+{
+    "a", "Z", "0", "9", "@", "[", "`", "{", "/", ":", " ", "\t", "-", "\x7F",
+    "The Quick Brown Fox Jumps Over The Lazy Dog 0123456789",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZ",
+    "\xC3\x89", "\xC3\x9C", "\xC3\x9F", "\xC3\xA9", "\xC4\xB0", "\xCC\x81", "\xCE\xA3",
+    "\xD0\x96", "\xC2\xA0", "\xE2\x80\x94", "\xE2\x82\xAC", "\xE4\xB8\xAD", "\xE1\xBA\x9E",
+    "\x80", "\xBF", "\xC0\xAF", "\xC3", "\xE2\x82", "\xED\xA0\x80", "\xF0\x9F\x98\x80", "\xFF"
+};
+
+static size_t check_pick_string(char *str)
+{
+    const char *piece;
+
+    size_t length = 0, max = check_rand() % CHECK_MAX_LENGTH, n;
+
+    while (length < max) {
+        piece = check_pieces[check_rand() % (sizeof(check_pieces) / sizeof(check_pieces[0]))];
+        n = strlen(piece);
+
+        if (length + n > max)
+            break;
+
+        memcpy(str + length, piece, n);
+        length += n;
+    }
+
+    return length;
+}
+
+/*
+ * The SIMD masks against the scalar one, over every byte value and over
+ * random blocks.
+ */
+static void check_masks()
+{
+    unsigned char block[TOK_BLOCK_SIZE];
+
+    uint32_t mask, expected;
+
+    int round, i;
+
+    for (round = 0; round < 10000; round++) {
+        for (i = 0; i < TOK_BLOCK_SIZE; i++)
+            block[i] = (round < 256 / TOK_BLOCK_SIZE) ? round * TOK_BLOCK_SIZE + i : check_rand();
+
+        expected = tok_mask_scalar(block, TOK_BLOCK_SIZE);
+        mask = tok_mask_block(block);
+
+        CHECK(mask == expected);
+        check_digest(&mask, sizeof(mask));
+
+#ifdef TOK_X86
+        CHECK((tok_mask_sse2(block) | (tok_mask_sse2(block + 16) << 16)) == expected);
+
+        if (tok_has_avx2())
+            CHECK(tok_mask_avx2(block) == expected);
+#endif
+    }
+}
+
+/*
+ * tok_fold() against a byte at a time fold without the ASCII fast paths.
+ */
+static size_t check_fold_reference(char *dst, const char *src, size_t length)
+{
+    const unsigned char *s = (const unsigned char *)src;
+
+    size_t i = 0, o = 0, n;
+
+    uint32_t cp;
+
+    while (i < length) {
+        if (s[i] < 0x80) {
+            dst[o++] = tok_lower_ascii(src[i++]);
+        }
+        else if ((n = tok_decode_utf8(s + i, length - i, &cp)) == 0) {
+            dst[o++] = src[i++];
+        }
+        else {
+            i += n;
+
+            if ((cp = tok_fold_code_point(cp)) != 0)
+                o += tok_encode_utf8(dst + o, cp);
+        }
+    }
+
+    return o;
+}
+
+static void check_fold()
+{
+    char str[CHECK_MAX_LENGTH], out[CHECK_MAX_LENGTH * 3 / 2 + 1], expected[CHECK_MAX_LENGTH * 3 / 2 + 1];
+
+    size_t length, n, n_expected, offset;
+
+    int round;
+
+    for (round = 0; round < 20000; round++) {
+        length = check_pick_string(str);
+
+        /* start anywhere, so blocks are not aligned with the ASCII runs */
+        offset = (length > 0) ? check_rand() % length : 0;
+
+        n = tok_fold(out, str + offset, length - offset);
+        n_expected = check_fold_reference(expected, str + offset, length - offset);
+
+        CHECK(n == n_expected && memcmp(out, expected, n) == 0);
+        check_digest(out, n);
+        CHECK(n <= (length - offset) * 3 / 2);
+    }
+}
+
+/*
+ * tok_spans() against runs of tok_is_token_byte(), including when there
+ * are more tokens than spans.
+ */
+static void check_spans()
+{
+    char str[CHECK_MAX_LENGTH];
+
+    struct tok_span spans[CHECK_MAX_LENGTH / 2 + 1], expected[CHECK_MAX_LENGTH / 2 + 1];
+
+    size_t length, i, n, n_expected, max;
+
+    int round;
+
+    for (round = 0; round < 20000; round++) {
+        length = check_pick_string(str);
+
+        for (i = 0, n_expected = 0; i < length; ) {
+            for (; i < length && !tok_is_token_byte(str[i]); i++)
+                ;
+
+            if (i == length)
+                break;
+
+            expected[n_expected].start = i;
+
+            for (; i < length && tok_is_token_byte(str[i]); i++)
+                ;
+
+            expected[n_expected].length = i - expected[n_expected].start;
+            n_expected++;
+        }
+
+        max = (round % 2 == 0) ? length / 2 + 1 : n_expected / 2;
+
+        CHECK(n_expected <= length / 2 + 1);
+
+        n = tok_spans(str, length, spans, max);
+
+        CHECK(n == n_expected);
+        check_digest(spans, (n < max ? n : max) * sizeof(struct tok_span));
+
+        for (i = 0; i < n && i < n_expected && i < max; i++)
+            CHECK(spans[i].start == expected[i].start && spans[i].length == expected[i].length);
+    }
+}
+
+int main()
+{
+    check_masks();
+    check_fold();
+    check_spans();
+
+    return check_report("tok_tests");
+}